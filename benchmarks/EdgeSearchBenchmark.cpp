@@ -0,0 +1,210 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @file
+ * Micro-benchmark of the edge search used by the edge-based pose refinement.
+ *
+ * Measures the time per edgel for projecting the edgels of a marker, searching the edge along the
+ * normal and computing the residual. EdgeListMeasurementFunction is compared with a reference that
+ * does the same in the previous formulation with uBLAS vectors in double precision and a line buffer
+ * on the heap for every edgel. Both use the same line sampling.
+ *
+ * Usage: EdgeSearchBenchmark [-n iterations]
+ *   -n  number of timed repetitions per configuration (default 2000)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <boost/scoped_array.hpp>
+#include <opencv2/core/core.hpp>
+
+#include <utMath/Vector.h>
+#include <utMath/Matrix.h>
+#include <utMath/Pose.h>
+#include <utAlgorithm/Projection.h>
+#include <utVision/Image.h>
+#include <utVision/MarkerDetection.h>
+#include <utVision/EdgeExtraction.h>
+#include <utVision/EdgeMeasurement.h>
+#include "SyntheticMarkers.h"
+
+using namespace Ubitrack;
+using namespace Ubitrack::Vision;
+using namespace Ubitrack::Vision::Benchmark;
+
+namespace ublas = boost::numeric::ublas;
+
+namespace {
+
+/** edge search and residuals as computed before, with uBLAS temporaries for every edgel */
+template< class MaximumT, class GradientT >
+double referenceEdgeSearch( Image& img, const std::vector< Math::Vector< float, 3 > >& p3d,
+	const std::vector< Math::Vector< float, 3 > >& p3d2, const Math::Matrix< double, 3, 3 >& K, 
+	const Math::Pose& pose, int searchPixels )
+{
+	double fResidual = 0;
+	for ( std::size_t i = 0; i < p3d.size(); i++ )
+	{
+		const Math::Vector< double, 3 > h1( ublas::prod( K, pose * Math::Vector< double, 3 >( p3d[ i ]( 0 ), p3d[ i ]( 1 ), p3d[ i ]( 2 ) ) ) );
+		const Math::Vector< double, 3 > h2( ublas::prod( K, pose * Math::Vector< double, 3 >( p3d2[ i ]( 0 ), p3d2[ i ]( 1 ), p3d2[ i ]( 2 ) ) ) );
+		const Math::Vector< double, 2 > p2d( h1( 0 ) / h1( 2 ), h1( 1 ) / h1( 2 ) );
+		const Math::Vector< double, 2 > p2d2( h2( 0 ) / h2( 2 ), h2( 1 ) / h2( 2 ) );
+
+		Math::Vector< double, 2 > dir( p2d2 - p2d );
+		dir /= ublas::norm_2( dir );
+		Math::Vector< double, 2 > normal( dir( 1 ), -dir( 0 ) );
+		if ( img.origin() )
+			normal *= -1;
+
+		boost::scoped_array< int > pBuffer( new int[ 2 * searchPixels + 1 ] );
+		GradientT().sample( img, pBuffer.get(), Math::Vector< float, 2 >( p2d ), Math::Vector< float, 2 >( normal ), searchPixels );
+
+		MaximumT max;
+		for ( int j = 1; j < 2 * searchPixels; j++ )
+			max.compare( j, pBuffer[ j ] );
+		double fMaxSubPix = max.index - searchPixels;
+		const double a = 0.5 * ( pBuffer[ max.index - 1 ] + pBuffer[ max.index + 1 ] ) - pBuffer[ max.index ];
+		const double b = 0.5 * ( pBuffer[ max.index + 1 ] - pBuffer[ max.index - 1 ] );
+		if ( a != 0 && fabs( b ) <= fabs( a * 10 ) )
+			fMaxSubPix -= b / ( 2 * a );
+
+		const Math::Vector< double, 2 > edgePoint( p2d + normal * fMaxSubPix );
+		const double fResult = ublas::inner_prod( normal, p2d - edgePoint );
+		fResidual += fResult * fResult;
+	}
+	return fResidual;
+}
+
+
+/** edge search and residuals with EdgeListMeasurementFunction */
+template< class T >
+double measurementEdgeSearch( Image& img, const std::vector< Math::Vector< T, 3 > >& p3d,
+	const std::vector< Math::Vector< T, 3 > >& p3d2, const Math::Matrix< T, 3, 3 >& K, 
+	const Math::Vector< T, 7 >& poseVector, int searchPixels, Math::Vector< T >& result )
+{
+	Math::Matrix< T, 2, 2 > scale( Math::Matrix< T, 2, 2 >::zeros() );
+	scale( 0, 0 ) = scale( 1, 1 ) = T( searchPixels * searchPixels );
+	EdgeListMeasurementFunction< T, FindEdgePositiveMaximum, ExtractLineSobel > edgeMF( p3d, p3d2, K, scale, img );
+	edgeMF.evaluate( result, poseVector );
+	return ublas::inner_prod( result, result );
+}
+
+
+double seconds( int64 ticks )
+{ return double( ticks ) / cv::getTickFrequency(); }
+
+} // anonymous namespace
+
+
+int main( int argc, char** argv )
+{
+	int nIterations = 2000;
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !strcmp( argv[ i ], "-n" ) && i + 1 < argc )
+			nIterations = std::max( 1, atoi( argv[ ++i ] ) );
+		else
+		{
+			std::cerr << "Usage: " << argv[ 0 ] << " [-n iterations]" << std::endl;
+			return 1;
+		}
+	}
+
+	// one marker in the middle of a frame
+	const int width = 1280;
+	const int height = 720;
+	const float fSize = 0.1f;
+	cv::RNG rng( 0x5eed );
+	RenderSettings settings;
+	const Math::Matrix< float, 3, 3 > K( syntheticIntrinsics( width, height ) );
+	const std::vector< SyntheticMarker > markers( layoutMarkers( std::vector< unsigned long long int >( 1, 0x272 ), 
+		width, height, K, fSize, 30.0, rng ) );
+	cv::Mat frame( renderFrame( markers, width, height, K, settings, rng ) );
+	Image img( frame );
+	img.Mat();
+
+	// the edge search works on top-down image coordinates
+	Math::Matrix< float, 3, 3 > correctedK( K );
+	Algorithm::correctOrigin( correctedK, img.origin(), img.height() );
+	Math::Matrix< double, 3, 3 > correctedKd;
+	for ( unsigned i = 0; i < 3; i++ )
+		for ( unsigned j = 0; j < 3; j++ )
+			correctedKd( i, j ) = correctedK( i, j );
+
+	std::vector< Math::Vector< float, 3 > > edgels1;
+	std::vector< Math::Vector< float, 3 > > edgels2;
+	Markers::computeMarkerEdgels( markers[ 0 ].nCode, fSize, edgels1, edgels2, settings.iCodeSize, settings.iMarkerSize, 0xFFFF, true );
+	std::vector< Math::Vector< double, 3 > > edgels1d;
+	std::vector< Math::Vector< double, 3 > > edgels2d;
+	for ( std::size_t i = 0; i < edgels1.size(); i++ )
+	{
+		edgels1d.push_back( Math::Vector< double, 3 >( edgels1[ i ]( 0 ), edgels1[ i ]( 1 ), edgels1[ i ]( 2 ) ) );
+		edgels2d.push_back( Math::Vector< double, 3 >( edgels2[ i ]( 0 ), edgels2[ i ]( 1 ), edgels2[ i ]( 2 ) ) );
+	}
+
+	// search around a pose that is slightly off
+	const Math::Pose pose( markers[ 0 ].pose.rotation(), markers[ 0 ].pose.translation() + Math::Vector< double, 3 >( 0.001, -0.001, 0.002 ) );
+	Math::Vector< float, 7 > poseVector;
+	pose.toVector( poseVector );
+	Math::Vector< double, 7 > poseVectord;
+	pose.toVector( poseVectord );
+	Math::Vector< float > result( edgels1.size() );
+	Math::Vector< double > resultd( edgels1.size() );
+
+	std::cout << edgels1.size() << " edgels, times per edgel" << std::endl;
+	const int searchLengths[] = { 2, 4, 8, 16 };
+	for ( int s = 0; s < 4; s++ )
+	{
+		const int searchPixels = searchLengths[ s ];
+		double fCheck = 0;
+
+		int64 start = cv::getTickCount();
+		for ( int i = 0; i < nIterations; i++ )
+			fCheck += referenceEdgeSearch< FindEdgePositiveMaximum, ExtractLineSobel >( img, edgels1, edgels2, correctedKd, pose, searchPixels );
+		const double fReference = seconds( cv::getTickCount() - start );
+
+		start = cv::getTickCount();
+		for ( int i = 0; i < nIterations; i++ )
+			fCheck += measurementEdgeSearch( img, edgels1, edgels2, correctedK, poseVector, searchPixels, result );
+		const double fFloat = seconds( cv::getTickCount() - start );
+
+		start = cv::getTickCount();
+		for ( int i = 0; i < nIterations; i++ )
+			fCheck += measurementEdgeSearch( img, edgels1d, edgels2d, correctedKd, poseVectord, searchPixels, resultd );
+		const double fDouble = seconds( cv::getTickCount() - start );
+
+		const double fScale = 1e9 / ( double( nIterations ) * edgels1.size() );
+		std::cout << "  search +-" << std::setw( 2 ) << searchPixels << " px: " << std::fixed << std::setprecision( 1 )
+			<< "reference " << std::setw( 7 ) << fReference * fScale << " ns, "
+			<< "float " << std::setw( 7 ) << fFloat * fScale << " ns, "
+			<< "double " << std::setw( 7 ) << fDouble * fScale << " ns"
+			<< "  (" << std::setprecision( 2 ) << fReference / std::max( 1e-12, fFloat ) << "x, checksum " << std::setprecision( 3 ) << fCheck << ")" << std::endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @file
+ * Benchmark of the marker detection on synthetic frames.
+ *
+ * Renders frames with markers at known poses for several resolutions, marker counts and image
+ * degradations, and reports the latency distribution of the individual detection stages, as measured
+ * by DetectionStatistics, as well as the detection rate and pose accuracy against the ground truth.
+ *
+ * Usage: MarkerDetectionBenchmark [-n frames] [-q] [-p]
+ *   -n  number of timed frames per scenario (default 50)
+ *   -q  quick mode, only the smaller resolutions and marker counts
+ *   -p  decode candidates and refine poses in parallel
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+#include <utVision/Image.h>
+#include <utVision/MarkerDetection.h>
+#include <utVision/MarkerDictionary.h>
+#include "SyntheticMarkers.h"
+
+#ifdef HAVE_LAPACK
+
+using namespace Ubitrack;
+using namespace Ubitrack::Vision;
+using namespace Ubitrack::Vision::Markers;
+using namespace Ubitrack::Vision::Benchmark;
+
+namespace {
+
+/** collects the timings of one stage in milliseconds */
+class StageTimes
+{
+public:
+	StageTimes( const std::string& name )
+		: m_name( name )
+	{}
+
+	void add( double fTime )
+	{ m_times.push_back( fTime ); }
+
+	double percentile( double p )
+	{
+		if ( m_times.empty() )
+			return 0.0;
+		std::sort( m_times.begin(), m_times.end() );
+		const std::size_t i = std::min( m_times.size() - 1, static_cast< std::size_t >( p * m_times.size() ) );
+		return m_times[ i ];
+	}
+
+	void print()
+	{
+		std::cout << "  " << std::left << std::setw( 18 ) << m_name << std::right << std::fixed << std::setprecision( 3 )
+			<< " p50 " << std::setw( 9 ) << percentile( 0.5 )
+			<< " p90 " << std::setw( 9 ) << percentile( 0.9 )
+			<< " p99 " << std::setw( 9 ) << percentile( 0.99 )
+			<< " max " << std::setw( 9 ) << percentile( 1.0 ) << " ms" << std::endl;
+	}
+
+protected:
+	std::string m_name;
+	std::vector< double > m_times;
+};
+
+
+struct Scenario
+{
+	int width;
+	int height;
+	int nMarkers;
+	const char* variant;
+	RenderSettings settings;
+};
+
+
+/** runs one scenario and prints its results */
+void runScenario( const Scenario& scenario, const MarkerDictionary& dictionary, int nFrames, bool bParallel )
+{
+	const int nWarmup = 3;
+	const float fSize = 0.06f;
+	cv::RNG rng( 0x5eed );
+
+	const Math::Matrix< float, 3, 3 > K( syntheticIntrinsics( scenario.width, scenario.height ) );
+	const std::vector< unsigned long long int > codes( dictionary.codes().begin(), dictionary.codes().begin() + scenario.nMarkers );
+
+	std::vector< StageTimes > stageTimes;
+	for ( int i = 0; i < DetectionStatistics::EStageCount; i++ )
+		stageTimes.push_back( StageTimes( DetectionStatistics::stageName( DetectionStatistics::Stage( i ) ) ) );
+	StageTimes tDetect( "detectMarkers" );
+	StageTimes tRefine( "refine only" );
+
+	DetectionContext context;
+	DetectionStatistics stats;
+	DetectionOptions options;
+	options.pContext = &context;
+	options.pStatistics = &stats;
+	options.bParallelDecoding = bParallel;
+	options.bParallelRefinement = bParallel;
+
+	double fTotalTime = 0.0;
+	DetectionStatistics totals;
+	std::size_t nExpected = 0;
+	std::size_t nDetected = 0;
+	std::size_t nPoses = 0;
+	double fSumT = 0.0, fMaxT = 0.0, fSumR = 0.0, fMaxR = 0.0;
+
+	for ( int iFrame = 0; iFrame < nWarmup + nFrames; iFrame++ )
+	{
+		const bool bTimed = iFrame >= nWarmup;
+		const std::vector< SyntheticMarker > markers( layoutMarkers( codes, scenario.width, scenario.height, K, fSize, 40.0, rng ) );
+		cv::Mat frame( renderFrame( markers, scenario.width, scenario.height, K, scenario.settings, rng ) );
+		Image img( frame );
+
+		// complete detection of all markers, followed by a refinement of the found poses
+		MarkerInfoMap infos;
+		for ( std::size_t i = 0; i < codes.size(); i++ )
+			infos[ codes[ i ] ] = MarkerInfo( fSize );
+
+		detectMarkers( img, infos, K, 0, false, scenario.settings.iCodeSize, scenario.settings.iMarkerSize,
+			0xFFFF, true, true, 120, options );
+		DetectionStatistics frameStats( stats );
+		const double fDetectTime = stats.fTotalTime;
+
+		detectMarkers( img, infos, K, 0, true, scenario.settings.iCodeSize, scenario.settings.iMarkerSize,
+			0xFFFF, true, true, 120, options );
+		frameStats.add( stats );
+
+		if ( !bTimed )
+			continue;
+
+		for ( int i = 0; i < DetectionStatistics::EStageCount; i++ )
+			stageTimes[ i ].add( frameStats.stageTimes[ i ] );
+		tDetect.add( fDetectTime );
+		tRefine.add( stats.fTotalTime );
+		fTotalTime += fDetectTime;
+		totals.add( frameStats );
+
+		for ( std::vector< SyntheticMarker >::const_iterator it = markers.begin(); it != markers.end(); it++ )
+		{
+			nExpected++;
+			MarkerInfoMap::const_iterator itInfo = infos.find( it->nCode );
+			if ( itInfo == infos.end() || itInfo->second.found == MarkerInfo::ENotFound )
+				continue;
+
+			nDetected++;
+			if ( itInfo->second.refinement == MarkerInfo::ECorners )
+				continue;
+
+			nPoses++;
+			const double fT = translationError( itInfo->second.pose, it->pose );
+			const double fR = rotationError( itInfo->second.pose, it->pose );
+			fSumT += fT;
+			fSumR += fR;
+			fMaxT = std::max( fMaxT, fT );
+			fMaxR = std::max( fMaxR, fR );
+		}
+	}
+
+	std::cout << scenario.width << "x" << scenario.height << ", " << scenario.nMarkers << " markers, " << scenario.variant << ": "
+		<< std::fixed << std::setprecision( 1 ) << ( 1000.0 * nFrames / std::max( 1e-6, fTotalTime ) ) << " frames/s, "
+		<< "detected " << std::setprecision( 1 ) << ( 100.0 * nDetected / std::max< std::size_t >( 1, nExpected ) ) << "%" << std::endl;
+	for ( std::vector< StageTimes >::iterator it = stageTimes.begin(); it != stageTimes.end(); it++ )
+		it->print();
+	tDetect.print();
+	tRefine.print();
+	std::cout << "  per frame          " << std::setprecision( 1 )
+		<< double( totals.nCandidates ) / nFrames << " candidates, "
+		<< double( totals.nRejectedCorners ) / nFrames << " rejected corners, "
+		<< double( totals.nRejectedCodes ) / nFrames << " rejected codes, "
+		<< double( totals.nLMIterations ) / nFrames << " LM iterations, "
+		<< double( totals.nFlips ) / nFrames << " flips" << std::endl;
+	if ( nPoses )
+		std::cout << "  pose error         translation mean " << std::setprecision( 2 ) << 1000.0 * fSumT / nPoses << " max " << 1000.0 * fMaxT
+			<< " mm, rotation mean " << fSumR / nPoses << " max " << fMaxR << " deg" << std::endl;
+}
+
+} // anonymous namespace
+
+
+int main( int argc, char** argv )
+{
+	int nFrames = 50;
+	bool bQuick = false;
+	bool bParallel = false;
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !strcmp( argv[ i ], "-n" ) && i + 1 < argc )
+			nFrames = std::max( 1, atoi( argv[ ++i ] ) );
+		else if ( !strcmp( argv[ i ], "-q" ) )
+			bQuick = true;
+		else if ( !strcmp( argv[ i ], "-p" ) )
+			bParallel = true;
+		else
+		{
+			std::cerr << "Usage: " << argv[ 0 ] << " [-n frames] [-q] [-p]" << std::endl;
+			return 1;
+		}
+	}
+
+	MarkerDictionary dictionary( 4, 0xFFFF );
+	dictionary.generate( 200, 3 );
+
+	const int resolutions[][ 2 ] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+	const int markerCounts[] = { 1, 10, 50, 200 };
+	const int nResolutions = bQuick ? 2 : 4;
+	const int nMarkerCounts = bQuick ? 2 : 4;
+
+	for ( int r = 0; r < nResolutions; r++ )
+		for ( int m = 0; m < nMarkerCounts; m++ )
+		{
+			if ( static_cast< std::size_t >( markerCounts[ m ] ) > dictionary.size() )
+				continue;
+
+			for ( int v = 0; v < 3; v++ )
+			{
+				Scenario scenario;
+				scenario.width = resolutions[ r ][ 0 ];
+				scenario.height = resolutions[ r ][ 1 ];
+				scenario.nMarkers = markerCounts[ m ];
+				scenario.variant = "clean";
+				if ( v == 1 )
+				{
+					scenario.variant = "noise";
+					scenario.settings.fNoiseSigma = 8.0;
+				}
+				else if ( v == 2 )
+				{
+					scenario.variant = "blur";
+					scenario.settings.fBlurSigma = 1.5;
+				}
+
+				runScenario( scenario, dictionary, nFrames, bParallel );
+			}
+		}
+
+	return 0;
+}
+
+#else
+
+#include <iostream>
+
+int main()
+{
+	std::cerr << "The marker detection benchmark requires LAPACK" << std::endl;
+	return 1;
+}
+
+#endif
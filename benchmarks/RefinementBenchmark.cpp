@@ -0,0 +1,189 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @file
+ * Regression benchmark for the cost of the edge-based pose refinement.
+ *
+ * The same set of markers, with the same size in pixels, is rendered into frames of increasing
+ * resolution. The markers are detected once and then refined repeatedly in the refinement only mode
+ * of detectMarkers. As the refinement only samples along the marker edgels, the time per refined
+ * marker must not grow with the size of the frame.
+ *
+ * Usage: RefinementBenchmark [-n iterations] [-m markers] [-t ratio]
+ *   -n  number of timed refinements per resolution (default 100)
+ *   -m  number of markers (default 20)
+ *   -t  fails if the time per marker on any resolution exceeds the one on the smallest by this factor (default 2)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+#include <utVision/Image.h>
+#include <utVision/MarkerDetection.h>
+#include <utVision/MarkerDictionary.h>
+#include "SyntheticMarkers.h"
+
+#ifdef HAVE_LAPACK
+
+using namespace Ubitrack;
+using namespace Ubitrack::Vision;
+using namespace Ubitrack::Vision::Markers;
+using namespace Ubitrack::Vision::Benchmark;
+
+namespace {
+
+/** median of a list of timings */
+double median( std::vector< double > times )
+{
+	if ( times.empty() )
+		return 0.0;
+	std::nth_element( times.begin(), times.begin() + times.size() / 2, times.end() );
+	return times[ times.size() / 2 ];
+}
+
+
+/** 
+ * refines the markers of one frame repeatedly and returns the median time per refined marker in 
+ * milliseconds, or a negative value if the markers were not found
+ */
+double runResolution( int width, int height, const std::vector< unsigned long long int >& codes, int nIterations )
+{
+	const float fSize = 0.06f;
+	const int layoutWidth = 1280;
+	const int layoutHeight = 720;
+	cv::RNG rng( 0x5eed );
+	RenderSettings settings;
+
+	// the markers are laid out in a region of constant size, so their size in pixels does not depend on the resolution
+	const Math::Matrix< float, 3, 3 > K( syntheticIntrinsics( width, height ) );
+	const std::vector< SyntheticMarker > markers( layoutMarkers( codes, layoutWidth, layoutHeight, K, fSize, 30.0, rng ) );
+	cv::Mat frame( renderFrame( markers, width, height, K, settings, rng ) );
+	Image img( frame );
+
+	MarkerInfoMap detected;
+	for ( std::size_t i = 0; i < codes.size(); i++ )
+		detected[ codes[ i ] ] = MarkerInfo( fSize );
+	detectMarkers( img, detected, K, 0, false, settings.iCodeSize, settings.iMarkerSize );
+
+	DetectionStatistics stats;
+	DetectionOptions options;
+	options.pStatistics = &stats;
+
+	std::vector< double > edgeTimes;
+	std::vector< double > refineTimes;
+	std::size_t nRefined = 0;
+	for ( int i = 0; i < nIterations + 3; i++ )
+	{
+		MarkerInfoMap infos( detected );
+		detectMarkers( img, infos, K, 0, true, settings.iCodeSize, settings.iMarkerSize,
+			0xFFFF, true, true, 120, options );
+
+		nRefined = stats.nEdgeRefinements;
+		if ( i < 3 || !nRefined )
+			continue;
+
+		edgeTimes.push_back( stats.stageTimes[ DetectionStatistics::EEdgeRefinement ] / nRefined );
+		refineTimes.push_back( stats.fTotalTime / nRefined );
+	}
+
+	if ( edgeTimes.empty() )
+	{
+		std::cout << "  " << width << "x" << height << ": no markers refined" << std::endl;
+		return -1.0;
+	}
+
+	const double fEdgeTime = median( edgeTimes );
+	std::cout << "  " << std::setw( 4 ) << width << "x" << std::setw( 4 ) << height << ": " << std::setw( 3 ) << nRefined << " markers, "
+		<< std::fixed << std::setprecision( 4 ) << "edge refinement " << fEdgeTime << " ms/marker, refinement only "
+		<< median( refineTimes ) << " ms/marker" << std::endl;
+	return fEdgeTime;
+}
+
+} // anonymous namespace
+
+
+int main( int argc, char** argv )
+{
+	int nIterations = 100;
+	int nMarkers = 20;
+	double fMaxRatio = 2.0;
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !strcmp( argv[ i ], "-n" ) && i + 1 < argc )
+			nIterations = std::max( 1, atoi( argv[ ++i ] ) );
+		else if ( !strcmp( argv[ i ], "-m" ) && i + 1 < argc )
+			nMarkers = std::max( 1, atoi( argv[ ++i ] ) );
+		else if ( !strcmp( argv[ i ], "-t" ) && i + 1 < argc )
+			fMaxRatio = atof( argv[ ++i ] );
+		else
+		{
+			std::cerr << "Usage: " << argv[ 0 ] << " [-n iterations] [-m markers] [-t ratio]" << std::endl;
+			return 1;
+		}
+	}
+
+	MarkerDictionary dictionary( 4, 0xFFFF );
+	dictionary.generate( nMarkers, 3 );
+	const std::vector< unsigned long long int > codes( dictionary.codes().begin(), 
+		dictionary.codes().begin() + std::min< std::size_t >( nMarkers, dictionary.size() ) );
+
+	const int resolutions[][ 2 ] = { { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 }, { 7680, 4320 } };
+	std::cout << "Edge-based refinement of " << codes.size() << " markers" << std::endl;
+
+	double fBaseTime = -1.0;
+	bool bFailed = false;
+	for ( int r = 0; r < 4; r++ )
+	{
+		const double fTime = runResolution( resolutions[ r ][ 0 ], resolutions[ r ][ 1 ], codes, nIterations );
+		if ( fTime < 0.0 )
+			bFailed = true;
+		else if ( fBaseTime < 0.0 )
+			fBaseTime = fTime;
+		else if ( fTime > fMaxRatio * fBaseTime )
+		{
+			std::cout << "  time per marker grows with the resolution: " << std::setprecision( 2 ) << fTime / fBaseTime
+				<< " times the time at " << resolutions[ 0 ][ 0 ] << "x" << resolutions[ 0 ][ 1 ] << std::endl;
+			bFailed = true;
+		}
+	}
+
+	return bFailed ? 1 : 0;
+}
+
+#else
+
+#include <iostream>
+
+int main()
+{
+	std::cerr << "The refinement benchmark requires LAPACK" << std::endl;
+	return 1;
+}
+
+#endif
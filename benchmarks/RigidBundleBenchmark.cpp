@@ -0,0 +1,238 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @file
+ * Benchmark comparing the joint refinement of a RigidMarkerBundle with the separate refinement of its markers.
+ *
+ * Every frame shows a random layout of tilted markers with noise. The markers form a bundle whose frame is 
+ * the camera frame of the layout, so the true bundle pose is the identity. The bundle pose is computed
+ * twice: by RigidMarkerBundle::refinePose after detecting the markers with \c MarkerInfo::EInitialPose, and
+ * from every marker on its own after detecting them with \c MarkerInfo::EEdgeRefinedPose. The benchmark
+ * reports the mean pose errors and the Levenberg-Marquardt iterations per frame of both.
+ *
+ * Usage: RigidBundleBenchmark [-n frames] [-m markers]
+ *   -n  number of frames (default 50)
+ *   -m  number of markers in the bundle (default 12)
+ *
+ * Fails if the bundle pose is not more accurate than the mean single-marker pose or needs more LM iterations.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+#include <utVision/Image.h>
+#include <utVision/MarkerDetection.h>
+#include <utVision/MarkerDictionary.h>
+#include <utVision/RigidMarkerBundle.h>
+#include "SyntheticMarkers.h"
+
+#ifdef HAVE_LAPACK
+
+using namespace Ubitrack;
+using namespace Ubitrack::Vision;
+using namespace Ubitrack::Vision::Markers;
+using namespace Ubitrack::Vision::Benchmark;
+
+namespace {
+
+/** accumulated results of one method */
+struct Result
+{
+	Result()
+		: fRotationError( 0.0 )
+		, fTranslationError( 0.0 )
+		, nPoses( 0 )
+		, nLMIterations( 0 )
+		, fTime( 0.0 )
+	{}
+
+	double fRotationError;
+	double fTranslationError;
+	unsigned nPoses;
+	unsigned nLMIterations;
+	double fTime;
+};
+
+
+double seconds( int64 ticks )
+{
+	return double( ticks ) / cv::getTickFrequency();
+}
+
+
+void print( const char* name, const Result& result, int nFrames )
+{
+	const unsigned nPoses = std::max( result.nPoses, 1u );
+	std::cout << "  " << std::left << std::setw( 20 ) << name << std::right << std::fixed 
+		<< std::setprecision( 3 ) << result.fRotationError / nPoses << " deg, " 
+		<< std::setprecision( 2 ) << 1000.0 * result.fTranslationError / nPoses << " mm, "
+		<< std::setprecision( 1 ) << double( result.nLMIterations ) / nFrames << " LM iterations, "
+		<< std::setprecision( 3 ) << 1000.0 * result.fTime / nFrames << " ms per frame" << std::endl;
+}
+
+} // anonymous namespace
+
+
+int main( int argc, char** argv )
+{
+	int nFrames = 50;
+	int nMarkers = 12;
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !strcmp( argv[ i ], "-n" ) && i + 1 < argc )
+			nFrames = std::max( 1, atoi( argv[ ++i ] ) );
+		else if ( !strcmp( argv[ i ], "-m" ) && i + 1 < argc )
+			nMarkers = std::max( 1, atoi( argv[ ++i ] ) );
+		else
+		{
+			std::cerr << "Usage: " << argv[ 0 ] << " [-n frames] [-m markers]" << std::endl;
+			return 1;
+		}
+	}
+
+	MarkerDictionary dictionary( 4, 0xFFFF );
+	dictionary.generate( nMarkers, 3 );
+	const std::vector< unsigned long long int > codes( dictionary.codes().begin(), 
+		dictionary.codes().begin() + std::min< std::size_t >( nMarkers, dictionary.size() ) );
+
+	const int width = 1280;
+	const int height = 720;
+	const float fSize = 0.06f;
+	const Math::Matrix< float, 3, 3 > K( syntheticIntrinsics( width, height ) );
+	const Math::Pose identity;
+	RenderSettings settings;
+	settings.fNoiseSigma = 8.0;
+	settings.fBlurSigma = 0.8;
+	cv::RNG rng( 0x5eed );
+
+	Result bundleResult;
+	Result singleResult;
+	for ( int frame = 0; frame < nFrames; frame++ )
+	{
+		const std::vector< SyntheticMarker > markers( layoutMarkers( codes, width, height, K, fSize, 50.0, rng ) );
+		cv::Mat pixels( renderFrame( markers, width, height, K, settings, rng ) );
+		Image img( pixels );
+
+		RigidMarkerBundle bundle( settings.iCodeSize, settings.iMarkerSize );
+		for ( std::size_t i = 0; i < markers.size(); i++ )
+			bundle.addMarker( markers[ i ].nCode, markers[ i ].pose, markers[ i ].fSize );
+
+		// joint refinement of the bundle
+		{
+			MarkerInfoMap infos;
+			for ( std::size_t i = 0; i < markers.size(); i++ )
+			{
+				MarkerInfo info( fSize );
+				info.refinement = MarkerInfo::EInitialPose;
+				infos[ markers[ i ].nCode ] = info;
+			}
+
+			DetectionStatistics stats;
+			const int64 start = cv::getTickCount();
+			detectMarkers( img, infos, K, 0, false, settings.iCodeSize, settings.iMarkerSize );
+			Math::Pose pose;
+			const unsigned nUsed = bundle.refinePose( img, infos, K, pose, 0, &stats );
+			bundleResult.fTime += seconds( cv::getTickCount() - start );
+
+			if ( nUsed )
+			{
+				bundleResult.fRotationError += rotationError( pose, identity );
+				bundleResult.fTranslationError += translationError( pose, identity );
+				bundleResult.nPoses++;
+			}
+			bundleResult.nLMIterations += stats.nLMIterations;
+		}
+
+		// separate refinement of every marker
+		{
+			MarkerInfoMap infos;
+			for ( std::size_t i = 0; i < markers.size(); i++ )
+				infos[ markers[ i ].nCode ] = MarkerInfo( fSize );
+
+			DetectionStatistics stats;
+			DetectionOptions options;
+			options.pStatistics = &stats;
+			const int64 start = cv::getTickCount();
+			detectMarkers( img, infos, K, 0, false, settings.iCodeSize, settings.iMarkerSize, 
+				0xFFFF, true, true, 120, options );
+			singleResult.fTime += seconds( cv::getTickCount() - start );
+
+			for ( std::size_t i = 0; i < markers.size(); i++ )
+			{
+				const MarkerInfo& info( infos[ markers[ i ].nCode ] );
+				if ( info.found != MarkerInfo::EFullScanFound )
+					continue;
+
+				// the bundle pose implied by this marker
+				const Math::Pose pose( info.pose * ~markers[ i ].pose );
+				singleResult.fRotationError += rotationError( pose, identity );
+				singleResult.fTranslationError += translationError( pose, identity );
+				singleResult.nPoses++;
+			}
+			singleResult.nLMIterations += stats.nLMIterations;
+		}
+	}
+
+	std::cout << "Bundle of " << codes.size() << " markers, " << nFrames << " frames, mean pose errors:" << std::endl;
+	print( "bundle refinement", bundleResult, nFrames );
+	print( "single markers", singleResult, nFrames );
+
+	bool bFailed = false;
+	if ( bundleResult.nPoses < unsigned( nFrames ) )
+	{
+		std::cout << "  bundle not found in " << nFrames - bundleResult.nPoses << " frames" << std::endl;
+		bFailed = true;
+	}
+	if ( !singleResult.nPoses 
+		|| bundleResult.fRotationError / std::max( bundleResult.nPoses, 1u ) > singleResult.fRotationError / singleResult.nPoses
+		|| bundleResult.fTranslationError / std::max( bundleResult.nPoses, 1u ) > singleResult.fTranslationError / singleResult.nPoses )
+	{
+		std::cout << "  bundle pose is less accurate than the single marker poses" << std::endl;
+		bFailed = true;
+	}
+	if ( bundleResult.nLMIterations >= singleResult.nLMIterations )
+	{
+		std::cout << "  bundle refinement does not save LM iterations" << std::endl;
+		bFailed = true;
+	}
+
+	return bFailed ? 1 : 0;
+}
+
+#else
+
+#include <iostream>
+
+int main()
+{
+	std::cerr << "The rigid bundle benchmark requires LAPACK" << std::endl;
+	return 1;
+}
+
+#endif
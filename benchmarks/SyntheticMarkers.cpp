@@ -0,0 +1,236 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @file
+ * Rendering of synthetic frames with markers at known poses.
+ */
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "SyntheticMarkers.h"
+
+namespace Ubitrack { namespace Vision { namespace Benchmark {
+
+namespace {
+
+	/** homography from the marker plane to bottom-up image coordinates */
+	cv::Matx33d markerHomography( const SyntheticMarker& marker, const Math::Matrix< float, 3, 3 >& K )
+	{
+		const Math::Vector< double, 3 > t( marker.pose * Math::Vector< double, 3 >( 0.0, 0.0, 0.0 ) );
+		const Math::Vector< double, 3 > px( marker.pose * Math::Vector< double, 3 >( 1.0, 0.0, 0.0 ) );
+		const Math::Vector< double, 3 > py( marker.pose * Math::Vector< double, 3 >( 0.0, 1.0, 0.0 ) );
+
+		cv::Matx33d Rt;
+		for ( int i = 0; i < 3; i++ )
+		{
+			Rt( i, 0 ) = px( i ) - t( i );
+			Rt( i, 1 ) = py( i ) - t( i );
+			Rt( i, 2 ) = t( i );
+		}
+
+		cv::Matx33d k;
+		for ( int i = 0; i < 3; i++ )
+			for ( int j = 0; j < 3; j++ )
+				k( i, j ) = K( i, j );
+
+		return k * Rt;
+	}
+
+	/** is the cell black? cells are counted from the top left corner of the marker */
+	bool isBlackCell( unsigned long long int nCode, int u, int v, const RenderSettings& settings )
+	{
+		const int n = settings.iMarkerSize;
+		const int bw = ( settings.iMarkerSize - settings.iCodeSize ) / 2;
+		if ( u < bw || v < bw || u >= n - bw || v >= n - bw )
+			return true;
+
+		// same bit order as readCode
+		const int bit = ( n - bw - v - 1 ) * settings.iCodeSize + ( n - bw - u - 1 );
+		return ( nCode >> bit ) & 1;
+	}
+
+	const float g_fBlack = 25.0f;
+	const float g_fWhite = 230.0f;
+
+}	// anonymous namespace
+
+
+Math::Matrix< float, 3, 3 > syntheticIntrinsics( int width, int height, double fFovDeg )
+{
+	const float f = static_cast< float >( 0.5 * width / tan( 0.5 * fFovDeg * M_PI / 180.0 ) );
+	Math::Matrix< float, 3, 3 > K;
+	K( 0, 0 ) = f;    K( 0, 1 ) = 0.0f; K( 0, 2 ) = -0.5f * ( width - 1 );
+	K( 1, 0 ) = 0.0f; K( 1, 1 ) = f;    K( 1, 2 ) = -0.5f * ( height - 1 );
+	K( 2, 0 ) = 0.0f; K( 2, 1 ) = 0.0f; K( 2, 2 ) = -1.0f;
+	return K;
+}
+
+
+std::vector< SyntheticMarker > layoutMarkers( const std::vector< unsigned long long int >& codes, int width, int height,
+	const Math::Matrix< float, 3, 3 >& K, float fSize, double fMaxTiltDeg, cv::RNG& rng )
+{
+	const int n = static_cast< int >( codes.size() );
+	const int cols = std::max( 1, static_cast< int >( ceil( sqrt( n * double( width ) / height ) ) ) );
+	const int rows = ( n + cols - 1 ) / cols;
+	const double fCell = std::min( double( width ) / cols, double( height ) / rows );
+
+	// distance at which a marker of the default size of 6 cells plus its quiet zone covers 60% of the cell
+	const double f = K( 0, 0 );
+	const double fDistance = f * fSize / ( 0.6 * fCell * 6.0 / 8.0 );
+
+	std::vector< SyntheticMarker > markers;
+	for ( int i = 0; i < n; i++ )
+	{
+		const double u = ( i % cols + 0.5 ) * width / cols;
+		const double row = ( i / cols + 0.5 ) * height / rows;
+		const double v = height - 1 - row;
+
+		const Math::Vector< double, 3 > t(
+			( u + K( 0, 2 ) ) * fDistance / f,
+			( v + K( 1, 2 ) ) * fDistance / f,
+			-fDistance );
+
+		// in-plane rotation followed by a tilt around an axis in the marker plane
+		const double fRoll = rng.uniform( 0.0, 2.0 * M_PI );
+		const double fAxis = rng.uniform( 0.0, 2.0 * M_PI );
+		const double fTilt = rng.uniform( 0.0, fMaxTiltDeg ) * M_PI / 180.0;
+		const Math::Quaternion qRoll( 0.0, 0.0, sin( 0.5 * fRoll ), cos( 0.5 * fRoll ) );
+		const Math::Quaternion qTilt( cos( fAxis ) * sin( 0.5 * fTilt ), sin( fAxis ) * sin( 0.5 * fTilt ), 0.0, cos( 0.5 * fTilt ) );
+
+		SyntheticMarker marker;
+		marker.nCode = codes[ i ];
+		marker.pose = Math::Pose( qTilt * qRoll, t );
+		marker.fSize = fSize;
+		markers.push_back( marker );
+	}
+	return markers;
+}
+
+
+cv::Mat renderFrame( const std::vector< SyntheticMarker >& markers, int width, int height,
+	const Math::Matrix< float, 3, 3 >& K, const RenderSettings& settings, cv::RNG& rng )
+{
+	// smooth background with some texture
+	cv::Mat frame( height, width, CV_32F );
+	const double fPhase = rng.uniform( 0.0, 2.0 * M_PI );
+	for ( int y = 0; y < height; y++ )
+	{
+		float* pRow = frame.ptr< float >( y );
+		for ( int x = 0; x < width; x++ )
+			pRow[ x ] = static_cast< float >( 100.0 + 50.0 * x / width + 15.0 * sin( fPhase + 0.05 * x ) * cos( 0.03 * y ) );
+	}
+
+	const int n = settings.iMarkerSize;
+	const int nSub = std::max( 1, settings.nSubSamples );
+	for ( std::vector< SyntheticMarker >::const_iterator it = markers.begin(); it != markers.end(); it++ )
+	{
+		const cv::Matx33d G( markerHomography( *it, K ) );
+		const cv::Matx33d Ginv( G.inv() );
+
+		// bounding box of the marker and its quiet zone, in top-down coordinates
+		const double fZone = 0.5 * it->fSize * ( n + 2 ) / n;
+		double x0 = width, x1 = 0, y0 = height, y1 = 0;
+		for ( int i = 0; i < 4; i++ )
+		{
+			const cv::Vec3d p( G * cv::Vec3d( ( i & 1 ) ? fZone : -fZone, ( i & 2 ) ? fZone : -fZone, 1.0 ) );
+			if ( p[ 2 ] <= 0 )
+				continue;
+			x0 = std::min( x0, p[ 0 ] / p[ 2 ] );
+			x1 = std::max( x1, p[ 0 ] / p[ 2 ] );
+			y0 = std::min( y0, height - 1 - p[ 1 ] / p[ 2 ] );
+			y1 = std::max( y1, height - 1 - p[ 1 ] / p[ 2 ] );
+		}
+
+		const int ix0 = std::max( 0, static_cast< int >( floor( x0 ) ) - 1 );
+		const int ix1 = std::min( width - 1, static_cast< int >( ceil( x1 ) ) + 1 );
+		const int iy0 = std::max( 0, static_cast< int >( floor( y0 ) ) - 1 );
+		const int iy1 = std::min( height - 1, static_cast< int >( ceil( y1 ) ) + 1 );
+
+		for ( int y = iy0; y <= iy1; y++ )
+		{
+			float* pRow = frame.ptr< float >( y );
+			for ( int x = ix0; x <= ix1; x++ )
+			{
+				float fSum = 0.0f;
+				int nInside = 0;
+				for ( int sy = 0; sy < nSub; sy++ )
+					for ( int sx = 0; sx < nSub; sx++ )
+					{
+						// sample position in bottom-up coordinates
+						const double u = x + ( sx + 0.5 ) / nSub - 0.5;
+						const double v = height - 1 - ( y + ( sy + 0.5 ) / nSub - 0.5 );
+						const cv::Vec3d m( Ginv * cv::Vec3d( u, v, 1.0 ) );
+						const double cu = n * ( m[ 0 ] / m[ 2 ] / it->fSize + 0.5 );
+						const double cv_ = n * ( 0.5 - m[ 1 ] / m[ 2 ] / it->fSize );
+						if ( cu < -1.0 || cv_ < -1.0 || cu >= n + 1.0 || cv_ >= n + 1.0 )
+							continue;
+
+						nInside++;
+						if ( cu >= 0.0 && cv_ >= 0.0 && cu < n && cv_ < n && isBlackCell( it->nCode, static_cast< int >( cu ), static_cast< int >( cv_ ), settings ) )
+							fSum += g_fBlack;
+						else
+							fSum += g_fWhite;
+					}
+
+				if ( nInside )
+					pRow[ x ] = ( fSum + ( nSub * nSub - nInside ) * pRow[ x ] ) / ( nSub * nSub );
+			}
+		}
+	}
+
+	if ( settings.fBlurSigma > 0.0 )
+		cv::GaussianBlur( frame, frame, cv::Size( 0, 0 ), settings.fBlurSigma );
+
+	if ( settings.fNoiseSigma > 0.0 )
+	{
+		cv::Mat noise( height, width, CV_32F );
+		rng.fill( noise, cv::RNG::NORMAL, 0.0, settings.fNoiseSigma );
+		frame += noise;
+	}
+
+	cv::Mat result;
+	frame.convertTo( result, CV_8U );
+	return result;
+}
+
+
+double rotationError( const Math::Pose& a, const Math::Pose& b )
+{
+	const Math::Quaternion& qa( a.rotation() );
+	const Math::Quaternion& qb( b.rotation() );
+	const double fDot = fabs( qa.R_component_1() * qb.R_component_1() + qa.R_component_2() * qb.R_component_2() +
+		qa.R_component_3() * qb.R_component_3() + qa.R_component_4() * qb.R_component_4() );
+	return 2.0 * acos( std::min( 1.0, fDot ) ) * 180.0 / M_PI;
+}
+
+
+double translationError( const Math::Pose& a, const Math::Pose& b )
+{
+	const Math::Vector< double, 3 > d( a.translation() - b.translation() );
+	return sqrt( d( 0 ) * d( 0 ) + d( 1 ) * d( 1 ) + d( 2 ) * d( 2 ) );
+}
+
+} } } // namespace Ubitrack::Vision::Benchmark
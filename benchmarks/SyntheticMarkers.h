@@ -0,0 +1,107 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @file
+ * Rendering of synthetic frames with markers at known poses, used by the benchmarks.
+ */
+
+#ifndef __UBITRACK_VISION_BENCHMARK_SYNTHETICMARKERS_H_INCLUDED__
+#define __UBITRACK_VISION_BENCHMARK_SYNTHETICMARKERS_H_INCLUDED__
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <utMath/Matrix.h>
+#include <utMath/Pose.h>
+
+namespace Ubitrack { namespace Vision { namespace Benchmark {
+
+/** a marker in a synthetic frame */
+struct SyntheticMarker
+{
+	/** normalized marker code */
+	unsigned long long int nCode;
+
+	/** ground truth pose, in the camera coordinate frame used by detectMarkers */
+	Math::Pose pose;
+
+	/** side length of the marker in meters */
+	float fSize;
+};
+
+/** how frames are rendered */
+struct RenderSettings
+{
+	RenderSettings()
+		: iCodeSize( 4 )
+		, iMarkerSize( 6 )
+		, fNoiseSigma( 0.0 )
+		, fBlurSigma( 0.0 )
+		, nSubSamples( 4 )
+	{}
+
+	/** size of the marker's bit pattern and overall size in bits, as passed to detectMarkers */
+	unsigned int iCodeSize;
+	unsigned int iMarkerSize;
+
+	/** standard deviation of additive gaussian noise in grey levels, 0 for none */
+	double fNoiseSigma;
+
+	/** standard deviation of the gaussian blur in pixels, 0 for none */
+	double fBlurSigma;
+
+	/** samples per pixel and axis for anti-aliasing the marker edges */
+	int nSubSamples;
+};
+
+/**
+ * Returns a camera matrix for the given resolution and horizontal field of view in the convention of
+ * Ubitrack (camera looks along -z, image y-axis points up), as expected by detectMarkers.
+ */
+Math::Matrix< float, 3, 3 > syntheticIntrinsics( int width, int height, double fFovDeg = 60.0 );
+
+/**
+ * Places markers in a grid over the image, each with a random in-plane rotation and a random tilt
+ * of up to \c fMaxTiltDeg degrees. The markers fill about 60% of their grid cell.
+ *
+ * @param codes codes of the markers, one marker is placed per code
+ */
+std::vector< SyntheticMarker > layoutMarkers( const std::vector< unsigned long long int >& codes, int width, int height,
+	const Math::Matrix< float, 3, 3 >& K, float fSize, double fMaxTiltDeg, cv::RNG& rng );
+
+/**
+ * Renders markers in front of a textured background into a new grey-scale frame with y-coordinate 0 on top.
+ * Each marker gets a white quiet zone of one cell.
+ */
+cv::Mat renderFrame( const std::vector< SyntheticMarker >& markers, int width, int height,
+	const Math::Matrix< float, 3, 3 >& K, const RenderSettings& settings, cv::RNG& rng );
+
+/** rotation angle in degrees between the rotations of two poses */
+double rotationError( const Math::Pose& a, const Math::Pose& b );
+
+/** distance between the translations of two poses */
+double translationError( const Math::Pose& a, const Math::Pose& b );
+
+} } } // namespace Ubitrack::Vision::Benchmark
+
+#endif
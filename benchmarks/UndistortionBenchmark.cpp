@@ -0,0 +1,159 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+
+/**
+ * @file
+ * Benchmark of the image preprocessing with Undistortion.
+ *
+ * Compares the separate steps \c CvtColor, \c undistort and \c PyrDown or \c Scale, each writing a
+ * full intermediate image, with \c undistortGrey, which produces the undistorted grey image and its
+ * half-resolution version in one pass over a BGR frame. Also reports the largest difference between
+ * the grey images of both variants.
+ *
+ * Usage: UndistortionBenchmark [-n frames] [-f]
+ *   -n  number of timed frames per resolution (default 100)
+ *   -f  fixed-point maps instead of float maps
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <utMath/Vector.h>
+#include <utMath/Matrix.h>
+#include <utMath/CameraIntrinsics.h>
+#include <utVision/Image.h>
+#include <utVision/Undistortion.h>
+#include "SyntheticMarkers.h"
+
+using namespace Ubitrack;
+using namespace Ubitrack::Vision;
+using namespace Ubitrack::Vision::Benchmark;
+
+namespace {
+
+double seconds( int64 ticks )
+{ return double( ticks ) / cv::getTickFrequency(); }
+
+
+/** intrinsics of a lens with moderate barrel distortion */
+Math::CameraIntrinsics< double > distortedIntrinsics( int width, int height )
+{
+	const Math::Matrix< float, 3, 3 > Kf( syntheticIntrinsics( width, height ) );
+	Math::Matrix< double, 3, 3 > K;
+	for ( int i = 0; i < 3; i++ )
+		for ( int j = 0; j < 3; j++ )
+			K( i, j ) = Kf( i, j );
+
+	Math::Vector< double, 6 > radial( Math::Vector< double, 6 >::zeros() );
+	radial( 0 ) = -0.25;
+	radial( 1 ) = 0.08;
+	Math::Vector< double, 2 > tangential( 0.001, -0.0005 );
+	return Math::CameraIntrinsics< double >( K, radial, tangential );
+}
+
+
+void runResolution( int width, int height, int nFrames, Undistortion::MapFormat format )
+{
+	Undistortion undistorter( distortedIntrinsics( width, height ) );
+	undistorter.setMapFormat( format );
+
+	cv::RNG rng( 0x5eed );
+	cv::Mat frame( height, width, CV_8UC3 );
+	rng.fill( frame, cv::RNG::UNIFORM, 0, 256 );
+	cv::GaussianBlur( frame, frame, cv::Size( 5, 5 ), 1.5 );
+	Image img( frame );
+	img.set_pixelFormat( Image::BGR );
+
+	// build the maps before timing
+	undistorter.undistortGrey( img );
+
+	double fPyrDown = 0.0, fScale = 0.0, fFused = 0.0;
+	double fMaxDiff = 0.0;
+	for ( int i = 0; i < nFrames; i++ )
+	{
+		int64 start = cv::getTickCount();
+		Image::Ptr pGrey( undistorter.undistort( img.CvtColor( cv::COLOR_BGR2GRAY, 1 ) ) );
+		Image::Ptr pHalf( pGrey->PyrDown() );
+		fPyrDown += seconds( cv::getTickCount() - start );
+
+		start = cv::getTickCount();
+		pGrey = undistorter.undistort( img.CvtColor( cv::COLOR_BGR2GRAY, 1 ) );
+		pHalf = pGrey->Scale( width / 2, height / 2 );
+		fScale += seconds( cv::getTickCount() - start );
+
+		start = cv::getTickCount();
+		Image::Ptr pFusedHalf;
+		Image::Ptr pFused( undistorter.undistortGrey( img, pFusedHalf ) );
+		fFused += seconds( cv::getTickCount() - start );
+
+		cv::Mat diff;
+		cv::absdiff( pGrey->Mat(), pFused->Mat(), diff );
+		double fMin, fMax;
+		cv::minMaxLoc( diff, &fMin, &fMax );
+		fMaxDiff = std::max( fMaxDiff, fMax );
+	}
+
+	const double fScaleMs = 1000.0 / nFrames;
+	std::cout << "  " << std::setw( 4 ) << width << "x" << std::setw( 4 ) << height << ": " << std::fixed << std::setprecision( 2 )
+		<< "separate+PyrDown " << std::setw( 6 ) << fPyrDown * fScaleMs << " ms, "
+		<< "separate+Scale " << std::setw( 6 ) << fScale * fScaleMs << " ms, "
+		<< "fused " << std::setw( 6 ) << fFused * fScaleMs << " ms"
+		<< "  (" << std::setprecision( 2 ) << fScale / std::max( 1e-12, fFused ) << "x, max grey difference " 
+		<< std::setprecision( 0 ) << fMaxDiff << ")" << std::endl;
+}
+
+} // anonymous namespace
+
+
+int main( int argc, char** argv )
+{
+	int nFrames = 100;
+	Undistortion::MapFormat format = Undistortion::EMapFloat;
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !strcmp( argv[ i ], "-n" ) && i + 1 < argc )
+			nFrames = std::max( 1, atoi( argv[ ++i ] ) );
+		else if ( !strcmp( argv[ i ], "-f" ) )
+			format = Undistortion::EMapFixedPoint;
+		else
+		{
+			std::cerr << "Usage: " << argv[ 0 ] << " [-n frames] [-f]" << std::endl;
+			return 1;
+		}
+	}
+
+	std::cout << "undistortion of BGR frames to grey and half resolution, " 
+		<< ( format == Undistortion::EMapFloat ? "float" : "fixed-point" ) << " maps" << std::endl;
+
+	const int resolutions[][ 2 ] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+	for ( int r = 0; r < 4; r++ )
+		runResolution( resolutions[ r ][ 0 ], resolutions[ r ][ 1 ], nFrames, format );
+
+	return 0;
+}
@@ -30,8 +30,14 @@
  */
 
 #include <math.h>
+#include <algorithm>
 #include <boost/scoped_array.hpp>
 
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define UTVISION_EDGEEXTRACTION_SSE2
+#endif
+
 #include "utVision.h"
 #include "Image.h"
 #include "EdgeExtraction.h"
@@ -86,6 +92,120 @@ int subpixSampleSafe( Image& src, const Math::Vector< float, 2 >& p )
 }
 
 
+/** number of points that are sampled at once by the line functions, bounds their stack buffers */
+static const int g_nSampleChunk = 64;
+
+
+/**
+ * \internal
+ * Computes the buffer offsets of the 2x2 neighbourhood and the interpolation weights of a point.
+ * If \c bSafe is set and the neighbourhood is not completely inside the image, all four offsets point to
+ * the nearest border pixel, which is then returned by the interpolation regardless of the weights.
+ */
+static inline void subpixNeighbourhood( float fx, float fy, int width, int height, int step, bool bSafe, 
+	int* pOffsets, int& dx, int& dy )
+{
+	const float fFloorX = floorf( fx );
+	const float fFloorY = floorf( fy );
+	int x = static_cast< int >( fFloorX );
+	int y = static_cast< int >( fFloorY );
+	dx = static_cast< int >( 256 * ( fx - fFloorX ) );
+	dy = static_cast< int >( 256 * ( fy - fFloorY ) );
+
+	if ( bSafe && ( x < 0 || x >= width - 1 || y < 0 || y >= height - 1 ) )
+	{
+		// continue border pixels
+		x = std::min( std::max( x, 0 ), width - 1 );
+		y = std::min( std::max( y, 0 ), height - 1 );
+		pOffsets[ 0 ] = pOffsets[ 1 ] = pOffsets[ 2 ] = pOffsets[ 3 ] = y * step + x;
+		return;
+	}
+
+	pOffsets[ 0 ] = y * step + x;
+	pOffsets[ 1 ] = pOffsets[ 0 ] + 1;
+	pOffsets[ 2 ] = pOffsets[ 0 ] + step;
+	pOffsets[ 3 ] = pOffsets[ 2 ] + 1;
+}
+
+
+void subpixSamplePoints( Image& src, const float* pX, const float* pY, int nPoints, int* pDst, bool bSafe )
+{
+	const cv::Mat& img( src.Mat() );
+	const unsigned char* pData = img.data;
+	const int step = static_cast< int >( img.step );
+	int i = 0;
+
+#ifdef UTVISION_EDGEEXTRACTION_SSE2
+	// four points at a time: the neighbourhoods are fetched per point, the interpolation is vectorized
+	for ( ; i + 4 <= nPoints; i += 4 )
+	{
+		int offsets[ 4 ][ 4 ];
+		int dx[ 4 ], dy[ 4 ];
+		for ( int k = 0; k < 4; k++ )
+			subpixNeighbourhood( pX[ i + k ], pY[ i + k ], img.cols, img.rows, step, bSafe, offsets[ k ], dx[ k ], dy[ k ] );
+
+		const __m128i vDx = _mm_loadu_si128( reinterpret_cast< const __m128i* >( dx ) );
+		const __m128i vDy = _mm_loadu_si128( reinterpret_cast< const __m128i* >( dy ) );
+		const __m128i v00 = _mm_setr_epi32( pData[ offsets[ 0 ][ 0 ] ], pData[ offsets[ 1 ][ 0 ] ], pData[ offsets[ 2 ][ 0 ] ], pData[ offsets[ 3 ][ 0 ] ] );
+		const __m128i v01 = _mm_setr_epi32( pData[ offsets[ 0 ][ 1 ] ], pData[ offsets[ 1 ][ 1 ] ], pData[ offsets[ 2 ][ 1 ] ], pData[ offsets[ 3 ][ 1 ] ] );
+		const __m128i v10 = _mm_setr_epi32( pData[ offsets[ 0 ][ 2 ] ], pData[ offsets[ 1 ][ 2 ] ], pData[ offsets[ 2 ][ 2 ] ], pData[ offsets[ 3 ][ 2 ] ] );
+		const __m128i v11 = _mm_setr_epi32( pData[ offsets[ 0 ][ 3 ] ], pData[ offsets[ 1 ][ 3 ] ], pData[ offsets[ 2 ][ 3 ] ], pData[ offsets[ 3 ][ 3 ] ] );
+
+		// the weights are below 256 and the differences fit into 16 bits, so the products can be
+		// computed with madd, the upper halves of the weights being zero
+		const __m128i a = _mm_add_epi32( v00, _mm_srai_epi32( _mm_madd_epi16( _mm_sub_epi32( v01, v00 ), vDx ), 8 ) );
+		const __m128i b = _mm_add_epi32( v10, _mm_srai_epi32( _mm_madd_epi16( _mm_sub_epi32( v11, v10 ), vDx ), 8 ) );
+		const __m128i r = _mm_add_epi32( a, _mm_srai_epi32( _mm_madd_epi16( _mm_sub_epi32( b, a ), vDy ), 8 ) );
+		_mm_storeu_si128( reinterpret_cast< __m128i* >( pDst + i ), r );
+	}
+#endif
+
+	for ( ; i < nPoints; i++ )
+	{
+		int offsets[ 4 ];
+		int dx, dy;
+		subpixNeighbourhood( pX[ i ], pY[ i ], img.cols, img.rows, step, bSafe, offsets, dx, dy );
+		const int a = pData[ offsets[ 0 ] ] + ( ( dx * ( pData[ offsets[ 1 ] ] - pData[ offsets[ 0 ] ] ) ) >> 8 );
+		const int b = pData[ offsets[ 2 ] ] + ( ( dx * ( pData[ offsets[ 3 ] ] - pData[ offsets[ 2 ] ] ) ) >> 8 );
+		pDst[ i ] = a + ( ( dy * ( b - a ) ) >> 8 );
+	}
+}
+
+
+void subpixSampleLine( Image& src, int* pDst, const Math::Vector< float, 2 >& start, 
+	const Math::Vector< float, 2 >& step, int nSamples, bool bSafe )
+{
+	float x[ g_nSampleChunk ];
+	float y[ g_nSampleChunk ];
+	float px = start( 0 );
+	float py = start( 1 );
+	for ( int i = 0; i < nSamples; i += g_nSampleChunk )
+	{
+		const int n = std::min( g_nSampleChunk, nSamples - i );
+		for ( int k = 0; k < n; k++ )
+		{
+			x[ k ] = px;
+			y[ k ] = py;
+			px += step( 0 );
+			py += step( 1 );
+		}
+		subpixSamplePoints( src, x, y, n, pDst + i, bSafe );
+	}
+}
+
+
+void subpixSampleLines( Image& src, int* pDst, const Math::Vector< float, 2 >* pStarts, 
+	const Math::Vector< float, 2 >* pSteps, int nLines, int nSamples, bool bSafe )
+{
+	for ( int i = 0; i < nLines; i++ )
+		subpixSampleLine( src, pDst + i * nSamples, pStarts[ i ], pSteps[ i ], nSamples, bSafe );
+}
+
+
+/** length of lines that are sampled without allocating a buffer on the heap */
+static const int g_nStackLine = 256;
+
+
 /**
  * \internal
  * Sample a line centered in a given point with subpixel precision and apply a sobel filter.
@@ -101,39 +221,64 @@ int subpixSampleSafe( Image& src, const Math::Vector< float, 2 >& p )
 void sobelLineSubPix( Image& src, int* pDst, const Math::Vector< float, 2 >& center, 
 	const Math::Vector< float, 2 >& direction, int nExtension )
 {
-	Math::Vector< float, 2 > n, p;
-	n( 0 ) = direction( 1 );
-	n( 1 ) = -direction( 0 );
+	sobelLineSubPix( src, pDst, center( 0 ), center( 1 ), direction( 0 ), direction( 1 ), nExtension );
+}
+
+
+void sobelLineSubPix( Image& src, int* pDst, float fCenterX, float fCenterY, float fDirX, float fDirY, int nExtension )
+{
+	const float fNormalX = fDirY;
+	const float fNormalY = -fDirX;
+	const float fHalf = static_cast< float >( ( nExtension >> 1 ) + 1 );
 
 	// check if one corner is outside the image
 	int t;
 	for ( t = 0; t < 4; t++ )
 	{
-		p = center + ( (t&1) ? -1 : 1 ) * ( ( nExtension >> 1 ) + 1 ) * direction + ( (t&2) ? -1 : 1 ) * n;
-		int x = static_cast< int >( floorf( p( 0 ) ) );
-		int y = static_cast< int >( floorf( p( 1 ) ) );
+		const float fSign1 = (t&1) ? -fHalf : fHalf;
+		const float fSign2 = (t&2) ? -1.0f : 1.0f;
+		int x = static_cast< int >( floorf( fCenterX + fSign1 * fDirX + fSign2 * fNormalX ) );
+		int y = static_cast< int >( floorf( fCenterY + fSign1 * fDirY + fSign2 * fNormalY ) );
 		if ( x < 0 || x >= src.width() - 1 || y < 0 || y >= src.height() - 1 )
 			break;
 	}
+	const bool bSafe = t != 4;
 
-	// sample averaged line into buffer
-	boost::scoped_array< int > buffer( new int[ nExtension + 2 ] );
-	p = center - direction * ( ( nExtension >> 1 ) + 1 );
-	if ( t == 4 )
-		// fast version
-		for ( int i = 0; i < nExtension + 2; i++ )
-		{
-			buffer[ i ] = 2 * subpixSampleFast( src, p ) +	subpixSampleFast( src, p - n ) + subpixSampleFast( src, p + n );
-			p += direction;
-		}
-	else
-		// slow but safe version
-		for ( int i = 0; i < nExtension + 2; i++ )
+	// sample the line and its two neighbours in chunks, averaged into the buffer
+	int stackBuffer[ g_nStackLine + 2 ];
+	boost::scoped_array< int > heapBuffer;
+	int* buffer = stackBuffer;
+	if ( nExtension > g_nStackLine )
+	{
+		heapBuffer.reset( new int[ nExtension + 2 ] );
+		buffer = heapBuffer.get();
+	}
+
+	float px = fCenterX - fDirX * fHalf;
+	float py = fCenterY - fDirY * fHalf;
+	float x[ 3 * g_nSampleChunk ];
+	float y[ 3 * g_nSampleChunk ];
+	int samples[ 3 * g_nSampleChunk ];
+	for ( int i = 0; i < nExtension + 2; i += g_nSampleChunk )
+	{
+		const int nChunk = std::min( g_nSampleChunk, nExtension + 2 - i );
+		for ( int k = 0; k < nChunk; k++ )
 		{
-			buffer[ i ] = 2 * subpixSampleSafe( src, p ) + subpixSampleSafe( src, p - n ) + subpixSampleSafe( src, p + n );
-			p += direction;
+			x[ k ] = px;
+			y[ k ] = py;
+			x[ nChunk + k ] = px - fNormalX;
+			y[ nChunk + k ] = py - fNormalY;
+			x[ 2 * nChunk + k ] = px + fNormalX;
+			y[ 2 * nChunk + k ] = py + fNormalY;
+			px += fDirX;
+			py += fDirY;
 		}
 
+		subpixSamplePoints( src, x, y, 3 * nChunk, samples, bSafe );
+		for ( int k = 0; k < nChunk; k++ )
+			buffer[ i + k ] = 2 * samples[ k ] + samples[ nChunk + k ] + samples[ 2 * nChunk + k ];
+	}
+
 	// apply difference and copy to destination buffer
 	for ( int i = 0; i < nExtension; i++ )
 		pDst[ i ] = ( buffer[ i ] - buffer[ i + 2 ] );
@@ -155,44 +300,50 @@ void sobelLineSubPix( Image& src, int* pDst, const Math::Vector< float, 2 >& cen
 void simpleLineGradient( Image& src, int* pDst, const Math::Vector< float, 2 >& center, 
 	const Math::Vector< float, 2 >& direction, int nExtension )
 {
-	Math::Vector< float, 2 > p;
+	simpleLineGradient( src, pDst, center( 0 ), center( 1 ), direction( 0 ), direction( 1 ), nExtension );
+}
 
+
+void simpleLineGradient( Image& src, int* pDst, float fCenterX, float fCenterY, float fDirX, float fDirY, int nExtension )
+{
 	// check if one end is outside the image
 	int t;
 	for ( t = 0; t < 2; t++ )
 	{
-		p = center + ( (t&1) ? -1 : 1 ) * ( ( nExtension >> 1 ) + 1 ) * direction;
-		int x = static_cast< int >( floorf( p( 0 ) ) );
-		int y = static_cast< int >( floorf( p( 1 ) ) );
+		const float fSign = (t&1) ? -1.0f : 1.0f;
+		const float fHalf = fSign * static_cast< float >( ( nExtension >> 1 ) + 1 );
+		int x = static_cast< int >( floorf( fCenterX + fHalf * fDirX ) );
+		int y = static_cast< int >( floorf( fCenterY + fHalf * fDirY ) );
 		if ( x < 0 || x >= src.width() - 1 || y < 0 || y >= src.height() - 1 )
 			break;
 	}
 
-	// sample line and compute gradient
-	p = center - direction * ( ( nExtension >> 1 ) + 0.5f );
-	if ( t == 2 )
+	// sample line in chunks and compute gradient
+	const bool bSafe = t != 2;
+	const float fStart = ( nExtension >> 1 ) + 0.5f;
+	float px = fCenterX - fDirX * fStart;
+	float py = fCenterY - fDirY * fStart;
+	float x[ g_nSampleChunk ];
+	float y[ g_nSampleChunk ];
+	int samples[ g_nSampleChunk + 1 ];
+	x[ 0 ] = px;
+	y[ 0 ] = py;
+	subpixSamplePoints( src, x, y, 1, samples, bSafe );
+	for ( int i = 0; i < nExtension; i += g_nSampleChunk )
 	{
-		// fast version
-		int lastVal = subpixSampleFast( src, p );
-		for ( int i = 0; i < nExtension; i++ )
+		const int nChunk = std::min( g_nSampleChunk, nExtension - i );
+		for ( int k = 0; k < nChunk; k++ )
 		{
-			p += direction;
-			int thisVal = subpixSampleFast( src, p );
-			pDst[ i ] = lastVal - thisVal;
-			lastVal = thisVal;
-		}
-	}
-	else
-	{
-		// slow but safe version
-		int lastVal = subpixSampleSafe( src, p );
-		for ( int i = 0; i < nExtension; i++ )
-		{
-			p += direction;
-			int thisVal = subpixSampleSafe( src, p );
-			pDst[ i ] = lastVal - thisVal;
-			lastVal = thisVal;
+			px += fDirX;
+			py += fDirY;
+			x[ k ] = px;
+			y[ k ] = py;
 		}
+
+		subpixSamplePoints( src, x, y, nChunk, samples + 1, bSafe );
+		for ( int k = 0; k < nChunk; k++ )
+			pDst[ i + k ] = samples[ k ] - samples[ k + 1 ];
+		samples[ 0 ] = samples[ nChunk ];
 	}
 }
 
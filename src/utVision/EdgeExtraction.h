@@ -33,6 +33,7 @@
 #define __UBITRACK_VISION_EDGEEXTRACTION_H_INCLUDED__
 
 #include <limits.h>
+#include <math.h>
 #include <boost/scoped_array.hpp>
 #include <utVision.h>
 #include <limits.h>
@@ -56,6 +57,10 @@ namespace Ubitrack { namespace Vision {
 UTVISION_EXPORT void sobelLineSubPix( Image& src, int* pDst, const Math::Vector< float, 2 >& center, 
 	const Math::Vector< float, 2 >& direction, int nExtension );
 
+/** sobelLineSubPix with center and direction given as scalars */
+UTVISION_EXPORT void sobelLineSubPix( Image& src, int* pDst, float fCenterX, float fCenterY, 
+	float fDirX, float fDirY, int nExtension );
+
 /**
  * Sample a line centered in a given point with subpixel precision and apply compute the gradient.
  *
@@ -70,6 +75,10 @@ UTVISION_EXPORT void sobelLineSubPix( Image& src, int* pDst, const Math::Vector<
 UTVISION_EXPORT void simpleLineGradient( Image& src, int* pDst, const Math::Vector< float, 2 >& center, 
 	const Math::Vector< float, 2 >& direction, int nExtension );
 
+/** simpleLineGradient with center and direction given as scalars */
+UTVISION_EXPORT void simpleLineGradient( Image& src, int* pDst, float fCenterX, float fCenterY, 
+	float fDirX, float fDirY, int nExtension );
+
 /**
  * Policy class for findEdge: find the edge with the highest positive intensity.
  */
@@ -132,6 +141,9 @@ struct ExtractLineSobel
 	void sample( Image& image, int* pDst, const Math::Vector< float, 2 >& center, 
 		const Math::Vector< float, 2 >& direction, int distance )
 	{ sobelLineSubPix( image, pDst, center, direction, distance * 2 ); }
+
+	void sample( Image& image, int* pDst, float fCenterX, float fCenterY, float fDirX, float fDirY, int distance )
+	{ sobelLineSubPix( image, pDst, fCenterX, fCenterY, fDirX, fDirY, distance * 2 ); }
 };
 
  
@@ -144,32 +156,44 @@ struct ExtractLineSimpleGradient
 	void sample( Image& image, int* pDst, const Math::Vector< float, 2 >& center, 
 		const Math::Vector< float, 2 >& direction, int distance )
 	{ simpleLineGradient( image, pDst, center, direction, distance * 2 ); }
+
+	void sample( Image& image, int* pDst, float fCenterX, float fCenterY, float fDirX, float fDirY, int distance )
+	{ simpleLineGradient( image, pDst, fCenterX, fCenterY, fDirX, fDirY, distance * 2 ); }
 };
 
  
+/** search distance up to which findEdge keeps the sampled line on the stack */
+const int g_nFindEdgeStackDistance = 64;
+
 /**
- * Finds an edge along a line.
+ * Finds an edge along a line, with start point and direction given as scalars.
  *
  * Note: integer coordinates lie at pixel centers.
  * This function does not respect the origin flag and assumes that a y-coordinate of 0 is on top.
  *
  * @param EdgeComparison class to compare edge intensities. Use e.g. \c FindEdgePositiveOnly
  * @param LineExtraction class to extract the line. Use e.g. \c ExtractLineSobel
- * @param T usually float or double
  *
  * @param image image to search for edge in
- * @param start point to start searching (in both directions)
- * @param dir search direction (length determines the )
+ * @param fStartX, fStartY point to start searching (in both directions)
+ * @param fDirX, fDirY search direction (normalized)
  * @param maxDistance maximum distance to search (in pixels)
- * @param response will store the strength of the maximum edge
- * @return the distance of the pixel with maximum response from \c start. Positive values are in the direction of \c dir.
+ * @param maxResponse will store the strength of the maximum edge
+ * @return the distance of the pixel with maximum response from the start. Positive values are in the search direction.
  */
-template< class EdgeComparison, class LineExtraction, class T >
-T findEdge( Image& image, const Math::Vector< T, 2 >& start, const Math::Vector< T, 2 >& dir, int maxDistance, int& maxResponse )
+template< class EdgeComparison, class LineExtraction >
+float findEdge( Image& image, float fStartX, float fStartY, float fDirX, float fDirY, int maxDistance, int& maxResponse )
 {
-	// extract the sampled line
-	boost::scoped_array< int > pBuffer( new int[ 2 * maxDistance + 1 ] );
-	LineExtraction().sample( image, pBuffer.get(), start, dir, maxDistance );
+	// extract the sampled line, short lines without heap allocation
+	int stackBuffer[ 2 * g_nFindEdgeStackDistance + 1 ];
+	boost::scoped_array< int > heapBuffer;
+	int* pBuffer = stackBuffer;
+	if ( maxDistance > g_nFindEdgeStackDistance )
+	{
+		heapBuffer.reset( new int[ 2 * maxDistance + 1 ] );
+		pBuffer = heapBuffer.get();
+	}
+	LineExtraction().sample( image, pBuffer, fStartX, fStartY, fDirX, fDirY, maxDistance );
 	
 	// find maximal edge
 	EdgeComparison max;
@@ -177,10 +201,10 @@ T findEdge( Image& image, const Math::Vector< T, 2 >& start, const Math::Vector<
 		max.compare( i, pBuffer[ i ] );
 		
 	// subpixel localisation of maximum: fit 3 pixels to parabola and compute zero of derivation
-	T fMaxSubPix = static_cast< T >( max.index - maxDistance );
-	T a = 0.5f * ( pBuffer[ max.index - 1 ] + pBuffer[ max.index + 1 ] ) - pBuffer[ max.index ];
-	T b = 0.5f * ( pBuffer[ max.index + 1 ] - pBuffer[ max.index - 1 ] );
-	if ( ( a != 0 ) && (fabsf( b ) <= fabsf( a * 10 ) ))
+	float fMaxSubPix = static_cast< float >( max.index - maxDistance );
+	const float a = 0.5f * ( pBuffer[ max.index - 1 ] + pBuffer[ max.index + 1 ] ) - pBuffer[ max.index ];
+	const float b = 0.5f * ( pBuffer[ max.index + 1 ] - pBuffer[ max.index - 1 ] );
+	if ( ( a != 0 ) && ( fabsf( b ) <= fabsf( a * 10 ) ) )
 		fMaxSubPix -= b / ( 2.0f * a );
 
 	maxResponse = max.value;
@@ -188,6 +212,32 @@ T findEdge( Image& image, const Math::Vector< T, 2 >& start, const Math::Vector<
 }
 
 
+/**
+ * Finds an edge along a line.
+ *
+ * Note: integer coordinates lie at pixel centers.
+ * This function does not respect the origin flag and assumes that a y-coordinate of 0 is on top.
+ *
+ * @param EdgeComparison class to compare edge intensities. Use e.g. \c FindEdgePositiveOnly
+ * @param LineExtraction class to extract the line. Use e.g. \c ExtractLineSobel
+ * @param T usually float or double
+ *
+ * @param image image to search for edge in
+ * @param start point to start searching (in both directions)
+ * @param dir search direction (length determines the )
+ * @param maxDistance maximum distance to search (in pixels)
+ * @param response will store the strength of the maximum edge
+ * @return the distance of the pixel with maximum response from \c start. Positive values are in the direction of \c dir.
+ */
+template< class EdgeComparison, class LineExtraction, class T >
+T findEdge( Image& image, const Math::Vector< T, 2 >& start, const Math::Vector< T, 2 >& dir, int maxDistance, int& maxResponse )
+{
+	return static_cast< T >( findEdge< EdgeComparison, LineExtraction >( image, 
+		static_cast< float >( start( 0 ) ), static_cast< float >( start( 1 ) ), 
+		static_cast< float >( dir( 0 ) ), static_cast< float >( dir( 1 ) ), maxDistance, maxResponse ) );
+}
+
+
 /**
  * Samples a point with subpixel precision and without outlier checks.
  *
@@ -204,6 +254,33 @@ UTVISION_EXPORT int subpixSampleFast( Image& src, const Math::Vector< float, 2 >
  */
 UTVISION_EXPORT int subpixSampleSafe( Image& src, const Math::Vector< float, 2 >& p );
 
+/**
+ * Samples many points with subpixel precision, using the same fixed-point bilinear interpolation as
+ * subpixSampleFast and subpixSampleSafe. The interpolation is vectorized where SSE2 is available.
+ *
+ * @param src image to sample
+ * @param pX x-coordinates of the points
+ * @param pY y-coordinates of the points
+ * @param nPoints number of points
+ * @param pDst array of nPoints integers that receives the samples
+ * @param bSafe if true, points whose neighbourhood is not inside the image return the nearest border
+ *    pixel, like subpixSampleSafe. If false, all points must be inside, like for subpixSampleFast.
+ */
+UTVISION_EXPORT void subpixSamplePoints( Image& src, const float* pX, const float* pY, int nPoints, int* pDst, bool bSafe = true );
+
+/**
+ * Samples \c nSamples points on a line, starting at \c start and advancing by \c step, see subpixSamplePoints.
+ */
+UTVISION_EXPORT void subpixSampleLine( Image& src, int* pDst, const Math::Vector< float, 2 >& start, 
+	const Math::Vector< float, 2 >& step, int nSamples, bool bSafe = true );
+
+/**
+ * Samples \c nSamples points on each of \c nLines lines, see subpixSampleLine. The samples of line i
+ * are stored at pDst[ i * nSamples ].
+ */
+UTVISION_EXPORT void subpixSampleLines( Image& src, int* pDst, const Math::Vector< float, 2 >* pStarts, 
+	const Math::Vector< float, 2 >* pSteps, int nLines, int nSamples, bool bSafe = true );
+
 } } // namespace Ubitrack::Vision
 
 #endif
@@ -36,7 +36,6 @@
 #include <utVision.h>
 #include <utMath/Vector.h>
 #include <utMath/Matrix.h>
-#include <utAlgorithm/Function/MultiplePointProjection.h>
 #include "EdgeExtraction.h"
 #include "Image.h"
 
@@ -48,7 +47,12 @@ namespace Ubitrack { namespace Vision {
 static int g_minEdgeIntensity = 10;
 
 /**
- * Computes a function that needs to be minimized for edge-based tracking
+ * Computes a function that needs to be minimized for edge-based tracking.
+ *
+ * The parameters are a 7-vector of translation and rotation quaternion (x, y, z, w), as created by
+ * Math::Pose::toVector. The edgels are projected and differentiated in fixed-size blocks, without
+ * temporary matrices, and the rows of the jacobian are written directly.
+ *
  * @param T double or float
  * @param MaximumT type of edge to find can be \c FindEdgeAbsoluteMaximum or \c FindEdgePositiveMaximum
  * @param GradientT type of gradient detector, e.g. ExtractLineSimpleGradient or ExtractLineSobel
@@ -80,24 +84,22 @@ public:
 		, m_pDebugImage( pDebugImage )
 		, m_outlierThreshold(outlierThreshold )
 		, m_fBoundedResidual( 1e50 )
+		, m_nJacobianEvaluations( 0 )
 	{
 	}
 
 	template< class VT1, class VT2 > 
 	void evaluate( VT1& result, const VT2& input ) const
 	{
-		namespace ublas = boost::numeric::ublas;
 
 		m_goodEdgels = 0;
 
 		// compute edge points
-		if ( !m_edgePoints.size() )
+		if ( m_normalX.empty() )
 			findEdgePoints( input );
 
-		// project first points and calculate jacobian
-		Math::Vector< T > p2d( m_p3d.size() * 2 );
-		Algorithm::Function::MultiplePointProjection< T >( m_p3d, m_K ).evaluate( p2d, input );
-
+		// project first points
+		const PoseProjection projection( input, m_K );
 		for ( unsigned i = 0; i < m_p3d.size(); i++ )
 		{
 			// remove too small intensity edges
@@ -107,49 +109,48 @@ public:
 			else
 			{
 				// compute result
-				result( i ) = ublas::inner_prod( m_normals[ i ], 
-					Math::Vector< T, 2 >( p2d( i * 2 ), p2d( i * 2 + 1 ) ) - m_edgePoints[ i ] );
+				T u, v;
+				projection.project( m_p3d[ i ], u, v );
+				result( i ) = m_normalX[ i ] * u + m_normalY[ i ] * v - m_edgeOffsets[ i ];
 
 				if ( fabs( result( i ) ) < m_outlierThreshold * m_searchLengths[ i ] )
 					m_goodEdgels++;
 			}
-			//std::cout << i << ": 3d (" << m_p3d[ i ] << ") -> 2d (" << p2d(i*2) << ", " << p2d(i*2+1) << 
-			//	"), edge " << m_edgePoints[ i ] << ", normal " << m_normals[ i ] << ", error " << result( i ) << std::endl;
-
 		}
-		//std::cout << "error :" << double( ublas::norm_2( result ) ) << std::endl;
 	}
 
 	template< class VT1, class VT2, class MT > 
 	void evaluateWithJacobian( VT1& result, VT2& input, MT& J ) 
 	{
-		namespace ublas = boost::numeric::ublas;
 		m_goodEdgels = 0;
+		m_nJacobianEvaluations++;
 		double fBoundedResidual = 0;
 
 		// compute edge points
-		if ( !m_edgePoints.size() )
+		if ( m_normalX.empty() )
 			findEdgePoints( input );
 
 		// project first points and calculate jacobian
-		Math::Vector< T > p2d( m_p3d.size() * 2 );
-		Math::Matrix< T, 0, 0 > j2d( m_p3d.size() * 2, input.size() );
-		Algorithm::Function::MultiplePointProjection< T >( m_p3d, m_K ).evaluateWithJacobian( p2d, input, j2d );
-
+		const PoseProjection projection( input, m_K );
 		for ( unsigned i = 0; i < m_p3d.size(); i++ )
 			// remove too small intensity edges
 			// TODO: magic number -> bad
 			if ( m_intensities[ i ] < g_minEdgeIntensity )
 			{
-				noalias( ublas::row( J, i ) ) = Math::Vector< T >::zeros( input.size() );
+				for ( unsigned j = 0; j < 7; j++ )
+					J( i, j ) = 0;
 				result( i ) = 0;
 				fBoundedResidual += m_outlierThreshold * m_searchLengths[ i ] * m_outlierThreshold * m_searchLengths[ i ];
 			}
 			else
 			{
-				// compute result
-				result( i ) = ublas::inner_prod( m_normals[ i ], 
-					Math::Vector< T, 2 >( p2d( i * 2 ), p2d( i * 2 + 1 ) ) - m_edgePoints[ i ] );
+				// compute result and jacobian
+				T u, v;
+				T row[ 7 ];
+				projection.projectWithJacobian( m_p3d[ i ], m_normalX[ i ], m_normalY[ i ], u, v, row );
+				result( i ) = m_normalX[ i ] * u + m_normalY[ i ] * v - m_edgeOffsets[ i ];
+				for ( unsigned j = 0; j < 7; j++ )
+					J( i, j ) = row[ j ];
 
 				if ( fabs( result( i ) ) < m_outlierThreshold * m_searchLengths[ i ] )
 				{
@@ -158,10 +159,6 @@ public:
 				}
 				else
 					fBoundedResidual += m_outlierThreshold * m_searchLengths[ i ] * m_outlierThreshold * m_searchLengths[ i ];
-				
-
-				// compute jacobian
-				noalias( ublas::row( J, i ) ) = ublas::prod( m_normals[ i ], ublas::subrange( j2d, i * 2, (i+1) * 2, 0, input.size() ) );
 			}
 			
 		if ( m_fBoundedResidual > fBoundedResidual )
@@ -171,26 +168,25 @@ public:
 	template< class VT2, class MT > 
 	void jacobian( const VT2& input, MT& J ) const
 	{
-		namespace ublas = boost::numeric::ublas;
-
 		// compute edge points
-		if ( !m_edgePoints.size() )
+		if ( m_normalX.empty() )
 			findEdgePoints( input );
 
 		// project first points and calculate jacobian
-		Math::Matrix< T, 0, 0 > j2d( m_p3d.size() * 2, input.size() );
-		Algorithm::Function::MultiplePointProjection< T >( m_p3d, m_K ).jacobian( input, j2d );
-
+		const PoseProjection projection( input, m_K );
 		for ( unsigned i = 0; i < m_p3d.size(); i++ )
 			// remove too small intensity edges
 			// TODO: magic number -> bad
 			if ( m_intensities[ i ] < g_minEdgeIntensity )
-				noalias( ublas::row( J, i ) ) = Math::Vector< T >::zeros( input.size() );
+				for ( unsigned j = 0; j < 7; j++ )
+					J( i, j ) = 0;
 			else
 			{
-				// results...
-				noalias( ublas::row( J, i ) ) = ublas::prod( m_normals[ i ], ublas::subrange( j2d, i * 2, (i+1) * 2, 0, input.size() ) );
-				//std::cout << "J( " << i << " )=" << ublas::row( J, i ) << std::endl;
+				T u, v;
+				T row[ 7 ];
+				projection.projectWithJacobian( m_p3d[ i ], m_normalX[ i ], m_normalY[ i ], u, v, row );
+				for ( unsigned j = 0; j < 7; j++ )
+					J( i, j ) = row[ j ];
 			}
 	}
 
@@ -232,39 +228,125 @@ public:
 	float getBoundedResidual() const
 	{ return float( m_fBoundedResidual ); }
 
+	/** number of calls to evaluateWithJacobian, i.e. of Levenberg-Marquardt iterations */
+	unsigned getJacobianEvaluations() const
+	{ return m_nJacobianEvaluations; }
+
 protected:
-	/** finds points on the edge */
-	template< class VT2 >
-	void findEdgePoints( VT2& input )
+	/** projection of points with a pose given as 7-vector, prepared once per parameter vector */
+	class PoseProjection
 	{
-		// initialize points
-		m_edgePoints.resize( m_p3d.size() );
-		m_normals.resize( m_p3d.size() );
-		m_searchLengths.resize( m_p3d.size() );
-		m_intensities.resize( m_p3d.size() );
+	public:
+		template< class VT >
+		PoseProjection( const VT& input, const Math::Matrix< T, 3, 3 >& K )
+			: m_K( K )
+		{
+			for ( unsigned i = 0; i < 3; i++ )
+				m_t[ i ] = input( i );
+			const T x = m_q[ 0 ] = input( 3 );
+			const T y = m_q[ 1 ] = input( 4 );
+			const T z = m_q[ 2 ] = input( 5 );
+			const T w = m_q[ 3 ] = input( 6 );
+
+			// rotation q * p * ~q, also valid for quaternions that are not normalized
+			m_R[ 0 ] = w * w + x * x - y * y - z * z;
+			m_R[ 1 ] = 2 * ( x * y - w * z );
+			m_R[ 2 ] = 2 * ( x * z + w * y );
+			m_R[ 3 ] = 2 * ( x * y + w * z );
+			m_R[ 4 ] = w * w - x * x + y * y - z * z;
+			m_R[ 5 ] = 2 * ( y * z - w * x );
+			m_R[ 6 ] = 2 * ( x * z - w * y );
+			m_R[ 7 ] = 2 * ( y * z + w * x );
+			m_R[ 8 ] = w * w - x * x - y * y + z * z;
+		}
 
-		// project first points
-		Math::Vector< T > p2d( m_p3d.size() * 2 );
-		Algorithm::Function::MultiplePointProjection< T >( m_p3d, m_K ).evaluate( p2d, input );
+		/** projects a point into the image */
+		void project( const Math::Vector< T, 3 >& p, T& u, T& v ) const
+		{
+			T h[ 3 ];
+			homogeneous( p, h );
+			u = h[ 0 ] / h[ 2 ];
+			v = h[ 1 ] / h[ 2 ];
+		}
 
-		// project second points
-		Math::Vector< T > p2d2( m_p3d.size() * 2 );
-		Algorithm::Function::MultiplePointProjection< T >( m_p3d2, m_K ).evaluate( p2d2, input );
+		/**
+		 * projects a point into the image and computes the derivatives of its projection along \c normal
+		 * with respect to the 7 pose parameters
+		 */
+		void projectWithJacobian( const Math::Vector< T, 3 >& p, T nx, T ny, T& u, T& v, T* pRow ) const
+		{
+			T h[ 3 ];
+			homogeneous( p, h );
+			const T fInvZ = 1 / h[ 2 ];
+			u = h[ 0 ] * fInvZ;
+			v = h[ 1 ] * fInvZ;
+
+			// derivative of the projection along the normal with respect to the homogeneous point ...
+			const T g[ 3 ] = { nx * fInvZ, ny * fInvZ, -( nx * u + ny * v ) * fInvZ };
+
+			// ... and to the point in camera coordinates, which is also the derivative wrt. translation
+			for ( unsigned j = 0; j < 3; j++ )
+				pRow[ j ] = g[ 0 ] * m_K( 0, j ) + g[ 1 ] * m_K( 1, j ) + g[ 2 ] * m_K( 2, j );
+
+			// derivatives of the rotated point with respect to x, y, z, w
+			const T x = m_q[ 0 ], y = m_q[ 1 ], z = m_q[ 2 ], w = m_q[ 3 ];
+			const T a = p( 0 ), b = p( 1 ), c = p( 2 );
+			const T d0 = 2 * ( x * a + y * b + z * c );
+			const T dRot[ 3 ][ 4 ] = {
+				{ d0, 2 * ( x * b - y * a + w * c ), 2 * ( x * c - z * a - w * b ), 2 * ( w * a - z * b + y * c ) },
+				{ 2 * ( y * a - x * b - w * c ), d0, 2 * ( w * a - z * b + y * c ), 2 * ( z * a + w * b - x * c ) },
+				{ 2 * ( z * a + w * b - x * c ), 2 * ( z * b - w * a - y * c ), d0, 2 * ( x * b - y * a + w * c ) } };
+
+			for ( unsigned j = 0; j < 4; j++ )
+				pRow[ 3 + j ] = pRow[ 0 ] * dRot[ 0 ][ j ] + pRow[ 1 ] * dRot[ 1 ][ j ] + pRow[ 2 ] * dRot[ 2 ][ j ];
+		}
 
-		for ( unsigned i = 0; i < m_p3d.size(); i++ )
+	protected:
+		/** computes K * ( R * p + t ) */
+		void homogeneous( const Math::Vector< T, 3 >& p, T* h ) const
 		{
-			// compute edge direction
-			Math::Vector< T, 2 > dir( p2d2( i * 2 ) - p2d( i * 2 ), p2d2( i * 2 + 1 ) - p2d( i * 2 + 1 ) );
-			T searchLen = ublas::norm_2( dir );
-			dir /= searchLen;
+			T c[ 3 ];
+			for ( unsigned i = 0; i < 3; i++ )
+				c[ i ] = m_R[ 3 * i ] * p( 0 ) + m_R[ 3 * i + 1 ] * p( 1 ) + m_R[ 3 * i + 2 ] * p( 2 ) + m_t[ i ];
+			for ( unsigned i = 0; i < 3; i++ )
+				h[ i ] = m_K( i, 0 ) * c[ 0 ] + m_K( i, 1 ) * c[ 1 ] + m_K( i, 2 ) * c[ 2 ];
+		}
 
-			// compute normal direction
-			Math::Vector< T, 2 > normal( dir( 1 ), -dir( 0 ) );
-			if ( m_image.origin() )
-				normal *= -1;
+		const Math::Matrix< T, 3, 3 >& m_K;
+		T m_t[ 3 ];
+		T m_q[ 4 ];
+		T m_R[ 9 ];
+	};
 
-			// experimental
-			searchLen = sqrt( ublas::inner_prod( normal, ublas::prod( m_scale, normal ) ) );
+	/** finds points on the edge */
+	template< class VT2 >
+	void findEdgePoints( const VT2& input ) const
+	{
+		// initialize points
+		const std::size_t n = m_p3d.size();
+		m_normalX.resize( n );
+		m_normalY.resize( n );
+		m_edgeOffsets.resize( n );
+		m_searchLengths.resize( n );
+		m_intensities.resize( n );
+
+		const T s00 = m_scale( 0, 0 ), s01 = m_scale( 0, 1 ), s10 = m_scale( 1, 0 ), s11 = m_scale( 1, 1 );
+		const T fNormalSign = m_image.origin() ? T( -1 ) : T( 1 );
+		const PoseProjection projection( input, m_K );
+		for ( std::size_t i = 0; i < n; i++ )
+		{
+			// project first and second point
+			T u, v, u2, v2;
+			projection.project( m_p3d[ i ], u, v );
+			projection.project( m_p3d2[ i ], u2, v2 );
+
+			// compute normal direction from the edge direction
+			const T fInvLen = fNormalSign / sqrt( ( u2 - u ) * ( u2 - u ) + ( v2 - v ) * ( v2 - v ) );
+			const T nx = ( v2 - v ) * fInvLen;
+			const T ny = ( u - u2 ) * fInvLen;
+
+			// search length from the scale matrix
+			const T searchLen = sqrt( nx * ( s00 * nx + s01 * ny ) + ny * ( s10 * nx + s11 * ny ) );
 
 			// determine number of pixels to search
 			int searchPixels = static_cast< int >( searchLen );
@@ -272,28 +354,26 @@ protected:
 				searchPixels = 1;
 
 			// search for position of maximum
-			Math::Vector< T, 2 > start( p2d( i * 2 ), p2d( i * 2 + 1 ) );
 			int maxIntensity;
-			T maxPos = findEdge< MaximumT, GradientT >
-				( m_image, start, normal, searchPixels, maxIntensity );
+			const T maxPos = findEdge< MaximumT, GradientT >( m_image, static_cast< float >( u ), static_cast< float >( v ), 
+				static_cast< float >( nx ), static_cast< float >( ny ), searchPixels, maxIntensity );
 
-			// set parameters
+			// set parameters, the edge point is ( u, v ) + maxPos * n
 			m_intensities[ i ] = maxIntensity;
 			m_searchLengths[ i ] = T( searchPixels );
-			m_normals[ i ] = normal;
-			m_edgePoints[ i ] = start + normal * maxPos;
+			m_normalX[ i ] = nx;
+			m_normalY[ i ] = ny;
+			m_edgeOffsets[ i ] = nx * u + ny * v + maxPos;
 
 			if ( m_pDebugImage )
 			{
 				IplImage dbgImg = m_pDebugImage->Mat();
-				Math::Vector< float, 2 > p1( start + searchPixels * normal );
-				Math::Vector< float, 2 > p2( start - searchPixels * normal );
 				cvLine( &dbgImg,
-					cvPoint( cvRound( p1( 0 ) * 16 ), cvRound( p1( 1 ) * 16 ) ), 
-					cvPoint( cvRound( p2( 0 ) * 16 ), cvRound( p2( 1 ) * 16 ) ), 
+					cvPoint( cvRound( ( u + searchPixels * nx ) * 16 ), cvRound( ( v + searchPixels * ny ) * 16 ) ), 
+					cvPoint( cvRound( ( u - searchPixels * nx ) * 16 ), cvRound( ( v - searchPixels * ny ) * 16 ) ), 
 					CV_RGB( 128, 128, 0 ), 1, CV_AA, 4 );
 				cvCircle( &dbgImg,
-					cvPoint( cvRound( m_edgePoints[ i ]( 0 ) * 16 ), cvRound( m_edgePoints[ i ]( 1 ) * 16 ) ),
+					cvPoint( cvRound( ( u + maxPos * nx ) * 16 ), cvRound( ( v + maxPos * ny ) * 16 ) ),
 					cvRound( m_pDebugImage->width() / 1600.0 * 16 ),
 					m_intensities[ i ] >= g_minEdgeIntensity ? CV_RGB( 0, 255, 0 ) : CV_RGB( 255, 0, 0 ), 
 					-1, CV_AA, 4 );
@@ -313,15 +393,16 @@ protected:
 	mutable Image* m_pDebugImage;
 	mutable T m_outlierThreshold;
 
-	/** positions of points on edge */
-	mutable std::vector< Math::Vector< T, 2 > > m_edgePoints;
+	/** normal directions of the edgels, stored per component */
+	mutable std::vector< T > m_normalX;
+	mutable std::vector< T > m_normalY;
+
+	/** inner products of the normals and the found edge points, the residual is n^T p - offset */
+	mutable std::vector< T > m_edgeOffsets;
 
 	/** point intensities */
 	mutable std::vector< int > m_intensities;
 
-	/** normal directions */
-	mutable std::vector< Math::Vector< T, 2 > > m_normals;
-
 	/** point intensities */
 	mutable std::vector< T > m_searchLengths;
 
@@ -331,6 +412,9 @@ protected:
 	/** residual where outliers have a constant maximum weight */
 	mutable double m_fBoundedResidual;
 
+	/** number of calls to evaluateWithJacobian */
+	unsigned m_nJacobianEvaluations;
+
 };
 
 } } // namespace Ubitrack::Vision
@@ -0,0 +1,64 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @ingroup vision
+ * @file
+ * Implementation of the shared image pyramid.
+ */
+
+#include <assert.h>
+#include "ImagePyramid.h"
+
+namespace Ubitrack { namespace Vision {
+
+ImagePyramid::ImagePyramid()
+	: m_pBase( 0 )
+{}
+
+
+void ImagePyramid::reset( Image& img )
+{
+	boost::mutex::scoped_lock l( m_mutex );
+	m_pBase = &img;
+	m_levels.clear();
+}
+
+
+Image& ImagePyramid::level( unsigned n )
+{
+	assert( m_pBase );
+	if ( n == 0 )
+		return *m_pBase;
+
+	boost::mutex::scoped_lock l( m_mutex );
+	while ( m_levels.size() < n )
+	{
+		Image& prev( m_levels.empty() ? *m_pBase : *m_levels.back() );
+		m_levels.push_back( prev.PyrDown() );
+	}
+
+	return *m_levels[ n - 1 ];
+}
+
+} } // namespace Ubitrack::Vision
@@ -0,0 +1,87 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @ingroup vision
+ * @file
+ * Gaussian image pyramid that is shared between the consumers of a frame.
+ */
+
+#ifndef __UBITRACK_VISION_IMAGEPYRAMID_H_INCLUDED__
+#define __UBITRACK_VISION_IMAGEPYRAMID_H_INCLUDED__
+
+#include <vector>
+#include <boost/utility.hpp>
+#include <boost/thread/mutex.hpp>
+#include <utVision.h>
+#include "Image.h"
+
+namespace Ubitrack { namespace Vision {
+
+/**
+ * @ingroup vision
+ * Gaussian pyramid of a single frame.
+ *
+ * Level 0 is the frame itself, level n has 1/2^n of its width and height. The levels are computed
+ * using Image::PyrDown when they are first requested and are kept until the next frame is set, so all
+ * consumers of a frame, possibly running on different threads, share the same levels.
+ *
+ * A pixel center (x, y) on level n corresponds to (2^n x, 2^n y) on level 0.
+ */
+class UTVISION_EXPORT ImagePyramid
+	: private boost::noncopyable
+{
+public:
+	/** constructor */
+	ImagePyramid();
+
+	/**
+	 * Starts a new frame and drops the levels of the previous one.
+	 * The frame is not copied and must stay valid as long as the pyramid is used for it.
+	 */
+	void reset( Image& img );
+
+	/** returns the current frame, 0 if none is set */
+	Image* base() const
+	{ return m_pBase; }
+
+	/**
+	 * Returns a level of the pyramid and computes it, if necessary.
+	 * References stay valid until the next call to \c reset.
+	 */
+	Image& level( unsigned n );
+
+protected:
+	/** protects the levels */
+	boost::mutex m_mutex;
+
+	/** the current frame */
+	Image* m_pBase;
+
+	/** levels 1 to n */
+	std::vector< Image::Ptr > m_levels;
+};
+
+} } // namespace Ubitrack::Vision
+
+#endif
@@ -33,9 +33,14 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <algorithm>
+#include <list>
 #include <boost/scoped_array.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/thread/mutex.hpp>
 #include <opencv/cv.h>
+#include <opencv2/core/utility.hpp>
 
 #include <iostream>
 
@@ -50,6 +55,9 @@
 #include "MarkerDetection.h"
 #include "PixelFlow.h"
 #include "EdgeExtraction.h"
+#include "QuadrangleExtractor.h"
+#include "MarkerDictionary.h"
+#include "MarkerInfoTable.h"
 #include <algorithm>
 
 
@@ -66,19 +74,6 @@ static log4cpp::Category& logger( log4cpp::Category::getInstance( "Ubitrack.Visi
 #include <utAlgorithm/Function/ProjectivePoseNormalize.h>
 
 #include <opencv/highgui.h>
-//#define DO_TIMING
-
-#ifdef DO_TIMING
-#include <utUtil/BlockTimer.h>
-
-static Ubitrack::Util::BlockTimer g_blockTimer1( "Vision1", "Ubitrack.Vision.MarkerDetection.Timing" );
-static Ubitrack::Util::BlockTimer g_blockTimer2( "Vision2", "Ubitrack.Vision.MarkerDetection.Timing" );
-static Ubitrack::Util::BlockTimer g_blockTimer3( "Marker1", "Ubitrack.Vision.MarkerDetection.Timing" );
-static Ubitrack::Util::BlockTimer g_blockTimer4( "Marker2", "Ubitrack.Vision.MarkerDetection.Timing" );
-//static Ubitrack::Util::BlockTimer g_blockTimer( "MarkerDetection", "Ubitrack.Vision.MarkerDetection.Timing" );
-//static Ubitrack::Util::BlockTimer g_blockTimer( "MarkerDetection", "Ubitrack.Vision.MarkerDetection.Timing" );
-
-#endif
 
 namespace ublas = boost::numeric::ublas;
 
@@ -102,6 +97,12 @@ int g_nMinimalEdgeStrength = 40;
 /** maximal number of non-black pixels on marker border */
 const int g_nMaxWhiteBorderPixels = 4;
 
+/** minimal width of the pyramid level on which quadrangles are searched */
+const int g_nMinDetectionWidth = 160;
+
+/** maximal number of cached marker edgel models */
+const std::size_t g_nMaxEdgelModels = 512;
+
 /** 2D marker corner points in counter-clockwise order */
 const float std2dPoints[ 4 ][ 2 ] = 
 	{ { -1.0f, 1.0f }, { -1.0f, -1.0f }, { 1.0f, -1.0f }, { 1.0f, 1.0f } };
@@ -112,21 +113,285 @@ static void drawCube( Vision::Image& img, const Math::Pose& pose, const Math::Ma
 bool checkRefinedMarker( const Math::Matrix< float, 3, 3 >& K ,Math::Pose checkPose, MarkerInfo& info, Image& img, unsigned long long int nCode, Image* pDebugImg, unsigned int iMarkerSize, unsigned int iCodeSize );
 
 
+/** \internal per frame buffers for decoding the quadrangle candidates */
+struct DetectionContext::DecodingBuffers
+{
+	/** allocates space for the candidates of a frame, does nothing if there is enough */
+	void resize( std::size_t nCandidates, unsigned int iMarkerSize )
+	{
+		if ( homographies.size() < nCandidates )
+		{
+			homographies.resize( nCandidates );
+			rotations.resize( nCandidates );
+			codes.resize( nCandidates );
+			correctedBits.resize( nCandidates );
+			batchIndices.resize( nCandidates );
+			batchHomographies.resize( nCandidates );
+		}
+		if ( cells.size() < nCandidates * iMarkerSize * iMarkerSize )
+			cells.resize( nCandidates * iMarkerSize * iMarkerSize );
+	}
+
+	/** homography of each candidate */
+	std::vector< Math::Matrix< float, 3, 3 > > homographies;
+
+	/** number of rotations used to normalize the code of each candidate */
+	std::vector< int > rotations;
+
+	/** normalized code of each candidate, 0 if the candidate is not a marker */
+	std::vector< unsigned long long int > codes;
+
+	/** number of code bits corrected by the dictionary for each candidate */
+	std::vector< unsigned int > correctedBits;
+
+	/** indices and homographies of the candidates whose cells are sampled together */
+	std::vector< int > batchIndices;
+	std::vector< Math::Matrix< float, 3, 3 > > batchHomographies;
+
+	/** sampled cells of the batch, iMarkerSize x iMarkerSize bytes per candidate */
+	std::vector< unsigned char > cells;
+};
+
+
+DetectionContext::DetectionContext()
+	: nFramesSinceFullScan( 0 )
+	, bFullScanRequested( true )
+	, nWidth( 0 )
+	, nHeight( 0 )
+	, m_pExtractor( new QuadrangleExtractor )
+	, m_pDecodingBuffers( new DecodingBuffers )
+{}
+
+
+DetectionContext::~DetectionContext()
+{}
+
+
+void DetectionContext::reset()
+{
+	nFramesSinceFullScan = 0;
+	bFullScanRequested = true;
+	nWidth = 0;
+	nHeight = 0;
+}
+
+
+QuadrangleExtractor& DetectionContext::quadrangleExtractor()
+{
+	return *m_pExtractor;
+}
+
+
+DetectionContext::DecodingBuffers& DetectionContext::decodingBuffers()
+{
+	return *m_pDecodingBuffers;
+}
+
+
+struct DeferredCovariance
+	: private boost::noncopyable
+{
+	DeferredCovariance( const Math::Pose& _pose, float _fSize, const Math::Matrix< float, 3, 3 >& _K )
+		: pose( _pose )
+		, fSize( _fSize )
+		, K( _K )
+		, bComputed( false )
+		, covariance( Math::Matrix< double, 6, 6 >::zeros() )
+	{}
+
+	Math::Pose pose;
+	float fSize;
+	Math::Matrix< float, 3, 3 > K;
+
+	/** protects bComputed and covariance */
+	boost::mutex mutex;
+	bool bComputed;
+	Math::Matrix< double, 6, 6 > covariance;
+};
+
+
+void MarkerInfo::deferCovariance( const Math::Pose& pose, const Math::Matrix< float, 3, 3 >& K )
+{
+	pDeferredCovariance.reset( new DeferredCovariance( pose, fSize, K ) );
+}
+
+
+const Math::Matrix< double, 6, 6 >& MarkerInfo::getCovariance() const
+{
+	if ( !pDeferredCovariance )
+		return covariance;
+
+	DeferredCovariance& deferred( *pDeferredCovariance );
+	boost::mutex::scoped_lock lock( deferred.mutex );
+#ifdef HAVE_LAPACK
+	if ( !deferred.bComputed )
+	{
+		// the corners of the marker, their order does not matter
+		std::vector< Math::Vector< float, 3 > > p3D;
+		const float fF = 0.5f * deferred.fSize;
+		for ( unsigned i = 0; i < 4; i++ )
+			p3D.push_back( Math::Vector< float, 3 >( fF * std2dPoints[ i ][ 0 ], fF * std2dPoints[ i ][ 1 ], 0.0f ) );
+
+		// FIXME: make pixel variance configurable
+		deferred.covariance = Algorithm::PoseEstimation2D3D::singleCameraPoseError( deferred.pose, p3D, deferred.K, 0.04f * 0.04f );
+		deferred.bComputed = true;
+	}
+#endif
+	return deferred.covariance;
+}
+
+
 #ifdef HAVE_LAPACK
 
-Math::Pose edgeBasedRefinement (Math::Pose initialPose, unsigned long long int nCode, unsigned int nCodeSize, unsigned int nMarkerSize, MarkerInfo& info, 
-	Math::Matrix< float, 3, 3 > K, Image& img, CornerList it, Image* pDebugImg, bool bRefine, unsigned long long int uiMask, bool computeInnerEdgels )
+/**
+ * \internal
+ * Adds the time until its destruction to a stage of the detection statistics. Does nothing if no
+ * statistics are requested.
+ */
+class StageTimer
+	: private boost::noncopyable
+{
+public:
+	StageTimer( DetectionStatistics* pStats, DetectionStatistics::Stage stage )
+		: m_pStats( pStats )
+		, m_stage( stage )
+		, m_start( pStats ? cv::getTickCount() : 0 )
+	{}
+
+	~StageTimer()
+	{ switchTo( m_stage ); }
+
+	/** adds the time so far to the current stage and continues with another one */
+	void switchTo( DetectionStatistics::Stage stage )
+	{
+		if ( !m_pStats )
+			return;
+
+		const int64 now = cv::getTickCount();
+		m_pStats->stageTimes[ m_stage ] += 1000.0 * ( now - m_start ) / cv::getTickFrequency();
+		m_stage = stage;
+		m_start = now;
+	}
+
+protected:
+	DetectionStatistics* m_pStats;
+	DetectionStatistics::Stage m_stage;
+	int64 m_start;
+};
+
+
+/**
+ * \internal
+ * Edgel models of the markers, as computed by computeMarkerEdgels. The models are built when a marker
+ * is refined for the first time and never change afterwards, so they can be used by several threads 
+ * without locking. At most g_nMaxEdgelModels are kept, the least recently used ones are dropped first.
+ */
+class MarkerEdgelModelCache
+	: private boost::noncopyable
 {
-	int sum = 0;
-	for(int i = 1; i< img.Mat().total()*img.Mat().elemSize(); i++)
-		sum += img.Mat().data[i];
+public:
+	/** edgel lists of one marker */
+	struct Model
+	{
+		std::vector< Math::Vector< float, 3 > > edgels1;
+		std::vector< Math::Vector< float, 3 > > edgels2;
+	};
+
+	/** 
+	 * returns the model of a marker and computes it if it is not known yet. The model stays valid as long
+	 * as the pointer is kept, even if it is dropped from the cache meanwhile.
+	 */
+	boost::shared_ptr< const Model > get( unsigned long long int nCode, float fSize, unsigned int nCodeSize, unsigned int nMarkerSize, 
+		unsigned long long int uiMask, bool computeInnerEdgels )
+	{
+		const Key key( nCode, fSize, nCodeSize, nMarkerSize, uiMask, computeInnerEdgels );
+
+		boost::mutex::scoped_lock lock( m_mutex );
+		std::map< Key, Entry >::iterator it = m_models.find( key );
+		if ( it != m_models.end() )
+		{
+			// mark as most recently used
+			m_lru.splice( m_lru.begin(), m_lru, it->second.itLru );
+			return it->second.pModel;
+		}
+
+		boost::shared_ptr< Model > pModel( new Model );
+		computeMarkerEdgels( nCode, fSize, pModel->edgels1, pModel->edgels2, nCodeSize, nMarkerSize, uiMask, computeInnerEdgels );
+
+		if ( m_models.size() >= g_nMaxEdgelModels )
+		{
+			m_models.erase( m_lru.back() );
+			m_lru.pop_back();
+		}
+
+		m_lru.push_front( key );
+		Entry& entry( m_models[ key ] );
+		entry.pModel = pModel;
+		entry.itLru = m_lru.begin();
+		return pModel;
+	}
 
+protected:
+	/** everything the edgels depend on */
+	struct Key
+	{
+		Key( unsigned long long int _nCode, float _fSize, unsigned int _nCodeSize, unsigned int _nMarkerSize, 
+			unsigned long long int _uiMask, bool _bInnerEdgels )
+			: nCode( _nCode )
+			, fSize( _fSize )
+			, nCodeSize( _nCodeSize )
+			, nMarkerSize( _nMarkerSize )
+			, uiMask( _uiMask )
+			, bInnerEdgels( _bInnerEdgels )
+		{}
+
+		bool operator<( const Key& k ) const
+		{
+			if ( nCode != k.nCode ) return nCode < k.nCode;
+			if ( fSize != k.fSize ) return fSize < k.fSize;
+			if ( nCodeSize != k.nCodeSize ) return nCodeSize < k.nCodeSize;
+			if ( nMarkerSize != k.nMarkerSize ) return nMarkerSize < k.nMarkerSize;
+			if ( uiMask != k.uiMask ) return uiMask < k.uiMask;
+			return bInnerEdgels < k.bInnerEdgels;
+		}
+
+		unsigned long long int nCode;
+		float fSize;
+		unsigned int nCodeSize;
+		unsigned int nMarkerSize;
+		unsigned long long int uiMask;
+		bool bInnerEdgels;
+	};
+
+	/** a cached model and its position in the usage list */
+	struct Entry
+	{
+		boost::shared_ptr< const Model > pModel;
+		std::list< Key >::iterator itLru;
+	};
+
+	boost::mutex m_mutex;
+	std::map< Key, Entry > m_models;
+
+	/** keys of the models, the most recently used first */
+	std::list< Key > m_lru;
+};
+
+/** edgel models of all markers refined so far */
+static MarkerEdgelModelCache g_edgelModels;
+
+
+Math::Pose edgeBasedRefinement (Math::Pose initialPose, unsigned long long int nCode, unsigned int nCodeSize, unsigned int nMarkerSize, MarkerInfo& info, 
+	Math::Matrix< float, 3, 3 > K, Image& img, CornerList it, Image* pDebugImg, bool bRefine, unsigned long long int uiMask, bool computeInnerEdgels,
+	DetectionStatistics* pStats, float fSearchLength = 0.0f )
+{
 	Math::Pose pose( initialPose );
 
-	// create edgel lists
-	std::vector< Math::Vector< float, 3 > > edgels1;
-	std::vector< Math::Vector< float, 3 > > edgels2;
-	computeMarkerEdgels( nCode, info.fSize, edgels1, edgels2, nCodeSize, nMarkerSize, uiMask, computeInnerEdgels );
+	// get edgel lists
+	const boost::shared_ptr< const MarkerEdgelModelCache::Model > pModel( 
+		g_edgelModels.get( nCode, info.fSize, nCodeSize, nMarkerSize, uiMask, computeInnerEdgels ) );
+	const std::vector< Math::Vector< float, 3 > >& edgels1( pModel->edgels1 );
+	const std::vector< Math::Vector< float, 3 > >& edgels2( pModel->edgels2 );
 
 	// optimize pose
 	Math::Vector< float, 7 > poseVector;
@@ -150,6 +415,14 @@ Math::Pose edgeBasedRefinement (Math::Pose initialPose, unsigned long long int n
 		cornerCov *= ( 1.5f * 1.5f );
 	else
 		cornerCov *= ( 2.0f * 2.0f );
+
+	// shorten the search range if the prediction is good enough
+	const float fDefaultLength = sqrt( 0.5f * ( cornerCov( 0, 0 ) + cornerCov( 1, 1 ) ) );
+	if ( fSearchLength > 0.0f && fSearchLength < fDefaultLength )
+	{
+		const float fScale = std::max( fSearchLength, 2.0f ) / fDefaultLength;
+		cornerCov *= fScale * fScale;
+	}
 	LOG4CPP_DEBUG( logger, "cornerCov = " << cornerCov );
 
 	// Optimization iterations on edgels
@@ -178,6 +451,12 @@ Math::Pose edgeBasedRefinement (Math::Pose initialPose, unsigned long long int n
 		info.nVisibility = 0;
 	}
 
+	if ( pStats )
+	{
+		pStats->nEdgeRefinements++;
+		pStats->nLMIterations += edgeMF.getJacobianEvaluations();
+	}
+
 	return pose;
 }
 
@@ -243,205 +522,393 @@ void calculateMarkerBoundingRectangle( const Vision::Image& img, CornerList corn
 }
 
 
-void markerCalculations(CornerList &it, Image& img, Image* pDebugImg,MarkerInfoMap& markerInfos,
-	const Math::Matrix< float, 3, 3 >& K,const Math::Matrix< float, 3, 3 >& invK, unsigned int iCodeSize, unsigned int iMarkerSize, unsigned long long int uiMask, bool useInnerEdgels) {
-	// refine corner positions
-		const bool bRefine = false;
-			if ( refineCorners( img, it ) ) //, pDebugImg ) )
-			{
-				// if image is top-down, exchange point 2 and 4 to assure counter-clock-wise order for squareHomography
-				if ( !img.origin() )
-				{
-					Math::Vector< float, 2 > temp( (it)[ 3 ] );
-					(it)[ 3 ] = (it)[ 1 ];
-					(it)[ 1 ] = temp;
-				}
+/**
+ * \internal
+ * Refines the corners of a range of quadrangle candidates and reads their marker codes.
+ * The cells of all candidates that survive the corner refinement are sampled in one batch.
+ * Only the range of the buffers that belongs to the candidates is written, so disjoint ranges
+ * can be processed concurrently.
+ *
+ * @param markers the candidates, will be refined and brought into counter-clock-wise order
+ * @param buffers returns homography, rotation, normalized code and corrected bits of every candidate in the range
+ * @param options decoding options, pDictionary and pValidCodes are used
+ * @param pStats optional statistics that are updated
+ */
+void decodeCandidates( MarkerList& markers, int iBegin, int iEnd, Image& img, Image* pDebugImg, DetectionContext::DecodingBuffers& buffers,
+	unsigned int iCodeSize, unsigned int iMarkerSize, unsigned long long int uiMask, const DetectionOptions& options, DetectionStatistics* pStats )
+{
+	assert( !options.pDictionary || options.pDictionary->codeSize() == iCodeSize );
 
-				// compute homography
-				Math::Matrix< float, 3, 3 > H( Algorithm::squareHomography( it ) );
+	if ( pStats )
+		pStats->nCandidates += iEnd - iBegin;
 
-				// get marker image & decode
-				boost::shared_ptr< Image > pMarker( getMarkerImage( img, H, iMarkerSize ) );
-				unsigned long long int nCode = readCode( *pMarker, iCodeSize, uiMask );
-				/*
-				// show marker image in debug mode
-				if ( pDebugImg )
-				{
-					// Maybe make configurable in the future
-					int scale = 5;
-					IplImage dbgImg = pDebugImg->Mat();
-					int markersPerCol = img.height() / ( pMarker->height * scale );
-					int xStart = ( iShownMarker / markersPerCol ) * ( pMarker->height * scale );
-					int yStart = ( iShownMarker % markersPerCol ) * ( pMarker->height * scale );
-					iShownMarker++;
-					for ( unsigned int x = 0; x < iMarkerSize; x++ ) {
-						for ( unsigned int y = 0; y < iMarkerSize; y++ )
-						{
-							unsigned c = ( (unsigned char*)pMarker->imageData )[ y * pMarker->widthStep + x ];
-							cvRectangle( &dbgImg,
-								cvPoint( xStart + scale * x, yStart + scale * y ), 
-								cvPoint( xStart + scale * (x+1), yStart + scale * (y+1) ),
-								nCode ? CV_RGB( c, c, c ) : CV_RGB( c, (c*c)>>8, (c*c)>>8 ), CV_FILLED );
-						}
-                    }
-
-                    for ( size_t i = 0; i < it->size(); ++i) {
-                        cvCircle( &dbgImg, cvPoint( cvRound( it->at( i )(0) * 16 ), cvRound( it->at( i )(1) * 16 ) ),
-                            cvRound( pDebugImg->width / 500.0 * 16 ), CV_RGB( 255, 127, 39 ), -1, CV_AA, 4 );
-                    }
-                }*/
-
-				// normalize marker code
-				int nRotate = 0;
-				nCode = normalizeCode( nCode, iCodeSize, nRotate );
-
-				if ( nCode )
-				{ 
-                    LOG4CPP_TRACE( logger, "found marker with code: 0x" << std::hex << nCode ); 
-                    // Draw marker contours for found marker
-                    if ( pDebugImg )
-                    {
-						IplImage dbgImg = pDebugImg->Mat();
-                        for ( size_t i = 0; i < it.size(); ++i) {
-                        cvCircle( &dbgImg, cvPoint( cvRound( it.at( i )(0) * 16 ), cvRound( it.at( i )(1) * 16 ) ),
-				            cvRound( pDebugImg->width() / 500.0 * 16 ), CV_RGB( 0, 255, 255 ), -1, CV_AA, 4 );
-                        }
-                    }
-                }
-
-				if ( nCode && ( markerInfos.find( nCode ) != markerInfos.end() || markerInfos.find( 0 ) != markerInfos.end() ) )
-				{
-					// find the info struct for this marker
-					if ( markerInfos.find( nCode ) == markerInfos.end() )
-						markerInfos[ nCode ] = markerInfos[ 0 ];
+	int nBatchEnd = iBegin;
+	for ( int i = iBegin; i < iEnd; i++ )
+	{
+		CornerList& it( markers[ i ] );
+		buffers.codes[ i ] = 0;
 
-					MarkerInfo& info( markerInfos[ nCode ] );
-					info.found = info.EFullScanFound;
-						
-					// create corner list
-					info.corners.resize( 4 );
-					for ( unsigned i = 0; i < 4; i++ )
-						Math::Util::vector_cast_assign( info.corners[ i ], Math::Vector< double, 2 >( (it)[ ( i + nRotate ) % 4 ]( 0 ), (it)[ ( i + nRotate ) % 4 ]( 1 ) ) );
-
-					// origin correction
-					if ( !img.origin() )
-						for ( unsigned i = 0; i < 4; i++ )
-							info.corners[ i ]( 1 ) = img.height() - 1 - info.corners[ i ]( 1 );
-
-                    if ( pDebugImg )
-                    {
-						IplImage dbgImg = pDebugImg->Mat();
-                        for ( size_t i = 0; i < it.size(); ++i) {
-                        cvCircle( &dbgImg, cvPoint( cvRound( it.at( i )(0) * 16 ), cvRound( it.at( i )(1) * 16 ) ),
-				            cvRound( pDebugImg->width() / 500.0 * 16 ), CV_RGB( 0, 255, 0 ), -1, CV_AA, 4 );
-                        }
-                    }
-
-					if ( info.refinement >= MarkerInfo::EInitialPose )
-					{
-						// scale homography with marker size
-						ublas::column( H, 2 ) *= info.fSize;						
-						LOG4CPP_DEBUG( logger, "Homography: " << H  );
-						// compute pose
-						Math::Pose initialPose( Algorithm::PoseEstimation2D3D::poseFromHomography( H, invK ) );						
-						LOG4CPP_DEBUG( logger, "initialPose: " << initialPose  );
-						// rotate pose to account for different order of corner points
-						const double fSqrtHalf = 0.70710678118654752440084436210485;
-						static const double csMap[ 4 ][ 2 ] =
-							{ { 1.0f, 0.0f }, { fSqrtHalf, fSqrtHalf }, { 0.0f, 1.0f }, { fSqrtHalf, -fSqrtHalf } };
-						initialPose = Math::Pose( initialPose.rotation() * Math::Quaternion( 0.0, 0.0, csMap[ nRotate ][ 1 ], csMap[ nRotate ][ 0 ] ), initialPose.translation() );
-						LOG4CPP_DEBUG( logger, "initial pose: " << initialPose << ", marker size: " << info.fSize );
-
-						// create list of 3D marker points
-						std::vector< Math::Vector< float, 3 > > p3D;
-							
-						const float fF = 0.5f * info.fSize;
-						for ( unsigned i = 0; i < 4; i++ )
-						{
-							unsigned j = ( i + 4 - nRotate ) % 4;
-							p3D.push_back( Math::Vector< float, 3 >( fF * std2dPoints[ j ][ 0 ], fF * std2dPoints[ j ][ 1 ], 0.0f ) );
-						}
-
-						Math::Pose pose( initialPose );
-
-						// perform some LM iterations on the edge points to get a more stable initialization
-						double optRes = Algorithm::PoseEstimation2D3D::optimizePose( pose, it, p3D, K, 4 );
-							
-						// try optimization with the rotation from the last pose
-						if ( info.bUseInitialPose )
-						{
-							Math::Pose testPose = Math::Pose( info.pose.rotation(), initialPose.translation() );
-							double testOptRes = Algorithm::PoseEstimation2D3D::optimizePose( testPose, it, p3D, K, 4 );
-							if ( testOptRes < optRes * 9 ) // prefer last pose rotation
-								pose = testPose;
-						}
-							
-						// refine the pose
-						if ( info.refinement >= MarkerInfo::EEdgeRefinedPose )
-						{
-							pose = edgeBasedRefinement( pose, nCode, iCodeSize, iMarkerSize, info, K, img, it, pDebugImg, bRefine, uiMask, useInnerEdgels );
-
-							// Compute refined corners, based on the refined pose
-							// This is only necessary here and not with optimizePose() because here, also the inner edgelets are considered for pose estimation
-							LOG4CPP_TRACE( logger, "Unrefined corner positions: [" << info.corners[0] << ", " << info.corners[1] << ", " << info.corners[2] << ", " << info.corners[3] << "]" );
-
-							updateCorners( K, pose, info );
-							// Origin correction
-							if ( !img.origin() )
-								for ( unsigned i = 0; i < 4; i++ )
-									info.corners[ i ]( 1 ) = img.height() - 1 - info.corners[ i ]( 1 );
-
-							LOG4CPP_TRACE( logger, "Refined corner positions: [" << info.corners[0] << ", " << info.corners[1] << ", " << info.corners[2] << ", " << info.corners[3] << "]" );
-						}
-						else
-						{
-							// more iterations on the edge points
-							Algorithm::PoseEstimation2D3D::optimizePose( pose, it, p3D, K, 7 );
-						}
-						
-						// remember pose
-						LOG4CPP_DEBUG( logger, "optimized pose: " << pose << ", marker size: " << info.fSize );
-									
-						// also send ErrorPose if anybody is connected
-						if ( info.bCalculateCovariance )
-							// FIXME: make pixel variance configurable
-							info.covariance = Algorithm::PoseEstimation2D3D::singleCameraPoseError( pose, p3D, K, 0.04f * 0.04f );
-						
-						// in debug mode, draw a nice cube onto the marker
-						if ( pDebugImg ) {
-							drawCube( *pDebugImg, pose, K, info.fSize, CV_RGB( 255, 255, 0 ), info.fResidual );
-						}
-									
-						// check whether need to switch
-						if ( info.nPrevPoseValidator == 0 )
-						{	
-							info.prevPose = pose;
-							info.pose = pose;
-						}
-						else
-						{	
-							info.prevPose = info.pose;
-							info.pose = pose;
-						}
-						info.nPrevPoseValidator++;
-						
-						// calculate projection buffer
-						Math::Vector< int, 2 > topLeft;
-						Math::Vector< int, 2 > botRight;
-						
-						calculateMarkerBoundingRectangle( img, info.corners, topLeft, botRight, 0.2 );
+		// refine corner positions
+		bool bRefined;
+		{
+			StageTimer timer( pStats, DetectionStatistics::ECornerRefinement );
+			bRefined = refineCorners( img, it ); //, pDebugImg );
+		}
+		if ( !bRefined )
+		{
+			if ( pStats )
+				pStats->nRejectedCorners++;
+			continue;
+		}
 
-						// Peter Keitler: This call crashes on some images or image sequences and therefore has been commented out!
-						//info.pFlow.calcProjectionBuffer( img, topLeft, botRight );
-					}
+		// if image is top-down, exchange point 2 and 4 to assure counter-clock-wise order for squareHomography
+		if ( !img.origin() )
+		{
+			Math::Vector< float, 2 > temp( (it)[ 3 ] );
+			(it)[ 3 ] = (it)[ 1 ];
+			(it)[ 1 ] = temp;
+		}
+
+		// compute homography
+		buffers.homographies[ i ] = Algorithm::squareHomography( it );
+		buffers.batchHomographies[ nBatchEnd ] = buffers.homographies[ i ];
+		buffers.batchIndices[ nBatchEnd++ ] = i;
+	}
+
+	if ( nBatchEnd == iBegin )
+		return;
+
+	StageTimer timer( pStats, DetectionStatistics::EDecode );
+
+	// sample the marker cells of the whole batch
+	const int nCells = iMarkerSize * iMarkerSize;
+	sampleMarkerCells( img, &buffers.batchHomographies[ iBegin ], nBatchEnd - iBegin, iMarkerSize, &buffers.cells[ iBegin * nCells ] );
+
+	for ( int k = iBegin; k < nBatchEnd; k++ )
+	{
+		const int i = buffers.batchIndices[ k ];
+		CornerList& it( markers[ i ] );
+
+		// decode
+		unsigned long long int nCode = readCode( &buffers.cells[ k * nCells ], iMarkerSize, iCodeSize, uiMask );
+
+		// normalize marker code, correct bit errors if there is a dictionary
+		int nRotate = 0;
+		unsigned int nCorrectedBits = 0;
+		if ( options.pDictionary )
+			nCode = nCode ? options.pDictionary->lookup( nCode, nRotate, nCorrectedBits ) : 0;
+		else
+			nCode = normalizeCode( nCode, iCodeSize, nRotate );
+
+		if ( nCode && options.pValidCodes && !options.pValidCodes->count( nCode ) )
+		{
+			LOG4CPP_TRACE( logger, "rejected unknown marker code: 0x" << std::hex << nCode );
+			nCode = 0;
+		}
+		buffers.codes[ i ] = nCode;
+		buffers.rotations[ i ] = nRotate;
+		buffers.correctedBits[ i ] = nCorrectedBits;
+		if ( !nCode && pStats )
+			pStats->nRejectedCodes++;
+
+		if ( nCode )
+		{ 
+			LOG4CPP_TRACE( logger, "found marker with code: 0x" << std::hex << nCode ); 
+			// Draw marker contours for found marker
+			if ( pDebugImg )
+			{
+				IplImage dbgImg = pDebugImg->Mat();
+				for ( size_t j = 0; j < it.size(); ++j) {
+				cvCircle( &dbgImg, cvPoint( cvRound( it.at( j )(0) * 16 ), cvRound( it.at( j )(1) * 16 ) ),
+					cvRound( pDebugImg->width() / 500.0 * 16 ), CV_RGB( 0, 255, 255 ), -1, CV_AA, 4 );
 				}
-				else
-				{ LOG4CPP_TRACE( logger, "no marker info found" ); }
 			}
+		}
+	}
 }
 
-void markerCalculationsRefine(unsigned long long int markerId,  Image& img, Vision::Image* pDebugImg,MarkerInfoMap& markerInfos, 
-	const Math::Matrix< float, 3, 3 >& K,const Math::Matrix< float, 3, 3 >& invK, unsigned int iCodeSize, unsigned int iMarkerSize, unsigned long long int uiMask, bool useInnerEdgels){
+
+/**
+ * \internal
+ * Stores the corners of a decoded candidate in its marker info and estimates the marker pose
+ * according to the requested refinement level.
+ */
+void estimateMarkerPose( CornerList& it, Math::Matrix< float, 3, 3 > H, int nRotate, unsigned long long int nCode, MarkerInfo& info,
+	Image& img, Image* pDebugImg, const Math::Matrix< float, 3, 3 >& K, const Math::Matrix< float, 3, 3 >& invK,
+	unsigned int iCodeSize, unsigned int iMarkerSize, unsigned long long int uiMask, bool useInnerEdgels, DetectionStatistics* pStats )
+{
+	const bool bRefine = false;
+	info.found = info.EFullScanFound;
+		
+	// create corner list
+	info.corners.resize( 4 );
+	for ( unsigned i = 0; i < 4; i++ )
+		Math::Util::vector_cast_assign( info.corners[ i ], Math::Vector< double, 2 >( (it)[ ( i + nRotate ) % 4 ]( 0 ), (it)[ ( i + nRotate ) % 4 ]( 1 ) ) );
+
+	// origin correction
+	if ( !img.origin() )
+		for ( unsigned i = 0; i < 4; i++ )
+			info.corners[ i ]( 1 ) = img.height() - 1 - info.corners[ i ]( 1 );
+
+	if ( pDebugImg )
+	{
+		IplImage dbgImg = pDebugImg->Mat();
+		for ( size_t i = 0; i < it.size(); ++i) {
+		cvCircle( &dbgImg, cvPoint( cvRound( it.at( i )(0) * 16 ), cvRound( it.at( i )(1) * 16 ) ),
+			cvRound( pDebugImg->width() / 500.0 * 16 ), CV_RGB( 0, 255, 0 ), -1, CV_AA, 4 );
+		}
+	}
+
+	if ( pStats )
+		pStats->nDetected++;
+
+	if ( info.refinement < MarkerInfo::EInitialPose )
+		return;
+
+	StageTimer timer( pStats, DetectionStatistics::EPoseEstimation );
+
+	// scale homography with marker size
+	ublas::column( H, 2 ) *= info.fSize;						
+	LOG4CPP_DEBUG( logger, "Homography: " << H  );
+	// compute pose
+	Math::Pose initialPose( Algorithm::PoseEstimation2D3D::poseFromHomography( H, invK ) );						
+	LOG4CPP_DEBUG( logger, "initialPose: " << initialPose  );
+	// rotate pose to account for different order of corner points
+	const double fSqrtHalf = 0.70710678118654752440084436210485;
+	static const double csMap[ 4 ][ 2 ] =
+		{ { 1.0f, 0.0f }, { fSqrtHalf, fSqrtHalf }, { 0.0f, 1.0f }, { fSqrtHalf, -fSqrtHalf } };
+	initialPose = Math::Pose( initialPose.rotation() * Math::Quaternion( 0.0, 0.0, csMap[ nRotate ][ 1 ], csMap[ nRotate ][ 0 ] ), initialPose.translation() );
+	LOG4CPP_DEBUG( logger, "initial pose: " << initialPose << ", marker size: " << info.fSize );
+
+	// create list of 3D marker points
+	std::vector< Math::Vector< float, 3 > > p3D;
+		
+	const float fF = 0.5f * info.fSize;
+	for ( unsigned i = 0; i < 4; i++ )
+	{
+		unsigned j = ( i + 4 - nRotate ) % 4;
+		p3D.push_back( Math::Vector< float, 3 >( fF * std2dPoints[ j ][ 0 ], fF * std2dPoints[ j ][ 1 ], 0.0f ) );
+	}
+
+	Math::Pose pose( initialPose );
+
+	// perform some LM iterations on the edge points to get a more stable initialization
+	double optRes = Algorithm::PoseEstimation2D3D::optimizePose( pose, it, p3D, K, 4 );
+		
+	// try optimization with the rotation from the last pose
+	if ( info.bUseInitialPose )
+	{
+		Math::Pose testPose = Math::Pose( info.pose.rotation(), initialPose.translation() );
+		double testOptRes = Algorithm::PoseEstimation2D3D::optimizePose( testPose, it, p3D, K, 4 );
+		if ( testOptRes < optRes * 9 ) // prefer last pose rotation
+			pose = testPose;
+	}
+		
+	// refine the pose
+	if ( info.refinement >= MarkerInfo::EEdgeRefinedPose )
+	{
+		timer.switchTo( DetectionStatistics::EEdgeRefinement );
+		pose = edgeBasedRefinement( pose, nCode, iCodeSize, iMarkerSize, info, K, img, it, pDebugImg, bRefine, uiMask, useInnerEdgels, pStats );
+
+		// Compute refined corners, based on the refined pose
+		// This is only necessary here and not with optimizePose() because here, also the inner edgelets are considered for pose estimation
+		LOG4CPP_TRACE( logger, "Unrefined corner positions: [" << info.corners[0] << ", " << info.corners[1] << ", " << info.corners[2] << ", " << info.corners[3] << "]" );
+
+		updateCorners( K, pose, info );
+		// Origin correction
+		if ( !img.origin() )
+			for ( unsigned i = 0; i < 4; i++ )
+				info.corners[ i ]( 1 ) = img.height() - 1 - info.corners[ i ]( 1 );
+
+		LOG4CPP_TRACE( logger, "Refined corner positions: [" << info.corners[0] << ", " << info.corners[1] << ", " << info.corners[2] << ", " << info.corners[3] << "]" );
+		timer.switchTo( DetectionStatistics::EPoseEstimation );
+	}
+	else
+	{
+		// more iterations on the edge points
+		Algorithm::PoseEstimation2D3D::optimizePose( pose, it, p3D, K, 7 );
+	}
+	
+	// remember pose
+	LOG4CPP_DEBUG( logger, "optimized pose: " << pose << ", marker size: " << info.fSize );
+				
+	// also send ErrorPose if anybody is connected
+	if ( info.bCalculateCovariance && info.bDeferCovariance )
+		info.deferCovariance( pose, K );
+	else if ( info.bCalculateCovariance )
+	{
+		// FIXME: make pixel variance configurable
+		info.covariance = Algorithm::PoseEstimation2D3D::singleCameraPoseError( pose, p3D, K, 0.04f * 0.04f );
+		info.pDeferredCovariance.reset();
+	}
+	
+	// in debug mode, draw a nice cube onto the marker
+	if ( pDebugImg ) {
+		drawCube( *pDebugImg, pose, K, info.fSize, CV_RGB( 255, 255, 0 ), info.fResidual );
+	}
+				
+	// check whether need to switch
+	if ( info.nPrevPoseValidator == 0 )
+	{	
+		info.prevPose = pose;
+		info.pose = pose;
+	}
+	else
+	{	
+		info.prevPose = info.pose;
+		info.pose = pose;
+	}
+	info.nPrevPoseValidator++;
+
+	if ( info.bEnableMotionModel )
+		info.motionModel.update( pose );
+	
+	// calculate projection buffer
+	Math::Vector< int, 2 > topLeft;
+	Math::Vector< int, 2 > botRight;
+	
+	calculateMarkerBoundingRectangle( img, info.corners, topLeft, botRight, 0.2 );
+
+	// Peter Keitler: This call crashes on some images or image sequences and therefore has been commented out!
+	//info.pFlow.calcProjectionBuffer( img, topLeft, botRight );
+}
+
+
+template< class InfoMap >
+void markerCalculations(CornerList &it, const Math::Matrix< float, 3, 3 >& H, int nRotate, unsigned long long int nCode, unsigned int nCorrectedBits, Image& img, Image* pDebugImg,InfoMap& markerInfos,
+	const Math::Matrix< float, 3, 3 >& K,const Math::Matrix< float, 3, 3 >& invK, unsigned int iCodeSize, unsigned int iMarkerSize, unsigned long long int uiMask, bool useInnerEdgels,
+	DetectionStatistics* pStats ) {
+	if ( nCode && ( markerInfos.find( nCode ) != markerInfos.end() || markerInfos.find( 0 ) != markerInfos.end() ) )
+	{
+		// find the info struct for this marker, the template is copied first because inserting
+		// into a flat container invalidates references
+		if ( markerInfos.find( nCode ) == markerInfos.end() )
+		{
+			MarkerInfo newInfo( markerInfos.find( 0 )->second );
+			markerInfos[ nCode ] = newInfo;
+		}
+
+		MarkerInfo& info( markerInfos[ nCode ] );
+		estimateMarkerPose( it, H, nRotate, nCode, info, img, pDebugImg, K, invK, iCodeSize, iMarkerSize, uiMask, useInnerEdgels, pStats );
+		info.nCorrectedBits = nCorrectedBits;
+	}
+	else if ( nCode )
+	{
+		LOG4CPP_TRACE( logger, "no marker info found" );
+		if ( pStats )
+			pStats->nUnknownMarkers++;
+	}
+}
+
+
+/** \internal result of processing a single quadrangle candidate on a worker thread */
+struct CandidateResult
+{
+	CandidateResult()
+		: nCode( 0 )
+	{}
+
+	/** normalized code of the candidate, 0 if it was rejected */
+	unsigned long long int nCode;
+
+	/** copy of the marker info, updated with the results of this candidate */
+	MarkerInfo info;
+};
+
+
+/**
+ * \internal
+ * Runs decodeCandidates, unless the candidates are already decoded, and estimateMarkerPose for a range
+ * of candidates. The marker map is only read,
+ * each candidate writes into its own slot of the decoding buffers and the result vector. Statistics are
+ * collected per range and added to the shared ones under a lock.
+ */
+template< class InfoMap >
+class ParallelMarkerCalculations
+	: public cv::ParallelLoopBody
+{
+public:
+	ParallelMarkerCalculations( MarkerList& markers, DetectionContext::DecodingBuffers& buffers, std::vector< CandidateResult >& results,
+		Image& img, const InfoMap& markerInfos, const Math::Matrix< float, 3, 3 >& K, const Math::Matrix< float, 3, 3 >& invK,
+		unsigned int iCodeSize, unsigned int iMarkerSize, unsigned long long int uiMask, bool useInnerEdgels, const DetectionOptions& options,
+		bool bDecode, DetectionStatistics* pStats, boost::mutex& statsMutex )
+		: m_markers( markers )
+		, m_buffers( buffers )
+		, m_results( results )
+		, m_img( img )
+		, m_markerInfos( markerInfos )
+		, m_K( K )
+		, m_invK( invK )
+		, m_iCodeSize( iCodeSize )
+		, m_iMarkerSize( iMarkerSize )
+		, m_uiMask( uiMask )
+		, m_useInnerEdgels( useInnerEdgels )
+		, m_options( options )
+		, m_bDecode( bDecode )
+		, m_pStats( pStats )
+		, m_statsMutex( statsMutex )
+	{}
+
+	virtual void operator()( const cv::Range& range ) const
+	{
+		DetectionStatistics stats;
+		DetectionStatistics* pStats( m_pStats ? &stats : 0 );
+
+		if ( m_bDecode )
+			decodeCandidates( m_markers, range.start, range.end, m_img, 0, m_buffers, m_iCodeSize, m_iMarkerSize, m_uiMask, m_options, pStats );
+
+		for ( int i = range.start; i < range.end; i++ )
+		{
+			unsigned long long int nCode = m_buffers.codes[ i ];
+			if ( !nCode )
+				continue;
+
+			// find the info struct for this marker
+			typename InfoMap::const_iterator itInfo = m_markerInfos.find( nCode );
+			if ( itInfo == m_markerInfos.end() )
+				itInfo = m_markerInfos.find( 0 );
+			if ( itInfo == m_markerInfos.end() )
+			{
+				LOG4CPP_TRACE( logger, "no marker info found" );
+				stats.nUnknownMarkers++;
+				continue;
+			}
+
+			CandidateResult& result( m_results[ i ] );
+			result.info = itInfo->second;
+			estimateMarkerPose( m_markers[ i ], m_buffers.homographies[ i ], m_buffers.rotations[ i ], nCode, result.info, m_img, 0, m_K, m_invK, m_iCodeSize, m_iMarkerSize, m_uiMask, m_useInnerEdgels, pStats );
+			result.info.nCorrectedBits = m_buffers.correctedBits[ i ];
+			result.nCode = nCode;
+		}
+
+		if ( m_pStats )
+		{
+			boost::mutex::scoped_lock lock( m_statsMutex );
+			m_pStats->add( stats );
+		}
+	}
+
+protected:
+	MarkerList& m_markers;
+	DetectionContext::DecodingBuffers& m_buffers;
+	std::vector< CandidateResult >& m_results;
+	Image& m_img;
+	const InfoMap& m_markerInfos;
+	const Math::Matrix< float, 3, 3 >& m_K;
+	const Math::Matrix< float, 3, 3 >& m_invK;
+	unsigned int m_iCodeSize;
+	unsigned int m_iMarkerSize;
+	unsigned long long int m_uiMask;
+	bool m_useInnerEdgels;
+	const DetectionOptions& m_options;
+	bool m_bDecode;
+	DetectionStatistics* m_pStats;
+	boost::mutex& m_statsMutex;
+};
+
+void markerCalculationsRefine(unsigned long long int markerId, MarkerInfo& info, Image& img, Vision::Image* pDebugImg, 
+	const Math::Matrix< float, 3, 3 >& K,const Math::Matrix< float, 3, 3 >& invK, unsigned int iCodeSize, unsigned int iMarkerSize, unsigned long long int uiMask, bool useInnerEdgels,
+	DetectionStatistics* pStats ){
 		int nDiff, nVis;
 		float fRes;
 		bool bDraw = true;				
@@ -451,11 +918,12 @@ void markerCalculationsRefine(unsigned long long int markerId,  Image& img, Visi
 		Math::Quaternion quat;
 		Math::Vector< double, 3 > oldTrans, newTrans;
 		Math::Vector< int, 2 > res;
-		MarkerInfo info(markerInfos[markerId]);
+		float fSearchLength = 0.0f;
 			
 			// Calculate the approximate pose via pixel flow
 			if ( info.bEnablePixelFlow )
 			{	
+				StageTimer timer( pStats, DetectionStatistics::EPixelFlow );
 				info.pFlow.computeFlow( img, res, nDiff, pDebugImg );
 
 				quat = info.pose.rotation();
@@ -471,6 +939,22 @@ void markerCalculationsRefine(unsigned long long int markerId,  Image& img, Visi
 				LOG4CPP_DEBUG( logger, "old: " << oldTrans << ", new: " << newTrans );
 				aprPose = Math::Pose( quat, newTrans );
 			}
+			else if ( info.bEnableMotionModel && info.motionModel.isInitialized() )
+			{
+				// predict with the motion model and search the edges within three standard deviations
+				aprPose = info.motionModel.predict();
+				if ( info.motionModel.hasVelocity() && aprPose.translation()( 2 ) < 0 )
+				{
+					double fDevTranslation, fDevRotation;
+					info.motionModel.predictedDeviation( fDevTranslation, fDevRotation );
+					const double fPixels = fabs( K( 0, 0 ) ) / -aprPose.translation()( 2 );
+
+					// a rotation by the deviation (radians) moves the corners, which are half a diagonal 
+					// away from the center, by at most that distance times the deviation
+					const double fHalfDiagonal = 0.5 * sqrt( 2.0 ) * info.fSize;
+					fSearchLength = static_cast< float >( 3.0 * fPixels * ( fDevTranslation + fHalfDiagonal * fDevRotation ) );
+				}
+			}
 			else if ( info.bEnableInterpolation )
 				// interpolating the current pose with previous one
 				aprPose = Math::linearInterpolate( info.prevPose, info.pose, 2 );
@@ -480,7 +964,8 @@ void markerCalculationsRefine(unsigned long long int markerId,  Image& img, Visi
 			// refine the pose
 			try
 			{
-				pose = edgeBasedRefinement( aprPose, markerId, iCodeSize, iMarkerSize, info, K, img, info.corners, pDebugImg, true, uiMask, useInnerEdgels );
+				StageTimer timer( pStats, DetectionStatistics::EEdgeRefinement );
+				pose = edgeBasedRefinement( aprPose, markerId, iCodeSize, iMarkerSize, info, K, img, info.corners, pDebugImg, true, uiMask, useInnerEdgels, pStats, fSearchLength );
 				fRes = info.fResidual;
 				nVis = info.nVisibility;
 			}
@@ -491,15 +976,20 @@ void markerCalculationsRefine(unsigned long long int markerId,  Image& img, Visi
 
 			if ( info.bEnableFlipCheck && info.nVisibility > 0 ) // should be same as bUseInitial Pose?
 			{
+				StageTimer timer( pStats, DetectionStatistics::EFlipCheck );
 				flipPose = alternateMarkerPose( aprPose );
-				flipPose = edgeBasedRefinement( flipPose, markerId, iCodeSize, iMarkerSize, info, K, img, info.corners, pDebugImg, true, uiMask, useInnerEdgels );
+				flipPose = edgeBasedRefinement( flipPose, markerId, iCodeSize, iMarkerSize, info, K, img, info.corners, pDebugImg, true, uiMask, useInnerEdgels, pStats );
 				
 				LOG4CPP_DEBUG( logger, "old res: " << fRes << ", flipped res: " << info.fResidual );
 				LOG4CPP_DEBUG( logger, "old vis: " << nVis << ", flipped vis: " << info.nVisibility );
 				
 				if ( info.fResidual < fRes * 0.6 )
 				//if ( info.nVisibility > nVis + 10 )
+				{
 					pose = flipPose;
+					if ( pStats )
+						pStats->nFlips++;
+				}
 				else
 				{
 					info.fResidual = fRes;
@@ -518,6 +1008,22 @@ void markerCalculationsRefine(unsigned long long int markerId,  Image& img, Visi
 				bDraw = false;
 				pose = aprPose;
 			}
+
+			if ( pStats && markerId )
+			{
+				if ( info.found == MarkerInfo::ERefinementFound )
+					pStats->nRefined++;
+				else
+					pStats->nLost++;
+			}
+
+			if ( info.bEnableMotionModel )
+			{
+				if ( info.found == MarkerInfo::ERefinementFound )
+					info.motionModel.update( pose );
+				else
+					info.motionModel.reset();
+			}
 			
 			// update corners list
 			updateCorners( K, pose, info );
@@ -529,6 +1035,7 @@ void markerCalculationsRefine(unsigned long long int markerId,  Image& img, Visi
 			// additional steps needed for pixel flow
 			if ( info.bEnablePixelFlow )
 			{
+				StageTimer timer( pStats, DetectionStatistics::EPixelFlow );
 				calculateMarkerBoundingRectangle(img,info.corners, topLeft, botRight, 0.2);
 				info.pFlow.calcProjectionBuffer(img,topLeft,botRight);
 			}
@@ -543,14 +1050,201 @@ void markerCalculationsRefine(unsigned long long int markerId,  Image& img, Visi
 				drawCube( *pDebugImg, pose, K, info.fSize, CV_RGB( 0, 0, 255 ) );
 }
 
-void detectMarkers( Image& img, MarkerInfoMap& markerInfos, 
+/** \internal a marker of the refinement only mode */
+typedef std::pair< unsigned long long int, MarkerInfo* > RefinementTask;
+
+
+/**
+ * \internal
+ * Checks if a marker can be refined without detection. The catch-all entry 0 is the template for newly
+ * detected codes and must keep its state, markers that were never detected have no corners to refine.
+ */
+static bool isRefinable( unsigned long long int markerId, const MarkerInfo& info )
+{
+	return markerId != 0 && info.corners.size() == 4;
+}
+
+
+/**
+ * \internal
+ * Runs markerCalculationsRefine for a range of markers. Every task updates only its own marker info.
+ */
+class ParallelMarkerRefinement
+	: public cv::ParallelLoopBody
+{
+public:
+	ParallelMarkerRefinement( const std::vector< RefinementTask >& tasks, Image& img, const Math::Matrix< float, 3, 3 >& K, 
+		const Math::Matrix< float, 3, 3 >& invK, unsigned int iCodeSize, unsigned int iMarkerSize, unsigned long long int uiMask, 
+		bool useInnerEdgels, DetectionStatistics* pStats, boost::mutex& statsMutex )
+		: m_tasks( tasks )
+		, m_img( img )
+		, m_K( K )
+		, m_invK( invK )
+		, m_iCodeSize( iCodeSize )
+		, m_iMarkerSize( iMarkerSize )
+		, m_uiMask( uiMask )
+		, m_useInnerEdgels( useInnerEdgels )
+		, m_pStats( pStats )
+		, m_statsMutex( statsMutex )
+	{}
+
+	virtual void operator()( const cv::Range& range ) const
+	{
+		DetectionStatistics stats;
+		DetectionStatistics* pStats( m_pStats ? &stats : 0 );
+
+		for ( int i = range.start; i < range.end; i++ )
+			markerCalculationsRefine( m_tasks[ i ].first, *m_tasks[ i ].second, m_img, 0, m_K, m_invK, 
+				m_iCodeSize, m_iMarkerSize, m_uiMask, m_useInnerEdgels, pStats );
+
+		if ( m_pStats )
+		{
+			boost::mutex::scoped_lock lock( m_statsMutex );
+			m_pStats->add( stats );
+		}
+	}
+
+protected:
+	const std::vector< RefinementTask >& m_tasks;
+	Image& m_img;
+	const Math::Matrix< float, 3, 3 >& m_K;
+	const Math::Matrix< float, 3, 3 >& m_invK;
+	unsigned int m_iCodeSize;
+	unsigned int m_iMarkerSize;
+	unsigned long long int m_uiMask;
+	bool m_useInnerEdgels;
+	DetectionStatistics* m_pStats;
+	boost::mutex& m_statsMutex;
+};
+
+
+/** detection contexts of the threads calling detectMarkers without their own context */
+static boost::thread_specific_ptr< DetectionContext > g_pDetectionContext;
+
+/** returns the detection context of the calling thread */
+static DetectionContext& threadDetectionContext()
+{
+	if ( !g_pDetectionContext.get() )
+		g_pDetectionContext.reset( new DetectionContext );
+	return *g_pDetectionContext;
+}
+
+
+/**
+ * \internal
+ * Predicts the image region of a marker in the current frame from its last pose or, if no pose
+ * was computed, from its last corners.
+ *
+ * @param K camera matrix, corrected for the image origin
+ * @param window returns the search window in image coordinates, y-coordinate of 0 is top
+ * @return false if no prediction is possible
+ */
+static bool predictSearchWindow( const MarkerInfo& info, const Image& img, const Math::Matrix< float, 3, 3 >& K,
+	float fMargin, cv::Rect& window )
+{
+	CornerList corners( 4 );
+	if ( info.refinement >= MarkerInfo::EInitialPose )
+	{
+		Math::Pose pose( info.pose );
+		if ( info.bEnableMotionModel && info.motionModel.isInitialized() )
+			pose = info.motionModel.predict();
+		else if ( info.bEnableInterpolation )
+			pose = Math::linearInterpolate( info.prevPose, info.pose, 2 );
+		for ( unsigned i = 0; i < 4; i++ )
+		{
+			Math::Vector< float, 3 > p2D = 
+				ublas::prod( K, pose * Math::Vector< float, 3 >( 0.5f * info.fSize * 
+				Math::Vector< float, 3 >( std2dPoints[ i ][ 0 ], std2dPoints[ i ][ 1 ], 0.0 ) ) );
+			if ( p2D( 2 ) <= 0 )
+				return false;
+			corners[ i ]( 0 ) = p2D( 0 ) / p2D( 2 );
+			corners[ i ]( 1 ) = p2D( 1 ) / p2D( 2 );
+		}
+	}
+	else
+	{
+		if ( info.corners.size() != 4 )
+			return false;
+
+		// corners are stored origin-corrected
+		corners = info.corners;
+		if ( !img.origin() )
+			for ( unsigned i = 0; i < 4; i++ )
+				corners[ i ]( 1 ) = img.height() - 1 - corners[ i ]( 1 );
+	}
+
+	Math::Vector< int, 2 > topLeft;
+	Math::Vector< int, 2 > botRight;
+	calculateMarkerBoundingRectangle( img, corners, topLeft, botRight, fMargin );
+	if ( botRight( 0 ) <= topLeft( 0 ) || botRight( 1 ) <= topLeft( 1 ) )
+		return false;
+
+	window = cv::Rect( topLeft( 0 ), topLeft( 1 ), botRight( 0 ) - topLeft( 0 ) + 1, botRight( 1 ) - topLeft( 1 ) + 1 );
+	return true;
+}
+
+
+/**
+ * \internal
+ * Decides whether the current frame can be analysed in search windows around the markers found
+ * in the previous frame and computes these windows.
+ *
+ * @param trackedCodes returns the codes of the markers the windows belong to
+ * @return true if only the search windows need to be analysed
+ */
+template< class InfoMap >
+static bool planTrackingScan( const InfoMap& markerInfos, const Image& img, const Math::Matrix< float, 3, 3 >& K,
+	const DetectionOptions& options, const DetectionContext& context, std::vector< cv::Rect >& windows,
+	std::vector< unsigned long long int >& trackedCodes )
+{
+	windows.clear();
+	trackedCodes.clear();
+
+	if ( options.nFullScanInterval == 0 || context.nFramesSinceFullScan + 1 >= options.nFullScanInterval || 
+		context.bFullScanRequested || context.nWidth != img.width() || context.nHeight != img.height() )
+		return false;
+
+	int nArea = 0;
+	for ( typename InfoMap::const_iterator it = markerInfos.begin(); it != markerInfos.end(); it++ )
+	{
+		const MarkerInfo& info( it->second );
+		if ( it->first == 0 || info.found < MarkerInfo::ERefinementFound )
+			continue;
+
+		// markers that are not tracked require full-frame analysis
+		if ( !info.bEnableTracking || !info.bEnableFastTracking )
+			return false;
+
+		cv::Rect window;
+		if ( !predictSearchWindow( info, img, K, options.fSearchWindowMargin, window ) )
+			return false;
+
+		windows.push_back( window );
+		trackedCodes.push_back( it->first );
+		nArea += window.area();
+	}
+
+	if ( windows.empty() || nArea > options.fMaxSearchWindowArea * img.width() * img.height() )
+		return false;
+
+	LOG4CPP_TRACE( logger, "analysing " << windows.size() << " search windows" );
+	return true;
+}
+
+
+/** \internal implementation of detectMarkers for both marker containers */
+template< class InfoMap >
+static void detectMarkersImpl( Image& img, InfoMap& markerInfos, 
 	const Math::Matrix< float, 3, 3 >& _K,  Image* pDebugImg, bool bRefine, 
 	unsigned int iCodeSize, unsigned int iMarkerSize, unsigned long long int uiMask, bool useInnerEdgels,
-	bool useAdaptiveThresholding, int binaryThresholdValue )
+	bool useAdaptiveThresholding, int binaryThresholdValue, const DetectionOptions& options )
 {
 	assert( (iMarkerSize - iCodeSize) / 2.0 == 1.0 || (iMarkerSize - iCodeSize) / 2.0 == 2.0 );
 	
-	
+	DetectionStatistics* pStats( options.pStatistics );
+	const int64 startTicks = pStats ? cv::getTickCount() : 0;
+	if ( pStats )
+		pStats->reset();
 	
 	Math::Matrix< float, 3, 3 > K( _K );
 
@@ -561,80 +1255,194 @@ void detectMarkers( Image& img, MarkerInfoMap& markerInfos,
 	// compute inverse camera matrix
 	Math::Matrix< float, 3, 3 > invK( invert_matrix( K ) );
 	
-	// initialize found state of markerInfos
-	BOOST_FOREACH( MarkerInfoMap::value_type& mapEl, markerInfos )
-		mapEl.second.found = MarkerInfo::ENotFound;
+	DetectionContext& context( options.pContext ? *options.pContext : threadDetectionContext() );
+
+	// predict search windows of tracked markers before their found state is reset
+	std::vector< cv::Rect > searchWindows;
+	std::vector< unsigned long long int > trackedCodes;
+	const bool bTrackingScan = !bRefine && planTrackingScan( markerInfos, img, K, options, context, searchWindows, trackedCodes );
+
+	// initialize found state of markerInfos, motion models start over after a frame without the marker
+	for ( typename InfoMap::iterator it = markerInfos.begin(); it != markerInfos.end(); it++ )
+	{
+		if ( it->second.found == MarkerInfo::ENotFound )
+			it->second.motionModel.reset();
+		it->second.found = MarkerInfo::ENotFound;
+	}
 	
 	if ( !bRefine )
 	{
 
 		LOG4CPP_TRACE( logger, "detectMarkers(): detection/refinement" );	
-		// threshold image
-		Image thresholded( img.width(), img.height(), 1 );
+		// threshold image and find markers in it
+		QuadrangleExtractor& extractor( context.quadrangleExtractor() );
+		if ( useAdaptiveThresholding )
+			extractor.setAdaptiveThreshold();
+		else
+			extractor.setBinaryThreshold( binaryThresholdValue );
+
+		// choose the pyramid level on which quadrangles are searched
+		unsigned nLevel = options.nDetectionLevel;
+		while ( nLevel > 0 && ( img.width() >> nLevel ) < g_nMinDetectionWidth )
+			nLevel--;
+
+		Image* pDetectionImg = &img;
+		if ( nLevel > 0 )
 		{
-			#ifdef DO_TIMING
-			UBITRACK_TIME( g_blockTimer1 );
-			#endif
-			// The source image is copied as OpenCV from beta 5 on destroys it
-			if(useAdaptiveThresholding){
-				if (img.isOnGPU()){
-					cv::adaptiveThreshold(img.uMat(), thresholded.uMat(), 255, cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY, (img.height() / 48) | 1, 4.0);
-				}
-				else{
-					cv::adaptiveThreshold(img.Mat(), thresholded.uMat(), 255, cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY, (img.height() / 48) | 1, 4.0);
-				}
-			} else {
-				if (img.isOnGPU()){
-					cv::threshold(img.uMat(), thresholded.Mat(), binaryThresholdValue, 255, cv::THRESH_BINARY);
-				}
-				else{
-					cv::threshold(img.Mat(), thresholded.Mat(), binaryThresholdValue, 255, cv::THRESH_BINARY);
-				}
-			}
+			ImagePyramid& pyramid( options.pPyramid ? *options.pPyramid : context.pyramid() );
+			if ( !options.pPyramid || pyramid.base() != &img )
+				pyramid.reset( img );
+			pDetectionImg = &pyramid.level( nLevel );
 		}
+		const int nScale = 1 << nLevel;
 
-		MarkerList markers;
+		// search windows on the detection level
+		for ( std::vector< cv::Rect >::iterator itWindow = searchWindows.begin(); itWindow != searchWindows.end(); itWindow++ )
 		{
-			#ifdef DO_TIMING 
-			UBITRACK_TIME( g_blockTimer2 );
-			#endif
-			// find markers in the image
-			markers = findQuadrangles( thresholded, pDebugImg);
+			int x1 = ( itWindow->x + itWindow->width + nScale - 1 ) / nScale;
+			int y1 = ( itWindow->y + itWindow->height + nScale - 1 ) / nScale;
+			itWindow->x /= nScale;
+			itWindow->y /= nScale;
+			itWindow->width = x1 - itWindow->x;
+			itWindow->height = y1 - itWindow->y;
 		}
+		extractor.setRegionsOfInterest( searchWindows );
+
+		MarkerList markers;
+		extractor.extract( *pDetectionImg, markers, nLevel ? 0 : pDebugImg );
+		if ( pStats )
 		{
-			#ifdef DO_TIMING
-			UBITRACK_TIME( g_blockTimer3 );
-			#endif
-			int iShownMarker = 0;
+			pStats->bTrackingScan = bTrackingScan;
+			pStats->nDetectionLevel = nLevel;
+			pStats->nContours = extractor.contourCount();
+			pStats->stageTimes[ DetectionStatistics::EThreshold ] = extractor.binarizationTime();
+			pStats->stageTimes[ DetectionStatistics::EContour ] = extractor.contourTime();
+		}
+
+		// lift the candidates to full resolution, where they are refined
+		if ( nLevel > 0 )
 			for ( MarkerList::iterator it = markers.begin(); it != markers.end(); it++ )
+				for ( CornerList::iterator itCorner = it->begin(); itCorner != it->end(); itCorner++ )
+					*itCorner *= static_cast< float >( nScale );
+		{
+			DetectionContext::DecodingBuffers& buffers( context.decodingBuffers() );
+			buffers.resize( markers.size(), iMarkerSize );
+
+			if ( ( options.bParallelDecoding || options.bParallelRefinement ) && !pDebugImg && markers.size() > 1 )
 			{
-				markerCalculations(*it, img, pDebugImg, markerInfos, K, invK, iCodeSize, iMarkerSize, uiMask, useInnerEdgels);
+				// make sure the image is downloaded before the workers share it
+				img.Mat();
+
+				if ( !options.bParallelDecoding )
+					decodeCandidates( markers, 0, static_cast< int >( markers.size() ), img, 0, buffers, iCodeSize, iMarkerSize, uiMask, options, pStats );
+
+				std::vector< CandidateResult > results( markers.size() );
+				boost::mutex statsMutex;
+				cv::parallel_for_( cv::Range( 0, static_cast< int >( markers.size() ) ),
+					ParallelMarkerCalculations< InfoMap >( markers, buffers, results, img, markerInfos, K, invK, iCodeSize, iMarkerSize, uiMask, useInnerEdgels, options,
+						options.bParallelDecoding, pStats, statsMutex ) );
+
+				// keep one candidate per code, the one with the smallest residual, or the last one if the residuals are
+				// equal, e.g. because they were not computed. The serial path instead updates the info with every candidate.
+				std::map< unsigned long long int, const CandidateResult* > bestResults;
+				for ( std::vector< CandidateResult >::const_iterator itResult = results.begin(); itResult != results.end(); itResult++ )
+				{
+					if ( !itResult->nCode )
+						continue;
+
+					const CandidateResult*& pBest( bestResults[ itResult->nCode ] );
+					if ( !pBest || itResult->info.fResidual <= pBest->info.fResidual )
+						pBest = &*itResult;
+				}
+
+				for ( std::map< unsigned long long int, const CandidateResult* >::const_iterator itBest = bestResults.begin(); 
+					itBest != bestResults.end(); itBest++ )
+					markerInfos[ itBest->first ] = itBest->second->info;
+			}
+			else
+			{
+				decodeCandidates( markers, 0, static_cast< int >( markers.size() ), img, pDebugImg, buffers, iCodeSize, iMarkerSize, uiMask, options, pStats );
+				for ( std::size_t i = 0; i < markers.size(); i++ )
+				{
+					markerCalculations( markers[ i ], buffers.homographies[ i ], buffers.rotations[ i ], buffers.codes[ i ], buffers.correctedBits[ i ],
+						img, pDebugImg, markerInfos, K, invK, iCodeSize, iMarkerSize, uiMask, useInnerEdgels, pStats );
+				}
 			}
 		}
 
+		// schedule the next full-frame analysis
+		context.nWidth = img.width();
+		context.nHeight = img.height();
+		if ( bTrackingScan )
+		{
+			context.nFramesSinceFullScan++;
+			context.bFullScanRequested = false;
+			for ( std::vector< unsigned long long int >::iterator itCode = trackedCodes.begin(); itCode != trackedCodes.end(); itCode++ )
+				if ( markerInfos[ *itCode ].found == MarkerInfo::ENotFound )
+				{
+					LOG4CPP_DEBUG( logger, "lost tracked marker 0x" << std::hex << *itCode << ", analysing full frame next" );
+					context.bFullScanRequested = true;
+				}
+		}
+		else
+		{
+			context.nFramesSinceFullScan = 0;
+			context.bFullScanRequested = false;
+		}
+
 	}
 	else
 	{	
 		LOG4CPP_TRACE( logger, "detectMarkers(): refinement only" );	
-		#ifdef DO_TIMING
-		UBITRACK_TIME( g_blockTimer4 );
-		#endif
-		// declaration of variables
-		std::map<unsigned long long int, MarkerInfo>::iterator it;		
-		for ( it = markerInfos.begin(); it != markerInfos.end(); it++ )
-		{	
-			markerCalculationsRefine(it->first, img, pDebugImg, markerInfos, K, invK, iCodeSize, iMarkerSize, uiMask, useInnerEdgels);
+		if ( options.bParallelRefinement && !pDebugImg && markerInfos.size() > 1 )
+		{
+			// make sure the image is downloaded before the workers share it
+			img.Mat();
+
+			std::vector< RefinementTask > tasks;
+			tasks.reserve( markerInfos.size() );
+			for ( typename InfoMap::iterator it = markerInfos.begin(); it != markerInfos.end(); it++ )
+				if ( isRefinable( it->first, it->second ) )
+					tasks.push_back( RefinementTask( it->first, &it->second ) );
+
+			boost::mutex statsMutex;
+			cv::parallel_for_( cv::Range( 0, static_cast< int >( tasks.size() ) ),
+				ParallelMarkerRefinement( tasks, img, K, invK, iCodeSize, iMarkerSize, uiMask, useInnerEdgels, pStats, statsMutex ) );
+		}
+		else
+		{
+			for ( typename InfoMap::iterator it = markerInfos.begin(); it != markerInfos.end(); it++ )
+			{	
+				if ( isRefinable( it->first, it->second ) )
+					markerCalculationsRefine(it->first, it->second, img, pDebugImg, K, invK, iCodeSize, iMarkerSize, uiMask, useInnerEdgels, pStats);
+			}
 		}
 	}
 
-	#ifdef DO_TIMING	
-	LOG4CPP_INFO( logger, g_blockTimer1);				
-	LOG4CPP_INFO( logger, g_blockTimer2);				
-	LOG4CPP_INFO( logger, g_blockTimer3);				
-	LOG4CPP_INFO( logger, g_blockTimer4);				
-	
-	#endif
+	if ( pStats )
+		pStats->fTotalTime = 1000.0 * ( cv::getTickCount() - startTicks ) / cv::getTickFrequency();
 }
+
+
+void detectMarkers( Image& img, MarkerInfoMap& markerInfos, 
+	const Math::Matrix< float, 3, 3 >& K,  Image* pDebugImg, bool bRefine, 
+	unsigned int iCodeSize, unsigned int iMarkerSize, unsigned long long int uiMask, bool useInnerEdgels,
+	bool useAdaptiveThresholding, int binaryThresholdValue, const DetectionOptions& options )
+{
+	detectMarkersImpl( img, markerInfos, K, pDebugImg, bRefine, iCodeSize, iMarkerSize, uiMask, useInnerEdgels,
+		useAdaptiveThresholding, binaryThresholdValue, options );
+}
+
+
+void detectMarkers( Image& img, MarkerInfoTable& markerInfos, 
+	const Math::Matrix< float, 3, 3 >& K,  Image* pDebugImg, bool bRefine, 
+	unsigned int iCodeSize, unsigned int iMarkerSize, unsigned long long int uiMask, bool useInnerEdgels,
+	bool useAdaptiveThresholding, int binaryThresholdValue, const DetectionOptions& options )
+{
+	detectMarkersImpl( img, markerInfos, K, pDebugImg, bRefine, iCodeSize, iMarkerSize, uiMask, useInnerEdgels,
+		useAdaptiveThresholding, binaryThresholdValue, options );
+}
+
 #endif // HAVE_LAPACK
 
 
@@ -728,77 +1536,12 @@ bool checkRefinedMarker(const Math::Matrix< float, 3, 3 >& K, Math::Pose checkPo
 
 MarkerList findQuadrangles( Image& img, Image * pDbgImg, cv::Point offset)
 {
-	// initialize return value
-	MarkerList ret;
-
-	// create memory storage that will contain all the dynamic data
-	CvMemStorage* pStorage = cvCreateMemStorage( 0 );
-
-	// Create dynamic structure and sequence.
-	CvSeq* pContours = cvCreateSeq( CV_SEQ_ELTYPE_POINT, sizeof( CvSeq ), sizeof( CvPoint ), pStorage );
-
-	// Find all contours.
-	IplImage cvimg = img.Mat();
-	cvFindContours( &cvimg, pStorage, &pContours, sizeof( CvContour ),
-		CV_RETR_LIST, CV_CHAIN_APPROX_SIMPLE, offset );
-
-	// approximate all contours by polygons and check size and corner number
-	for ( CvSeq* pContour = pContours; pContour; pContour = pContour->h_next ) 
-	{
-		CvRect boundingRect = cvBoundingRect( pContour );
-		
-		const float fDiameter = sqrtf( static_cast< float >( boundingRect.height * boundingRect.height + boundingRect.width * boundingRect.width ) );
-		
-		// CW@2015-04-02: starts to annoy me: several times a marker was not detected because it was to big (although I am using a really ibg image ;)
-		// introducing now relative size checks instead of absolute ones, hope that helps, otherwise please correct here
-		// taking the diagonal from vga resolution(==800) for building the bounds measured in pixels
-		static const float lowerBound = (30/800.0f); // ~=3,75 %
-		static const float upperBound = (650/800.0f); // ~= 81,25 %
-		static const float fDiagonal = sqrtf( std::pow( img.width(), 2.0f ) + std::pow( img.height(), 2.0f ) );
-		const float ratio = fDiameter / fDiagonal;
-		
-		
-		// discard too small contours
-		if ( ratio < lowerBound )
-			continue;
-
-		// discard too large contours
-		if ( ratio > upperBound )
-			continue;
-	
-		// approximate contour by few corners
-		CvSeq* pApproxChain = cvApproxPoly( pContour, sizeof( CvContour ), pStorage,
-			CV_POLY_APPROX_DP, fDiameter * 0.03f + 2.0f, 0 );
-
-		int nCorners = pApproxChain->total; // This is number point in contour
-
-		// discard non-quadrangles
-		if ( nCorners != 4 )
-			continue;
-
-		// Alloc memory for contour point set. 
-		boost::scoped_array< CvPoint > pPointArray( new CvPoint[ nCorners ] );
-
-		// Get contour point set and append to list
-		cvCvtSeqToArray( pApproxChain, pPointArray.get(), CV_WHOLE_SEQ );
-
-		CornerList rect( 4 );
-		for ( int i = 0; i < 4; i++ ) 
-		{
-			rect[ i ][ 0 ] = static_cast< float >( pPointArray[ i ].x );
-			rect[ i ][ 1 ] = static_cast< float >( pPointArray[ i ].y );
-		}
-
-		if (pDbgImg) {
-			IplImage dbgImg = pDbgImg->Mat();
-			cvDrawContours( &dbgImg, pApproxChain, CV_RGB ( 255, 0, 255), CV_RGB( 255, 0, 255 ), -1);
-		}
-
-		ret.push_back( rect );
-	}
-	// cleanup	     
-	cvReleaseMemStorage( &pStorage );
+	// the image is already thresholded
+	QuadrangleExtractor extractor;
+	extractor.setBinaryThreshold( 0 );
 
+	MarkerList ret;
+	extractor.extract( img, ret, pDbgImg, offset );
 	return ret;
 }
 
@@ -972,103 +1715,130 @@ bool refineCorners( Image& img, CornerList& corners, Image* pDebugImg )
  
 
 boost::shared_ptr< Image > getMarkerImage( Image& img, const Math::Matrix< float, 3, 3 > homography, int nSize )
-	{
-	// compute a suitable scaling matrix that maps 
-	// for x: -0.5 -> -1 and (nSize-0.5) -> +1
-	// for y: -0.5 -> +1 and (nSize-0.5) -> -1
-	Math::Matrix< float, 3, 3 > hScale;
-	
-	float m = 1.0f / nSize;
-	hScale( 0, 0 ) = m;
-	hScale( 0, 1 ) = 0.0f;
-	hScale( 0, 2 ) = 0.5f * m - 0.5f;
-	hScale( 1, 0 ) = 0.0f;
-	hScale( 1, 1 ) = -hScale( 0, 0 );
-	hScale( 1, 2 ) = -hScale( 0, 2 );
-	hScale( 2, 0 ) = 0.0f;
-	hScale( 2, 1 ) = 0.0f;
-	hScale( 2, 2 ) = 1.0f;
-
-	// transpose because of column major representation in Matrix
-	Math::Matrix< float, 3, 3 > Htrans = ublas::trans( ublas::prod( homography, hScale ) );	
-	CvMat cvH = cvMat( 3, 3, CV_32FC1, Htrans.content() );
-	
+{
 	// create target image
 	boost::shared_ptr< Image > r( new Image( nSize, nSize, 1 ) );
-	
-	// apply homography
-	IplImage cvimg = img.Mat();
-	IplImage cvout = r->Mat();
-	cvWarpPerspective( &cvimg, &cvout, &cvH,
-		CV_INTER_LINEAR + CV_WARP_FILL_OUTLIERS + CV_WARP_INVERSE_MAP, cvScalar( 128 ) );
+	assert( r->Mat().isContinuous() );
 
+	sampleMarkerCells( img, &homography, 1, nSize, r->Mat().data );
 	return r;
-	}
+}
 
 
-unsigned long long int readCode( Image& markerImage, unsigned int iCodeSize, unsigned long long int uiMask )
+void sampleMarkerCells( Image& img, const Math::Matrix< float, 3, 3 >* pHomographies, std::size_t nMarkers, int nSize, unsigned char* pCells )
 {
-	// This method only works for square markers...
-	assert( markerImage.height() == markerImage.width() );
-	
-	LOG4CPP_TRACE( logger, "readCode(): markerImage.width: " << markerImage.width() 
-		<< ", markerImage.height: " << markerImage.height()  
-		<< ", iCodeSize: " << iCodeSize 
-		<< ", markerImage.widthStep: " <<  markerImage.Mat().step 
-		<< ", markerImage.width: " << markerImage.width() );
+	const cv::Mat& mat( img.Mat() );
+	const float fMaxX = static_cast< float >( mat.cols - 1 );
+	const float fMaxY = static_cast< float >( mat.rows - 1 );
+
+	// the cell centres are mapped to the square coordinates used by squareHomography 
+	// for x: -0.5 -> -1 and (nSize-0.5) -> +1
+	// for y: -0.5 -> +1 and (nSize-0.5) -> -1
+	const float m = 1.0f / nSize;
+	const float c0 = 0.5f * m - 0.5f;
+
+	for ( std::size_t i = 0; i < nMarkers; i++ )
+	{
+		const Math::Matrix< float, 3, 3 >& H( pHomographies[ i ] );
+
+		// homogeneous image coordinates are linear along a row of cells
+		const float dx = H( 0, 0 ) * m;
+		const float dy = H( 1, 0 ) * m;
+		const float dw = H( 2, 0 ) * m;
+
+		for ( int v = 0; v < nSize; v++ )
+		{
+			const float sy = -( c0 + v * m );
+			float x = H( 0, 0 ) * c0 + H( 0, 1 ) * sy + H( 0, 2 );
+			float y = H( 1, 0 ) * c0 + H( 1, 1 ) * sy + H( 1, 2 );
+			float w = H( 2, 0 ) * c0 + H( 2, 1 ) * sy + H( 2, 2 );
+
+			for ( int u = 0; u < nSize; u++, x += dx, y += dy, w += dw )
+			{
+				const float fx = x / w;
+				const float fy = y / w;
 
+				// also catches NaNs
+				if ( !( fx >= 0.0f && fy >= 0.0f && fx < fMaxX && fy < fMaxY ) )
+				{
+					*pCells++ = 128;
+					continue;
+				}
+
+				const int ix = static_cast< int >( fx );
+				const int iy = static_cast< int >( fy );
+				const float ax = fx - ix;
+				const float ay = fy - iy;
+				const unsigned char* p0 = mat.ptr< unsigned char >( iy ) + ix;
+				const unsigned char* p1 = p0 + mat.step;
+
+				const float top = p0[ 0 ] + ax * ( p0[ 1 ] - p0[ 0 ] );
+				const float bottom = p1[ 0 ] + ax * ( p1[ 1 ] - p1[ 0 ] );
+				*pCells++ = static_cast< unsigned char >( top + ay * ( bottom - top ) + 0.5f );
+			}
+		}
+	}
+}
+
+
+/**
+ * \internal
+ * reads the marker code from nSize x nSize cells with a row step of \c step.
+ */
+static unsigned long long int readCode( const unsigned char* pCells, std::size_t step, int nSize, unsigned int iCodeSize, unsigned long long int uiMask )
+{
 	// find threshold
 	int nAvg = 0;
-	const unsigned char* pData = reinterpret_cast< const unsigned char* >( markerImage.Mat().data ); 
-	for ( int y = 0; y < markerImage.width(); y++ )	
+	const unsigned char* pData = pCells; 
+	for ( int y = 0; y < nSize; y++ )	
 		{
-		for ( int x = 0; x < markerImage.width(); x++ )	
+		for ( int x = 0; x < nSize; x++ )	
 			nAvg += *pData++;
-		pData += markerImage.Mat().step - markerImage.width();
+		pData += step - nSize;
 		}
 		
-	nAvg /= markerImage.width() * markerImage.height();
+	nAvg /= nSize * nSize;
 	
 	// check if border is black
 	int nBlackBorderPixels = 0;
-	pData = reinterpret_cast< const unsigned char* >( markerImage.Mat().data ); 
-	unsigned int nBorderThickness = (markerImage.width() - iCodeSize) / 2;
+	pData = pCells; 
+	unsigned int nBorderThickness = (nSize - iCodeSize) / 2;
 	// Iterate border thickness
 	for ( unsigned int j = 0; j < nBorderThickness; j++ ) {
 		// Iterate all horizontal border pixels
-		for ( int i = 0; i < markerImage.width(); i++ )
+		for ( int i = 0; i < nSize; i++ )
 		{
 			// upper border
-			if ( pData[ j * markerImage.Mat().step + i ] <= nAvg )
+			if ( pData[ j * step + i ] <= nAvg )
 				nBlackBorderPixels++;
 			// lower border
-			if ( pData[ markerImage.Mat().step * ( markerImage.height() - 1 - j) + i ] <= nAvg )
+			if ( pData[ step * ( nSize - 1 - j) + i ] <= nAvg )
 				nBlackBorderPixels++;
 		}
 		// Iterate remaining vertical border pixels
-		for ( unsigned int i = nBorderThickness; i < markerImage.height() - nBorderThickness; i++ )
+		for ( unsigned int i = nBorderThickness; i < nSize - nBorderThickness; i++ )
 		{
 			// left
-			if ( pData[ i * markerImage.Mat().step + j ] <= nAvg )
+			if ( pData[ i * step + j ] <= nAvg )
 				nBlackBorderPixels++;
 			// right
-			if ( pData[ i * markerImage.Mat().step + markerImage.width() - 1 - j ] <= nAvg )
+			if ( pData[ i * step + nSize - 1 - j ] <= nAvg )
 				nBlackBorderPixels++;
 		}
 	}
 		
-	if ( nBlackBorderPixels < 2 * markerImage.width() + 2 * ( markerImage.height() - 2 ) - g_nMaxWhiteBorderPixels ) {
+	if ( nBlackBorderPixels < 2 * nSize + 2 * ( nSize - 2 ) - g_nMaxWhiteBorderPixels ) {
 		LOG4CPP_TRACE( logger, "readCode(): black border corrupt" );
 		return 0;
 	}
 		
 	// compute marker code
 	unsigned long long int nMarkerCode = 0;
-	unsigned int uiBorderWidth = (markerImage.width() - iCodeSize) / 2;
-	for ( unsigned int y = uiBorderWidth; y < (markerImage.width() - uiBorderWidth); y++ )	
-		for ( unsigned int x = uiBorderWidth; x < (markerImage.width() - uiBorderWidth); x++ )
-			if ( pData[ y * markerImage.Mat().step + x ] <= nAvg )
-				nMarkerCode |= ((unsigned long long int)1) << ( (markerImage.width() - uiBorderWidth - y - 1) * iCodeSize + (markerImage.width() - uiBorderWidth - x - 1) );
+	unsigned int uiBorderWidth = (nSize - iCodeSize) / 2;
+	for ( unsigned int y = uiBorderWidth; y < (nSize - uiBorderWidth); y++ )	
+		for ( unsigned int x = uiBorderWidth; x < (nSize - uiBorderWidth); x++ )
+			if ( pData[ y * step + x ] <= nAvg )
+				nMarkerCode |= ((unsigned long long int)1) << ( (nSize - uiBorderWidth - y - 1) * iCodeSize + (nSize - uiBorderWidth - x - 1) );
 					
 	LOG4CPP_TRACE( logger, "readCode(): raw code: 0x" << std::hex << nMarkerCode );
 
@@ -1081,29 +1851,109 @@ unsigned long long int readCode( Image& markerImage, unsigned int iCodeSize, uns
 }
 
 
+unsigned long long int readCode( const unsigned char* pCells, unsigned int iMarkerSize, unsigned int iCodeSize, unsigned long long int uiMask )
+{
+	return readCode( pCells, iMarkerSize, static_cast< int >( iMarkerSize ), iCodeSize, uiMask );
+}
+
+
+unsigned long long int readCode( Image& markerImage, unsigned int iCodeSize, unsigned long long int uiMask )
+{
+	// This method only works for square markers...
+	assert( markerImage.height() == markerImage.width() );
+	
+	LOG4CPP_TRACE( logger, "readCode(): markerImage.width: " << markerImage.width() 
+		<< ", markerImage.height: " << markerImage.height()  
+		<< ", iCodeSize: " << iCodeSize 
+		<< ", markerImage.widthStep: " <<  markerImage.Mat().step 
+		<< ", markerImage.width: " << markerImage.width() );
+
+	return readCode( markerImage.Mat().data, markerImage.Mat().step, markerImage.width(), iCodeSize, uiMask );
+}
+
+
 /** 
  * \internal
- * rotates a marker code 90 degrees counter-clockwise.
+ * rotates a marker code 90 degrees counter-clockwise, bit by bit.
  *
  * @param nCode code to rotate
  * @param codeLen side-length of marker code
  * @return rotated marker code
  */
-unsigned long long int rotateMarkerCode( unsigned long long int nCode, int codeLen )
+static unsigned long long int rotateMarkerCodeBitwise( unsigned long long int nCode, int codeLen )
 {
-	LOG4CPP_TRACE( logger, "rotateMarkerCode(): old: 0x" << std::hex << nCode );
-
 	unsigned long long int nRotCode = 0;
 	for ( int j = 0; j < codeLen * codeLen; j++ )
 		if ( ( nCode & ( ((unsigned long long int)1) << j ) ) != 0 )
 			nRotCode |= ((unsigned long long int)1) << ( codeLen * ( j % codeLen ) + codeLen - 1 - ( j / codeLen ) );
 
-	LOG4CPP_TRACE( logger, "rotateMarkerCode(): new: 0x" << std::hex << nRotCode );
-
 	return nRotCode;
 }
 
 
+/**
+ * \internal
+ * Lookup tables for rotating marker codes of all sizes up to 8x8. A rotation is a permutation of the
+ * code bits, so the rotated code is the combination of the rotated bytes of the code.
+ */
+class CodeRotationTables
+{
+public:
+	/** largest supported side-length of a marker code */
+	static const int s_maxCodeLen = 8;
+
+	CodeRotationTables()
+	{
+		for ( int codeLen = 1; codeLen <= s_maxCodeLen; codeLen++ )
+		{
+			const int nBytes = ( codeLen * codeLen + 7 ) / 8;
+			m_nBytes[ codeLen ] = nBytes;
+			m_tables[ codeLen ].resize( nBytes * 256 );
+			for ( int iByte = 0; iByte < nBytes; iByte++ )
+				for ( int v = 0; v < 256; v++ )
+					m_tables[ codeLen ][ iByte * 256 + v ] = rotateMarkerCodeBitwise( ((unsigned long long int)v) << ( 8 * iByte ), codeLen );
+		}
+	}
+
+	/** rotates a code 90 degrees counter-clockwise, codeLen must be in [1, s_maxCodeLen] */
+	unsigned long long int rotate( unsigned long long int nCode, int codeLen ) const
+	{
+		const unsigned long long int* pTable = &m_tables[ codeLen ][ 0 ];
+		unsigned long long int nRotCode = 0;
+		for ( int iByte = 0; iByte < m_nBytes[ codeLen ]; iByte++, pTable += 256 )
+			nRotCode |= pTable[ ( nCode >> ( 8 * iByte ) ) & 0xFF ];
+		return nRotCode;
+	}
+
+protected:
+	/** number of bytes of a code */
+	int m_nBytes[ s_maxCodeLen + 1 ];
+
+	/** rotated bits for each byte of a code and each byte value */
+	std::vector< unsigned long long int > m_tables[ s_maxCodeLen + 1 ];
+};
+
+/** the rotation tables, built when the library is loaded */
+static const CodeRotationTables g_codeRotationTables;
+
+
+/** 
+ * \internal
+ * rotates a marker code 90 degrees counter-clockwise.
+ *
+ * @param nCode code to rotate
+ * @param codeLen side-length of marker code
+ * @return rotated marker code
+ */
+unsigned long long int rotateMarkerCode( unsigned long long int nCode, int codeLen )
+{
+	if ( codeLen < 1 || codeLen > CodeRotationTables::s_maxCodeLen )
+		return rotateMarkerCodeBitwise( nCode, codeLen );
+
+	return g_codeRotationTables.rotate( nCode, codeLen );
+}
+
+
 unsigned long long int normalizeCode( unsigned long long int nCode, int codeSize, int& nRotations )
 {
 	LOG4CPP_TRACE( logger, "normalizeCode(): old: 0x" << std::hex << nCode );
@@ -35,12 +35,18 @@
 #include <list>
 #include <vector>
 #include <map>
+#include <boost/utility.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_set.hpp>
 #include <utVision.h>
 #include <utMath/Vector.h>
 #include <utMath/Matrix.h>
 #include <utMath/Pose.h>
 #include "Image.h"
+#include "ImagePyramid.h"
 #include "PixelFlow.h"
+#include "MarkerMotionModel.h"
 
 namespace Ubitrack { namespace Vision { namespace Markers {
 
@@ -50,6 +56,9 @@ typedef std::vector< Ubitrack::Math::Vector< float, 2 > > CornerList;
 /** a list of polygons */
 typedef std::vector< CornerList > MarkerList;
 
+/** \internal inputs and result of a deferred covariance computation, see MarkerInfo::bDeferCovariance */
+struct DeferredCovariance;
+
 /** information about a marker */
 struct MarkerInfo
 {
@@ -59,15 +68,18 @@ struct MarkerInfo
 		, refinement( EEdgeRefinedPose )
 		, bEnableInterpolation( false )
 		, bEnablePixelFlow( false )
+		, bEnableMotionModel( false )
 		, bEnableFlipCheck( true )
 		, bEnableTracking( true )
 		, bEnableFastTracking( false )
 		, bUseInitialPose( false )
 		, bCalculateCovariance( false )
+		, bDeferCovariance( false )
 		, found( ENotFound )
 		, nPrevPoseValidator( 0 )
 		, fResidual( 0 )
 		, nLostFrameCount( 0 )
+		, nCorrectedBits( 0 )
 	{}
 
 	/** marker size in meters */
@@ -90,6 +102,12 @@ struct MarkerInfo
 	
 	/** enables pixel flow for prediction */
 	bool bEnablePixelFlow;
+
+	/** 
+	 * predict the pose with a constant-velocity Kalman filter, which also limits the edge search range
+	 * according to the predicted uncertainty. Every call of detectMarkers counts as one frame.
+	 */
+	bool bEnableMotionModel;
 	
 	/** check alternate marker pose to prevent flipping? */
 	bool bEnableFlipCheck;
@@ -109,6 +127,13 @@ struct MarkerInfo
 	/** calculate covariance? */
 	bool bCalculateCovariance;
 
+	/** 
+	 * if bCalculateCovariance is set, only store what is needed to compute the covariance and compute it 
+	 * on the first call of getCovariance(), which saves the computation for consumers that never read it.
+	 * \c covariance is not written in this case.
+	 */
+	bool bDeferCovariance;
+
 	/** return value that describes if and how the marker was detected */
 	enum FoundState
 	{
@@ -125,11 +150,23 @@ struct MarkerInfo
 	/** pose of the marker */
 	Math::Pose pose;
 
-	/** covariance matrix */
+	/** covariance matrix, computed by detectMarkers if bCalculateCovariance is set and bDeferCovariance is not */
 	Math::Matrix< double, 6, 6 > covariance;
 
+	/** 
+	 * returns the covariance matrix. If its computation was deferred, it is computed on the first call,
+	 * which may happen from several threads at once. Copies of the info share the deferred computation.
+	 */
+	UTVISION_EXPORT const Math::Matrix< double, 6, 6 >& getCovariance() const;
+
+	/** defers the computation of the covariance of the given pose, detected with the camera matrix K */
+	UTVISION_EXPORT void deferCovariance( const Math::Pose& pose, const Math::Matrix< float, 3, 3 >& K );
+
 	// INTERNAL 
 
+	/** deferred covariance, 0 if \c covariance holds the current one */
+	boost::shared_ptr< DeferredCovariance > pDeferredCovariance;
+
 	/** previous pose of the marker */
 	Math::Pose prevPose;
 
@@ -144,15 +181,286 @@ struct MarkerInfo
 
 	/** Counts how many frames ago the marker was lost */
 	unsigned nLostFrameCount;
+
+	/** number of code bits that were corrected by the marker dictionary in the last detection */
+	unsigned nCorrectedBits;
 	
 	/** information about pixel flow */
 	PixelFlow pFlow;
+
+	/** motion model for prediction, see bEnableMotionModel */
+	MarkerMotionModel motionModel;
 };
 
 
 /** map of marker infos */
 typedef std::map< unsigned long long int, MarkerInfo > MarkerInfoMap;
 
+/** set of normalized marker codes */
+typedef boost::unordered_set< unsigned long long int > MarkerCodeSet;
+
+
+class QuadrangleExtractor;
+class MarkerDictionary;
+class MarkerInfoTable;
+
+/**
+ * State that detectMarkers keeps between the frames of one image stream, e.g. for deciding
+ * when the full frame needs to be analysed again. Use one context per stream and do not
+ * share it between threads.
+ */
+class UTVISION_EXPORT DetectionContext
+	: private boost::noncopyable
+{
+public:
+	/** constructor */
+	DetectionContext();
+
+	/** destructor */
+	~DetectionContext();
+
+	/** forget everything about previous frames */
+	void reset();
+
+	/** the extractor used to find quadrangle candidates, keeps its buffers between frames */
+	QuadrangleExtractor& quadrangleExtractor();
+
+	/** pyramid of the current frame, used if the caller does not provide one */
+	ImagePyramid& pyramid()
+	{ return m_pyramid; }
+
+	// INTERNAL
+
+	/** buffers for decoding the quadrangle candidates of a frame */
+	struct DecodingBuffers;
+	DecodingBuffers& decodingBuffers();
+
+	/** number of frames that were analysed in search windows only since the last full-frame analysis */
+	unsigned nFramesSinceFullScan;
+
+	/** forces a full-frame analysis of the next frame, e.g. because a tracked marker was lost */
+	bool bFullScanRequested;
+
+	/** size of the previous frame */
+	int nWidth;
+	int nHeight;
+
+protected:
+	boost::scoped_ptr< QuadrangleExtractor > m_pExtractor;
+	boost::scoped_ptr< DecodingBuffers > m_pDecodingBuffers;
+	ImagePyramid m_pyramid;
+};
+
+
+/**
+ * Counters and timings of one call to detectMarkers, for finding out where the time of a frame goes.
+ * Times are in milliseconds. Stages that run on several threads report the sum over all threads.
+ */
+struct DetectionStatistics
+{
+	/** processing stages */
+	enum Stage
+	{
+		EThreshold,         // binarization of the image
+		EContour,           // contour following and polygon approximation
+		ECornerRefinement,  // sub-pixel refinement of the candidate corners
+		EDecode,            // sampling and decoding of the marker codes
+		EPoseEstimation,    // pose from homography and corner-based optimization
+		EEdgeRefinement,    // edge-based pose refinement
+		EFlipCheck,         // refinement of the alternate pose
+		EPixelFlow,         // pixel flow prediction
+		EStageCount
+	};
+
+	/** constructor */
+	DetectionStatistics()
+	{ reset(); }
+
+	/** sets all counters and times to zero */
+	void reset()
+	{
+		for ( int i = 0; i < EStageCount; i++ )
+			stageTimes[ i ] = 0.0;
+		fTotalTime = 0.0;
+		bTrackingScan = false;
+		nDetectionLevel = 0;
+		nContours = 0;
+		nCandidates = 0;
+		nRejectedCorners = 0;
+		nRejectedCodes = 0;
+		nUnknownMarkers = 0;
+		nDetected = 0;
+		nRefined = 0;
+		nLost = 0;
+		nFlips = 0;
+		nEdgeRefinements = 0;
+		nLMIterations = 0;
+	}
+
+	/** adds the counters and times of another object, e.g. of a worker thread */
+	void add( const DetectionStatistics& other )
+	{
+		for ( int i = 0; i < EStageCount; i++ )
+			stageTimes[ i ] += other.stageTimes[ i ];
+		nContours += other.nContours;
+		nCandidates += other.nCandidates;
+		nRejectedCorners += other.nRejectedCorners;
+		nRejectedCodes += other.nRejectedCodes;
+		nUnknownMarkers += other.nUnknownMarkers;
+		nDetected += other.nDetected;
+		nRefined += other.nRefined;
+		nLost += other.nLost;
+		nFlips += other.nFlips;
+		nEdgeRefinements += other.nEdgeRefinements;
+		nLMIterations += other.nLMIterations;
+	}
+
+	/** name of a stage, for printing */
+	static const char* stageName( Stage stage )
+	{
+		static const char* names[ EStageCount ] = { "threshold", "contour", "corner refinement", "decode",
+			"pose estimation", "edge refinement", "flip check", "pixel flow" };
+		return names[ stage ];
+	}
+
+	/** time spent in each stage */
+	double stageTimes[ EStageCount ];
+
+	/** wall-clock time of the whole call */
+	double fTotalTime;
+
+	/** was the frame only analysed in search windows? */
+	bool bTrackingScan;
+
+	/** pyramid level on which quadrangles were searched */
+	unsigned nDetectionLevel;
+
+	/** number of contours that were approximated by polygons */
+	unsigned nContours;
+
+	/** number of quadrangle candidates */
+	unsigned nCandidates;
+
+	/** candidates whose corners could not be refined */
+	unsigned nRejectedCorners;
+
+	/** candidates without a valid marker code */
+	unsigned nRejectedCodes;
+
+	/** candidates with a valid code for which no marker info exists */
+	unsigned nUnknownMarkers;
+
+	/** markers found by the full detection */
+	unsigned nDetected;
+
+	/** markers found by the refinement only mode */
+	unsigned nRefined;
+
+	/** markers that were lost in the refinement only mode */
+	unsigned nLost;
+
+	/** refinements in which the flip check chose the alternate pose */
+	unsigned nFlips;
+
+	/** number of edge-based pose refinements, including flip checks */
+	unsigned nEdgeRefinements;
+
+	/** Levenberg-Marquardt iterations of all edge-based pose refinements */
+	unsigned nLMIterations;
+};
+
+
+/** options that control how a frame is processed by detectMarkers */
+struct DetectionOptions
+{
+	/** constructor */
+	DetectionOptions()
+		: bParallelDecoding( false )
+		, bParallelRefinement( false )
+		, nFullScanInterval( 0 )
+		, fSearchWindowMargin( 1.0f )
+		, fMaxSearchWindowArea( 0.5f )
+		, pContext( 0 )
+		, nDetectionLevel( 0 )
+		, pPyramid( 0 )
+		, pValidCodes( 0 )
+		, pDictionary( 0 )
+		, pStatistics( 0 )
+	{}
+
+	/**
+	 * decode and refine the quadrangle candidates of a frame concurrently using the OpenCV parallel
+	 * framework. The results do not depend on thread scheduling. Ignored when a debug image is requested.
+	 *
+	 * Note that the results can differ from the serial detection if a code is found on several candidates,
+	 * e.g. on a reflection: the serial detection updates the marker info with every candidate in turn, 
+	 * while the concurrent one refines each candidate from the previous info and keeps the result with
+	 * the smallest residual. The same applies to \c bParallelRefinement.
+	 */
+	bool bParallelDecoding;
+
+	/**
+	 * estimate and refine the marker poses concurrently, one task per marker. Applies to the decoded
+	 * candidates of a detection, which are still decoded serially unless \c bParallelDecoding is set,
+	 * and to the refinement only mode. The image is shared read-only, every task works on its own
+	 * marker info. Ignored when a debug image is requested.
+	 */
+	bool bParallelRefinement;
+
+	/**
+	 * Enables tracking in search windows. If all markers found in the previous frame have
+	 * \c bEnableTracking and \c bEnableFastTracking set, only windows around their predicted positions
+	 * are thresholded and searched for quadrangles. The full frame is still analysed at least every
+	 * \c nFullScanInterval frames, which is when new markers are found, and in the frame after a
+	 * tracked marker was lost. 0 always analyses the full frame.
+	 */
+	unsigned nFullScanInterval;
+
+	/** amount by which the search windows are enlarged, relative to the predicted marker extent */
+	float fSearchWindowMargin;
+
+	/** the full frame is analysed if the search windows cover more than this fraction of the image */
+	float fMaxSearchWindowArea;
+
+	/** state kept between frames. If 0, a context shared by all calls from the same thread is used. */
+	DetectionContext* pContext;
+
+	/**
+	 * pyramid level on which quadrangle candidates are searched. The corners of the candidates are
+	 * scaled to full resolution before they are refined, decoded and used for pose estimation there.
+	 * Level n finds only markers that are larger than about 2^n times the minimal marker size at full
+	 * resolution, but needs only 1/4^n of the thresholding and contour following work. The level is
+	 * reduced for small images.
+	 */
+	unsigned nDetectionLevel;
+
+	/**
+	 * pyramid of the image that is shared with other consumers of the frame. It must have been reset
+	 * to the image passed to detectMarkers. If 0, the pyramid of the detection context is used.
+	 */
+	ImagePyramid* pPyramid;
+
+	/**
+	 * normalized codes of all markers that may occur. Candidates with other codes are rejected right
+	 * after decoding, even if a marker of code "0000" is present in the map. If 0, all codes are accepted.
+	 */
+	const MarkerCodeSet* pValidCodes;
+
+	/**
+	 * dictionary that is used to decode the candidates. Raw codes are mapped to the nearest code of the
+	 * dictionary within its correctable number of bits, codes that are not close to any are rejected.
+	 * The dictionary must have been created with the same code size and mask.
+	 * If 0, codes are only normalized.
+	 */
+	const MarkerDictionary* pDictionary;
+
+	/**
+	 * receives the counters and timings of the call, see \c DetectionStatistics. The object is reset at
+	 * the beginning of each call. If 0, nothing is measured.
+	 */
+	DetectionStatistics* pStatistics;
+};
+
 
 #ifdef HAVE_LAPACK
 /**
@@ -165,16 +473,30 @@ typedef std::map< unsigned long long int, MarkerInfo > MarkerInfoMap;
  *    If a marker of code "0000" is present in the map, the method will detect ALL markers in the image and add them to the map.
  * @param K camera intrinsics matrix
  * @param pDebugImg creates a debug image if non-null
- * @param bRefine if true, only do refinement, no detection
+ * @param bRefine if true, only do refinement, no detection. Only markers with corners from a previous detection
+ *    are refined, the entry of code "0000" is left unchanged.
  * @param uiCodeSize size of marker's bit pattern
  * @param uiMarkerSize overall size of the marker, counted in bits, including the border and the bit pattern
  * @param uiMask regions of the marker's bit pattern that belong to the ID (1) or not (0)
  * @param useInnerEdgels incorporate inner edgelets into pose refinement. May be unstable.
+ * @param options additional processing options, see \c DetectionOptions
  */
 UTVISION_EXPORT void detectMarkers( Image& img, std::map< unsigned long long int, MarkerInfo >& markers, 
 	const Math::Matrix< float, 3, 3 >& K, Image* pDebugImg = 0, bool bRefine = false, unsigned int iCodeSize = 4, 
 	unsigned int iMarkerSize = 6, unsigned long long int uiMask = 0xFFFF, bool useInnerEdgels = true,
-	bool useAdaptiveThresholding = true, int binaryThresholdValue = 120 );
+	bool useAdaptiveThresholding = true, int binaryThresholdValue = 120,
+	const DetectionOptions& options = DetectionOptions() );
+
+/**
+ * @ingroup vision
+ * Detects markers in the image, see above. The marker infos are kept in a flat \c MarkerInfoTable,
+ * which is updated in place.
+ */
+UTVISION_EXPORT void detectMarkers( Image& img, MarkerInfoTable& markers, 
+	const Math::Matrix< float, 3, 3 >& K, Image* pDebugImg = 0, bool bRefine = false, unsigned int iCodeSize = 4, 
+	unsigned int iMarkerSize = 6, unsigned long long int uiMask = 0xFFFF, bool useInnerEdgels = true,
+	bool useAdaptiveThresholding = true, int binaryThresholdValue = 120,
+	const DetectionOptions& options = DetectionOptions() );
 #endif
 
 /**
@@ -184,7 +506,10 @@ UTVISION_EXPORT void detectMarkers( Image& img, std::map< unsigned long long int
  * For better accuracy, the corner coordinates should be refined using refineCorners afterwards.
  * This function does not respect the origin flag and assumes a y-coordinate of 0 is top.
  *
- * @param img thresholded grey-scale input image. Note: The image will be destructively modified by this routine.
+ * For repeated calls on grey-scale images, use a \c QuadrangleExtractor instead, which also does the thresholding
+ * and keeps its buffers between frames.
+ *
+ * @param img thresholded grey-scale input image
  * @param pDbgImg optional debug image which shows found contours.
  * @param origin additional offset that is added to contour coordinates. Useful when using ROIs.
  * @return list of found markers in image
@@ -223,6 +548,35 @@ UTVISION_EXPORT boost::shared_ptr< Image > getMarkerImage( Image& img, const Mat
  */
 UTVISION_EXPORT unsigned long long int readCode( Image& img, unsigned int uiCodeSize, unsigned long long int uiMask );
 
+/**
+ * @ingroup vision
+ * Reads the marker code from cells sampled by \c sampleMarkerCells.
+ *
+ * @param pCells uiMarkerSize x uiMarkerSize cell values in row-major order
+ * @param uiMarkerSize overall size of the marker, counted in bits, including the border and the bit pattern
+ * @param uiCodeSize size of marker's bit pattern 
+ * @param uiMask regions of the marker's bit pattern that belong to the ID (1) or not (0)
+ * @return unnormalized marker code, 0 if marker code could not be read
+ */
+UTVISION_EXPORT unsigned long long int readCode( const unsigned char* pCells, unsigned int uiMarkerSize, unsigned int uiCodeSize, unsigned long long int uiMask );
+
+/**
+ * @ingroup vision
+ * Samples the cell centres of several markers through their homographies.
+ *
+ * For each homography, the same values as in the image returned by \c getMarkerImage are computed by
+ * bilinear interpolation and written to \c pCells, without allocating memory. Cells outside the image
+ * are set to 128.
+ *
+ * @param img the grey-scale camera image
+ * @param pHomographies homographies as computed by Ubitrack::Algorithm::squareHomography
+ * @param nMarkers number of homographies
+ * @param nSize number of cells per marker side
+ * @param pCells receives nSize x nSize bytes per marker in row-major order
+ */
+UTVISION_EXPORT void sampleMarkerCells( Image& img, const Math::Matrix< float, 3, 3 >* pHomographies, std::size_t nMarkers,
+	int nSize, unsigned char* pCells );
+
 /**
  * @ingroup vision
  * Normalizes a marker code.
@@ -234,6 +588,16 @@ UTVISION_EXPORT unsigned long long int readCode( Image& img, unsigned int uiCode
  */
 UTVISION_EXPORT unsigned long long int normalizeCode( unsigned long long int nCode, int codeSize, int& nRotations );
 
+/**
+ * @ingroup vision
+ * Rotates a marker code 90 degrees counter-clockwise.
+ *
+ * @param nCode code to rotate
+ * @param codeLen side-length of code pattern
+ * @return rotated marker code
+ */
+UTVISION_EXPORT unsigned long long int rotateMarkerCode( unsigned long long int nCode, int codeLen );
+
 /**
  * @ingroup vision
  * Computes edgels for a marker consisting of inner and outer edges
@@ -0,0 +1,275 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @ingroup vision
+ * @file
+ * Implementation of marker dictionaries with error correction.
+ */
+
+#include <assert.h>
+#include <limits>
+#include <algorithm>
+#include "MarkerDictionary.h"
+#include "MarkerDetection.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// get a logger
+#include <log4cpp/Category.hh>
+static log4cpp::Category& logger( log4cpp::Category::getInstance( "Ubitrack.Vision.MarkerDictionary" ) );
+
+namespace Ubitrack { namespace Vision { namespace Markers {
+
+/** dictionaries with up to this many rotations are searched linearly */
+static const std::size_t g_nMaxLinearSearch = 512;
+
+/** number of set bits */
+static inline unsigned int popcount( unsigned long long int x )
+{
+#if defined( __GNUC__ )
+	return __builtin_popcountll( x );
+#elif defined( _MSC_VER ) && defined( _M_X64 )
+	return static_cast< unsigned int >( __popcnt64( x ) );
+#else
+	x = x - ( ( x >> 1 ) & 0x5555555555555555ULL );
+	x = ( x & 0x3333333333333333ULL ) + ( ( x >> 2 ) & 0x3333333333333333ULL );
+	x = ( x + ( x >> 4 ) ) & 0x0F0F0F0F0F0F0F0FULL;
+	return static_cast< unsigned int >( ( x * 0x0101010101010101ULL ) >> 56 );
+#endif
+}
+
+
+/** all bits of a code */
+static unsigned long long int codeBits( unsigned int codeSize )
+{
+	return codeSize * codeSize >= 64 ? ~0ULL : ( 1ULL << ( codeSize * codeSize ) ) - 1;
+}
+
+
+MarkerDictionary::MarkerDictionary( unsigned int uiCodeSize, unsigned long long int uiMask )
+	: m_codeSize( uiCodeSize )
+	, m_mask( ( uiMask ? uiMask : ~0ULL ) & codeBits( uiCodeSize ) )
+	, m_minDistance( std::numeric_limits< unsigned int >::max() )
+	, m_maxCorrection( std::numeric_limits< unsigned int >::max() )
+{
+	// the stored rotations would not match the rotations of masked raw codes
+	assert( rotateMarkerCode( m_mask, m_codeSize ) == m_mask );
+}
+
+
+bool MarkerDictionary::add( unsigned long long int nCode )
+{
+	int nRotations;
+	const unsigned long long int nNormCode = normalizeCode( nCode & m_mask, m_codeSize, nRotations );
+	for ( std::vector< unsigned long long int >::const_iterator it = m_codes.begin(); it != m_codes.end(); it++ )
+		if ( *it == nNormCode )
+			return true;
+
+	// symmetric codes cannot be told apart from their rotations
+	unsigned long long int nRotCode = nNormCode;
+	for ( int j = 1; j < 4; j++ )
+	{
+		nRotCode = rotateMarkerCode( nRotCode, m_codeSize ) & m_mask;
+		if ( nRotCode == nNormCode )
+		{
+			LOG4CPP_WARN( logger, "marker code 0x" << std::hex << nNormCode << " is rotation-symmetric and not added to the dictionary" );
+			return false;
+		}
+	}
+
+	m_codes.push_back( nNormCode );
+
+	nRotCode = nNormCode;
+	for ( int j = 0; j < 4; j++, nRotCode = rotateMarkerCode( nRotCode, m_codeSize ) )
+	{
+		const unsigned long long int nEntry = nRotCode & m_mask;
+		for ( std::vector< unsigned long long int >::const_iterator it = m_rotations.begin(); it != m_rotations.end(); it++ )
+			m_minDistance = std::min( m_minDistance, popcount( *it ^ nEntry ) );
+
+		// the rotation that normalizeCode would report for the exact code
+		int nEntryRotations;
+		if ( normalizeCode( nEntry, m_codeSize, nEntryRotations ) != nNormCode )
+			nEntryRotations = ( 4 - j ) % 4;
+
+		m_exact.insert( std::make_pair( nEntry, static_cast< int >( m_rotations.size() ) ) );
+		m_rotations.push_back( nEntry );
+		m_rotationCodes.push_back( nNormCode );
+		m_rotationCounts.push_back( nEntryRotations );
+	}
+
+	buildIndex();
+	return true;
+}
+
+
+std::size_t MarkerDictionary::generate( std::size_t nCodes, unsigned int minDistance )
+{
+	// xorshift generator with fixed seed
+	unsigned long long int nState = 0x9E3779B97F4A7C15ULL;
+	const std::size_t nMaxTries = 1 << 20;
+
+	std::size_t nAdded = 0;
+	for ( std::size_t iTry = 0; iTry < nMaxTries && nAdded < nCodes; iTry++ )
+	{
+		nState ^= nState << 13;
+		nState ^= nState >> 7;
+		nState ^= nState << 17;
+
+		int nRotations;
+		const unsigned long long int nCode = normalizeCode( nState & m_mask, m_codeSize, nRotations );
+		if ( !nCode )
+			continue;
+
+		// check distance of the rotations to each other and to all existing rotations
+		unsigned long long int rotations[ 4 ];
+		rotations[ 0 ] = nCode;
+		for ( int j = 1; j < 4; j++ )
+			rotations[ j ] = rotateMarkerCode( rotations[ j - 1 ], m_codeSize ) & m_mask;
+
+		bool bValid = true;
+		for ( int j = 0; j < 4 && bValid; j++ )
+		{
+			for ( int k = j + 1; k < 4 && bValid; k++ )
+				bValid = popcount( rotations[ j ] ^ rotations[ k ] ) >= minDistance;
+			for ( std::vector< unsigned long long int >::const_iterator it = m_rotations.begin(); it != m_rotations.end() && bValid; it++ )
+				bValid = popcount( rotations[ j ] ^ *it ) >= minDistance;
+		}
+
+		if ( bValid && add( nCode ) )
+			nAdded++;
+	}
+
+	LOG4CPP_DEBUG( logger, "generated " << nAdded << " codes with minimal distance " << minDistance );
+	return nAdded;
+}
+
+
+void MarkerDictionary::setMaxCorrection( unsigned int maxBits )
+{
+	m_maxCorrection = maxBits;
+	buildIndex();
+}
+
+
+unsigned int MarkerDictionary::correctableBits() const
+{
+	if ( m_rotations.size() < 2 || m_minDistance == 0 )
+		return 0;
+	return std::min( ( m_minDistance - 1 ) / 2, m_maxCorrection );
+}
+
+
+void MarkerDictionary::buildIndex()
+{
+	m_chunkBits.clear();
+	m_chunkIndex.clear();
+
+	const unsigned int nCorrectable = correctableBits();
+	if ( nCorrectable == 0 || m_rotations.size() <= g_nMaxLinearSearch )
+		return;
+
+	// split the mask bits into nCorrectable + 1 chunks of about equal size
+	std::vector< int > maskBits;
+	for ( int i = 0; i < 64; i++ )
+		if ( m_mask & ( 1ULL << i ) )
+			maskBits.push_back( i );
+
+	const std::size_t nChunks = nCorrectable + 1;
+	for ( std::size_t k = 0; k < nChunks; k++ )
+		m_chunkBits.push_back( maskBits[ k * maskBits.size() / nChunks ] );
+	m_chunkBits.push_back( maskBits.back() + 1 );
+
+	m_chunkIndex.resize( nChunks );
+	for ( std::size_t i = 0; i < m_rotations.size(); i++ )
+		for ( std::size_t k = 0; k < nChunks; k++ )
+		{
+			const int nWidth = m_chunkBits[ k + 1 ] - m_chunkBits[ k ];
+			const unsigned long long int nChunkMask = nWidth >= 64 ? ~0ULL : ( 1ULL << nWidth ) - 1;
+			m_chunkIndex[ k ].insert( std::make_pair( ( m_rotations[ i ] >> m_chunkBits[ k ] ) & nChunkMask, static_cast< int >( i ) ) );
+		}
+}
+
+
+int MarkerDictionary::findNearest( unsigned long long int nCode, unsigned int& nDistance ) const
+{
+	boost::unordered_map< unsigned long long int, int >::const_iterator itExact = m_exact.find( nCode );
+	if ( itExact != m_exact.end() )
+	{
+		nDistance = 0;
+		return itExact->second;
+	}
+
+	// at most one rotation can be within the correctable distance
+	const unsigned int nCorrectable = correctableBits();
+	if ( nCorrectable == 0 )
+		return -1;
+
+	if ( m_chunkIndex.empty() )
+	{
+		for ( std::size_t i = 0; i < m_rotations.size(); i++ )
+		{
+			nDistance = popcount( m_rotations[ i ] ^ nCode );
+			if ( nDistance <= nCorrectable )
+				return static_cast< int >( i );
+		}
+		return -1;
+	}
+
+	// a correctable code matches at least one chunk exactly
+	for ( std::size_t k = 0; k < m_chunkIndex.size(); k++ )
+	{
+		const int nWidth = m_chunkBits[ k + 1 ] - m_chunkBits[ k ];
+		const unsigned long long int nChunkMask = nWidth >= 64 ? ~0ULL : ( 1ULL << nWidth ) - 1;
+		typedef boost::unordered_multimap< unsigned long long int, int >::const_iterator ChunkIterator;
+		std::pair< ChunkIterator, ChunkIterator > range = m_chunkIndex[ k ].equal_range( ( nCode >> m_chunkBits[ k ] ) & nChunkMask );
+		for ( ChunkIterator it = range.first; it != range.second; it++ )
+		{
+			nDistance = popcount( m_rotations[ it->second ] ^ nCode );
+			if ( nDistance <= nCorrectable )
+				return it->second;
+		}
+	}
+	return -1;
+}
+
+
+unsigned long long int MarkerDictionary::lookup( unsigned long long int nRawCode, int& nRotations, unsigned int& nCorrectedBits ) const
+{
+	const int i = findNearest( nRawCode & m_mask, nCorrectedBits );
+	if ( i < 0 )
+	{
+		nRotations = 0;
+		nCorrectedBits = 0;
+		return 0;
+	}
+
+	nRotations = m_rotationCounts[ i ];
+	if ( nCorrectedBits )
+	{ LOG4CPP_TRACE( logger, "corrected " << nCorrectedBits << " bits of marker 0x" << std::hex << m_rotationCodes[ i ] ); }
+	return m_rotationCodes[ i ];
+}
+
+} } } // namespace Ubitrack::Vision::Markers
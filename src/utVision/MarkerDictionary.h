@@ -0,0 +1,153 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @ingroup vision
+ * @file
+ * Dictionaries of marker codes with error correction.
+ */
+
+#ifndef __UBITRACK_VISION_MARKERDICTIONARY_H_INCLUDED__
+#define __UBITRACK_VISION_MARKERDICTIONARY_H_INCLUDED__
+
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include <utVision.h>
+
+namespace Ubitrack { namespace Vision { namespace Markers {
+
+/**
+ * @ingroup vision
+ * A set of marker codes that is used to correct bit errors of decoded markers.
+ *
+ * All four rotations of every code are stored. The minimal Hamming distance between any two of them
+ * determines how many wrong bits can be corrected without confusing markers or their rotations. A raw
+ * code as returned by readCode is mapped to the nearest stored rotation, if it differs in at most
+ * \c correctableBits() bits. Exact matches are found by hashing. Otherwise, small dictionaries are
+ * searched linearly using popcount, large ones with multi-index hashing: the code bits are split into
+ * correctableBits() + 1 disjoint chunks, one of which must match exactly for a correctable code.
+ *
+ * Codes are compared only on the bits set in the mask used by readCode. As readCode masks the raw code
+ * before it is rotated, while the dictionary masks the stored rotations, the mask must be invariant under
+ * rotations by 90 degrees.
+ */
+class UTVISION_EXPORT MarkerDictionary
+{
+public:
+	/**
+	 * constructs an empty dictionary
+	 * @param uiCodeSize size of marker's bit pattern
+	 * @param uiMask regions of the marker's bit pattern that belong to the ID (1) or not (0), 0 for all bits.
+	 *   Must be invariant under rotations of the pattern.
+	 */
+	MarkerDictionary( unsigned int uiCodeSize = 4, unsigned long long int uiMask = 0xFFFF );
+
+	/** 
+	 * adds a marker code, which is normalized first. Codes that equal one of their own rotations are rejected,
+	 * as the orientation of such markers is ambiguous and their distance of 0 would disable the error 
+	 * correction of the whole dictionary.
+	 * @return false if the code was rejected, true if it is in the dictionary
+	 */
+	bool add( unsigned long long int nCode );
+
+	/**
+	 * Adds codes that have at least the given Hamming distance to all rotations of each other and of
+	 * the codes already in the dictionary. Candidates are drawn from a fixed pseudo-random sequence, so
+	 * the result is reproducible.
+	 *
+	 * @param nCodes number of codes to add
+	 * @param minDistance required minimal distance
+	 * @return number of codes that were actually added
+	 */
+	std::size_t generate( std::size_t nCodes, unsigned int minDistance );
+
+	/** restricts error correction to less than the possible number of bits */
+	void setMaxCorrection( unsigned int maxBits );
+
+	/** number of codes */
+	std::size_t size() const
+	{ return m_codes.size(); }
+
+	/** the normalized codes */
+	const std::vector< unsigned long long int >& codes() const
+	{ return m_codes; }
+
+	/** size of the marker's bit pattern */
+	unsigned int codeSize() const
+	{ return m_codeSize; }
+
+	/** smallest Hamming distance between two different codes or rotations, 0 if there are less than two */
+	unsigned int minimalDistance() const
+	{ return m_rotations.size() < 2 ? 0 : m_minDistance; }
+
+	/** number of bit errors that are corrected */
+	unsigned int correctableBits() const;
+
+	/**
+	 * Finds the marker for a raw code.
+	 *
+	 * @param nRawCode unnormalized code as returned by readCode
+	 * @param nRotations returns the number of counter-clockwise rotations, as normalizeCode
+	 * @param nCorrectedBits returns the number of bits that differ from the stored code
+	 * @return normalized code of the marker, 0 if there is no marker within correctableBits()
+	 */
+	unsigned long long int lookup( unsigned long long int nRawCode, int& nRotations, unsigned int& nCorrectedBits ) const;
+
+protected:
+	/** rebuilds the chunk index for multi-index hashing */
+	void buildIndex();
+
+	/** returns the index of the nearest rotation within correctableBits() or -1 */
+	int findNearest( unsigned long long int nCode, unsigned int& nDistance ) const;
+
+	/** code size and mask */
+	unsigned int m_codeSize;
+	unsigned long long int m_mask;
+
+	/** normalized codes */
+	std::vector< unsigned long long int > m_codes;
+
+	/** all rotations of all codes, masked, and the normalized code and rotation they belong to */
+	std::vector< unsigned long long int > m_rotations;
+	std::vector< unsigned long long int > m_rotationCodes;
+	std::vector< int > m_rotationCounts;
+
+	/** maps masked rotations to their index */
+	boost::unordered_map< unsigned long long int, int > m_exact;
+
+	/** minimal distance */
+	unsigned int m_minDistance;
+
+	/** limit for correction set by the user */
+	unsigned int m_maxCorrection;
+
+	/** first bit of each chunk, followed by the end */
+	std::vector< int > m_chunkBits;
+
+	/** per chunk: maps chunk values to the indices of the rotations */
+	std::vector< boost::unordered_multimap< unsigned long long int, int > > m_chunkIndex;
+};
+
+} } } // namespace Ubitrack::Vision::Markers
+
+#endif
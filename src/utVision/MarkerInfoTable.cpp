@@ -0,0 +1,94 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @ingroup vision
+ * @file
+ * Implementation of the flat marker info container.
+ */
+
+#include <algorithm>
+#include "MarkerInfoTable.h"
+
+namespace Ubitrack { namespace Vision { namespace Markers {
+
+MarkerInfoTable::MarkerInfoTable( const MarkerInfoMap& markers )
+{
+	// the map is already sorted
+	reserve( markers.size() );
+	for ( MarkerInfoMap::const_iterator it = markers.begin(); it != markers.end(); it++ )
+	{
+		m_codes.push_back( it->first );
+		m_infos.push_back( it->second );
+	}
+}
+
+
+void MarkerInfoTable::reserve( std::size_t n )
+{
+	m_codes.reserve( n );
+	m_infos.reserve( n );
+}
+
+
+void MarkerInfoTable::clear()
+{
+	m_codes.clear();
+	m_infos.clear();
+}
+
+
+std::size_t MarkerInfoTable::findIndex( key_type nCode ) const
+{
+	std::vector< key_type >::const_iterator it = std::lower_bound( m_codes.begin(), m_codes.end(), nCode );
+	if ( it == m_codes.end() || *it != nCode )
+		return m_codes.size();
+	return it - m_codes.begin();
+}
+
+
+MarkerInfo& MarkerInfoTable::operator[]( key_type nCode )
+{
+	std::vector< key_type >::iterator it = std::lower_bound( m_codes.begin(), m_codes.end(), nCode );
+	const std::size_t i = it - m_codes.begin();
+	if ( it == m_codes.end() || *it != nCode )
+	{
+		m_codes.insert( it, nCode );
+		m_infos.insert( m_infos.begin() + i, MarkerInfo() );
+	}
+	return m_infos[ i ];
+}
+
+
+std::size_t MarkerInfoTable::erase( key_type nCode )
+{
+	const std::size_t i = findIndex( nCode );
+	if ( i == m_codes.size() )
+		return 0;
+
+	m_codes.erase( m_codes.begin() + i );
+	m_infos.erase( m_infos.begin() + i );
+	return 1;
+}
+
+} } } // namespace Ubitrack::Vision::Markers
@@ -0,0 +1,189 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @ingroup vision
+ * @file
+ * Flat container for marker infos.
+ */
+
+#ifndef __UBITRACK_VISION_MARKERINFOTABLE_H_INCLUDED__
+#define __UBITRACK_VISION_MARKERINFOTABLE_H_INCLUDED__
+
+#include <vector>
+#include <utVision.h>
+#include "MarkerDetection.h"
+
+namespace Ubitrack { namespace Vision { namespace Markers {
+
+/**
+ * @ingroup vision
+ * Map of marker infos stored in flat arrays, as an alternative to \c MarkerInfoMap.
+ *
+ * The marker codes are kept sorted in one array and the infos in a second one with the same order.
+ * Lookups are binary searches that only touch the code array, and iterating over all markers walks
+ * both arrays linearly. The infos are updated in place and no memory is allocated once all markers are
+ * known. Inserting a marker moves the following entries, which is intended to happen rarely.
+ *
+ * The interface is a subset of the one of std::map. Unlike std::map, references and iterators are
+ * invalidated when markers are inserted or erased. Iterators return proxies with \c first and \c second.
+ */
+class UTVISION_EXPORT MarkerInfoTable
+{
+public:
+	typedef unsigned long long int key_type;
+	typedef MarkerInfo mapped_type;
+
+	/** an entry of the table, behaves like std::pair< const key_type, MarkerInfo > */
+	template< class Info >
+	struct Entry
+	{
+		Entry( const key_type& _first, Info& _second )
+			: first( _first )
+			, second( _second )
+		{}
+
+		const Entry* operator->() const
+		{ return this; }
+
+		const key_type& first;
+		Info& second;
+	};
+
+	/** forward iterator over the entries */
+	template< class Table, class Info >
+	class Iterator
+	{
+	public:
+		Iterator( Table* pTable = 0, std::size_t i = 0 )
+			: m_pTable( pTable )
+			, m_i( i )
+		{}
+
+		/** conversion from iterator to const_iterator */
+		template< class Table2, class Info2 >
+		Iterator( const Iterator< Table2, Info2 >& it )
+			: m_pTable( it.table() )
+			, m_i( it.index() )
+		{}
+
+		Entry< Info > operator*() const
+		{ return Entry< Info >( m_pTable->m_codes[ m_i ], m_pTable->m_infos[ m_i ] ); }
+
+		Entry< Info > operator->() const
+		{ return **this; }
+
+		Iterator& operator++()
+		{ ++m_i; return *this; }
+
+		Iterator operator++( int )
+		{ Iterator r( *this ); ++m_i; return r; }
+
+		bool operator==( const Iterator& it ) const
+		{ return m_i == it.m_i; }
+
+		bool operator!=( const Iterator& it ) const
+		{ return m_i != it.m_i; }
+
+		Table* table() const
+		{ return m_pTable; }
+
+		std::size_t index() const
+		{ return m_i; }
+
+	protected:
+		Table* m_pTable;
+		std::size_t m_i;
+	};
+
+	typedef Iterator< MarkerInfoTable, MarkerInfo > iterator;
+	typedef Iterator< const MarkerInfoTable, const MarkerInfo > const_iterator;
+
+	/** constructor */
+	MarkerInfoTable()
+	{}
+
+	/** copies the markers of a MarkerInfoMap */
+	explicit MarkerInfoTable( const MarkerInfoMap& markers );
+
+	/** reserves memory for the given number of markers */
+	void reserve( std::size_t n );
+
+	std::size_t size() const
+	{ return m_codes.size(); }
+
+	bool empty() const
+	{ return m_codes.empty(); }
+
+	void clear();
+
+	iterator begin()
+	{ return iterator( this, 0 ); }
+
+	iterator end()
+	{ return iterator( this, m_codes.size() ); }
+
+	const_iterator begin() const
+	{ return const_iterator( this, 0 ); }
+
+	const_iterator end() const
+	{ return const_iterator( this, m_codes.size() ); }
+
+	/** finds a marker, returns end() if it is not in the table */
+	iterator find( key_type nCode )
+	{ return iterator( this, findIndex( nCode ) ); }
+
+	const_iterator find( key_type nCode ) const
+	{ return const_iterator( this, findIndex( nCode ) ); }
+
+	/** returns the info of a marker and inserts a default one if it is not in the table */
+	MarkerInfo& operator[]( key_type nCode );
+
+	/** removes a marker, returns the number of removed markers */
+	std::size_t erase( key_type nCode );
+
+	/** the sorted marker codes */
+	const std::vector< key_type >& codes() const
+	{ return m_codes; }
+
+	/** the marker infos in the order of codes() */
+	std::vector< MarkerInfo >& infos()
+	{ return m_infos; }
+
+	const std::vector< MarkerInfo >& infos() const
+	{ return m_infos; }
+
+protected:
+	/** returns the index of a code or size() */
+	std::size_t findIndex( key_type nCode ) const;
+
+	/** sorted codes */
+	std::vector< key_type > m_codes;
+
+	/** infos in the same order */
+	std::vector< MarkerInfo > m_infos;
+};
+
+} } } // namespace Ubitrack::Vision::Markers
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @ingroup vision
+ * @file
+ * Implementation of the constant-velocity motion model for markers.
+ */
+
+#include <math.h>
+#include "MarkerMotionModel.h"
+
+namespace Ubitrack { namespace Vision { namespace Markers {
+
+/** initial velocity variance, large enough that the second measurement determines the velocity */
+static const double g_fInitialVelocityVariance = 0.1 * 0.1;
+static const double g_fInitialAngularVelocityVariance = 0.5 * 0.5;
+
+
+/** rotation vector of a unit quaternion */
+static Math::Vector< double, 3 > rotationVector( const Math::Quaternion& q )
+{
+	// use the representation with the smaller angle
+	const double fSign = q.R_component_1() < 0 ? -1.0 : 1.0;
+	const Math::Vector< double, 3 > v( fSign * q.R_component_2(), fSign * q.R_component_3(), fSign * q.R_component_4() );
+	const double fSin = sqrt( v( 0 ) * v( 0 ) + v( 1 ) * v( 1 ) + v( 2 ) * v( 2 ) );
+	if ( fSin < 1e-12 )
+		return 2.0 * v;
+	return ( 2.0 * atan2( fSin, fSign * q.R_component_1() ) / fSin ) * v;
+}
+
+
+/** unit quaternion of a rotation vector */
+static Math::Quaternion fromRotationVector( const Math::Vector< double, 3 >& v )
+{
+	const double fAngle = sqrt( v( 0 ) * v( 0 ) + v( 1 ) * v( 1 ) + v( 2 ) * v( 2 ) );
+	const double fScale = fAngle < 1e-12 ? 0.5 : sin( 0.5 * fAngle ) / fAngle;
+	return Math::Quaternion( fScale * v( 0 ), fScale * v( 1 ), fScale * v( 2 ), cos( 0.5 * fAngle ) );
+}
+
+
+MarkerMotionModel::AxisCovariance MarkerMotionModel::AxisCovariance::predict( double fAccelerationVariance ) const
+{
+	// x' = F x with F = [ 1 1; 0 1 ], noise of a constant acceleration during the frame
+	AxisCovariance p;
+	p.fPos = fPos + 2 * fPosVel + fVel + 0.25 * fAccelerationVariance;
+	p.fPosVel = fPosVel + fVel + 0.5 * fAccelerationVariance;
+	p.fVel = fVel + fAccelerationVariance;
+	return p;
+}
+
+
+MarkerMotionModel::MarkerMotionModel( double _fTranslationNoise, double _fRotationNoise, double _fAcceleration, double _fAngularAcceleration )
+	: fTranslationNoise( _fTranslationNoise )
+	, fRotationNoise( _fRotationNoise )
+	, fAcceleration( _fAcceleration )
+	, fAngularAcceleration( _fAngularAcceleration )
+	, m_nUpdates( 0 )
+{
+	reset();
+}
+
+
+void MarkerMotionModel::reset()
+{
+	m_nUpdates = 0;
+	m_translation = Math::Vector< double, 3 >( 0, 0, 0 );
+	m_velocity = Math::Vector< double, 3 >( 0, 0, 0 );
+	m_rotation = Math::Quaternion( 0, 0, 0, 1 );
+	m_angularVelocity = Math::Vector< double, 3 >( 0, 0, 0 );
+	m_translationCov.fPos = m_translationCov.fPosVel = m_translationCov.fVel = 0;
+	m_rotationCov.fPos = m_rotationCov.fPosVel = m_rotationCov.fVel = 0;
+}
+
+
+Math::Pose MarkerMotionModel::predict() const
+{
+	return Math::Pose( fromRotationVector( m_angularVelocity ) * m_rotation, m_translation + m_velocity );
+}
+
+
+Math::Matrix< double, 6, 6 > MarkerMotionModel::predictedCovariance() const
+{
+	double fTranslation, fRotation;
+	predictedDeviation( fTranslation, fRotation );
+
+	Math::Matrix< double, 6, 6 > cov( Math::Matrix< double, 6, 6 >::zeros() );
+	for ( unsigned i = 0; i < 3; i++ )
+	{
+		cov( i, i ) = fTranslation * fTranslation;
+		cov( i + 3, i + 3 ) = fRotation * fRotation;
+	}
+	return cov;
+}
+
+
+void MarkerMotionModel::predictedDeviation( double& fTranslation, double& fRotation ) const
+{
+	fTranslation = sqrt( m_translationCov.predict( fAcceleration * fAcceleration ).fPos );
+	fRotation = sqrt( m_rotationCov.predict( fAngularAcceleration * fAngularAcceleration ).fPos );
+}
+
+
+void MarkerMotionModel::update( const Math::Pose& pose )
+{
+	if ( !m_nUpdates++ )
+	{
+		m_translation = pose.translation();
+		m_velocity = Math::Vector< double, 3 >( 0, 0, 0 );
+		m_translationCov.fPos = fTranslationNoise * fTranslationNoise;
+		m_translationCov.fPosVel = 0;
+		m_translationCov.fVel = g_fInitialVelocityVariance;
+
+		m_rotation = pose.rotation();
+		m_angularVelocity = Math::Vector< double, 3 >( 0, 0, 0 );
+		m_rotationCov.fPos = fRotationNoise * fRotationNoise;
+		m_rotationCov.fPosVel = 0;
+		m_rotationCov.fVel = g_fInitialAngularVelocityVariance;
+		return;
+	}
+
+	// translation
+	{
+		const AxisCovariance p( m_translationCov.predict( fAcceleration * fAcceleration ) );
+		const double fGainPos = p.fPos / ( p.fPos + fTranslationNoise * fTranslationNoise );
+		const double fGainVel = p.fPosVel / ( p.fPos + fTranslationNoise * fTranslationNoise );
+
+		const Math::Vector< double, 3 > predicted( m_translation + m_velocity );
+		const Math::Vector< double, 3 > innovation( pose.translation() - predicted );
+		m_translation = predicted + fGainPos * innovation;
+		m_velocity += fGainVel * innovation;
+
+		m_translationCov.fPos = ( 1 - fGainPos ) * p.fPos;
+		m_translationCov.fPosVel = ( 1 - fGainPos ) * p.fPosVel;
+		m_translationCov.fVel = p.fVel - fGainVel * p.fPosVel;
+	}
+
+	// rotation, with the innovation as rotation vector between prediction and measurement
+	{
+		const AxisCovariance p( m_rotationCov.predict( fAngularAcceleration * fAngularAcceleration ) );
+		const double fGainPos = p.fPos / ( p.fPos + fRotationNoise * fRotationNoise );
+		const double fGainVel = p.fPosVel / ( p.fPos + fRotationNoise * fRotationNoise );
+
+		const Math::Quaternion predicted( fromRotationVector( m_angularVelocity ) * m_rotation );
+		const Math::Vector< double, 3 > innovation( rotationVector( pose.rotation() * ~predicted ) );
+		m_rotation = fromRotationVector( fGainPos * innovation ) * predicted;
+		m_angularVelocity += fGainVel * innovation;
+
+		m_rotationCov.fPos = ( 1 - fGainPos ) * p.fPos;
+		m_rotationCov.fPosVel = ( 1 - fGainPos ) * p.fPosVel;
+		m_rotationCov.fVel = p.fVel - fGainVel * p.fPosVel;
+	}
+}
+
+} } } // namespace Ubitrack::Vision::Markers
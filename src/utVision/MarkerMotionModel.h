@@ -0,0 +1,124 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @ingroup vision
+ * @file
+ * Motion model for predicting marker poses between frames.
+ */
+
+#ifndef __UBITRACK_VISION_MARKERMOTIONMODEL_H_INCLUDED__
+#define __UBITRACK_VISION_MARKERMOTIONMODEL_H_INCLUDED__
+
+#include <utVision.h>
+#include <utMath/Vector.h>
+#include <utMath/Matrix.h>
+#include <utMath/Pose.h>
+#include <utMath/Quaternion.h>
+
+namespace Ubitrack { namespace Vision { namespace Markers {
+
+/**
+ * @ingroup vision
+ * Constant-velocity Kalman filter on the pose of a marker, which predicts the pose in the next frame
+ * together with its uncertainty.
+ *
+ * Translation and rotation are filtered separately, rotations as rotation vectors relative to the
+ * current estimate. Every axis has a position and a velocity, and as all axes of translation or rotation
+ * have the same noise, they share one 2x2 covariance matrix. The time step is one frame, i.e. one call
+ * of \c update.
+ */
+class UTVISION_EXPORT MarkerMotionModel
+{
+public:
+	/**
+	 * constructor
+	 * @param fTranslationNoise standard deviation of the measured translation in meters
+	 * @param fRotationNoise standard deviation of the measured rotation in radians
+	 * @param fAcceleration standard deviation of the change of the velocity in meters per frame
+	 * @param fAngularAcceleration standard deviation of the change of the angular velocity in radians per frame
+	 */
+	MarkerMotionModel( double fTranslationNoise = 0.002, double fRotationNoise = 0.01, 
+		double fAcceleration = 0.005, double fAngularAcceleration = 0.02 );
+
+	/** forgets the state, e.g. when the marker was lost */
+	void reset();
+
+	/** is there a pose to predict from? */
+	bool isInitialized() const
+	{ return m_nUpdates > 0; }
+
+	/** has the velocity been measured, i.e. are there at least two updates? */
+	bool hasVelocity() const
+	{ return m_nUpdates > 1; }
+
+	/** returns the predicted pose in the next frame */
+	Math::Pose predict() const;
+
+	/** 
+	 * returns the predicted covariance in the next frame, translation first, followed by the 
+	 * rotation vector in the camera frame
+	 */
+	Math::Matrix< double, 6, 6 > predictedCovariance() const;
+
+	/** returns the predicted standard deviations of translation and rotation per axis */
+	void predictedDeviation( double& fTranslation, double& fRotation ) const;
+
+	/** adds the measured pose of the next frame */
+	void update( const Math::Pose& pose );
+
+	/** noise parameters, see constructor */
+	double fTranslationNoise;
+	double fRotationNoise;
+	double fAcceleration;
+	double fAngularAcceleration;
+
+protected:
+	/** covariance of position and velocity of one axis */
+	struct AxisCovariance
+	{
+		double fPos;
+		double fPosVel;
+		double fVel;
+
+		/** covariance after one frame with the given acceleration variance */
+		AxisCovariance predict( double fAccelerationVariance ) const;
+	};
+
+	/** number of updates since the last reset */
+	unsigned m_nUpdates;
+
+	Math::Vector< double, 3 > m_translation;
+	Math::Vector< double, 3 > m_velocity;
+	AxisCovariance m_translationCov;
+
+	Math::Quaternion m_rotation;
+
+	/** rotation per frame as rotation vector in the camera frame */
+	Math::Vector< double, 3 > m_angularVelocity;
+	AxisCovariance m_rotationCov;
+};
+
+} } } // namespace Ubitrack::Vision::Markers
+
+#endif
@@ -0,0 +1,519 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @ingroup vision
+ * @file
+ * Implementation of the quadrangle extraction for marker detection.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/utility.hpp>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define UTVISION_QUADRANGLE_SSE2
+#endif
+
+#include "QuadrangleExtractor.h"
+
+// get a logger
+#include <log4cpp/Category.hh>
+static log4cpp::Category& logger( log4cpp::Category::getInstance( "Ubitrack.Vision.QuadrangleExtractor" ) );
+
+namespace Ubitrack { namespace Vision { namespace Markers {
+
+// CW@2015-04-02: relative size checks instead of absolute ones, taking the diagonal from vga resolution(==800) for building the bounds
+/** minimal diameter of a quadrangle relative to the image diagonal */
+static const float g_fQuadMinRatio = 30 / 800.0f; // ~=3,75 %
+
+/** maximal diameter of a quadrangle relative to the image diagonal */
+static const float g_fQuadMaxRatio = 650 / 800.0f; // ~= 81,25 %
+
+/** label of foreground pixels that have not been visited yet */
+static const signed char g_labelForeground = 1;
+
+/** label of visited border pixels */
+static const signed char g_labelBorder = 2;
+
+/** label of visited border pixels whose right neighbour is background */
+static const signed char g_labelRightBorder = -2;
+
+/** minimal number of rows of a tile */
+static const int g_nMinTileHeight = 32;
+
+
+/** box sum for a column whose box leaves the image, the border columns are replicated */
+static inline int borderBoxSum( const int* pColSums, const int* pPrefix, int x, int r, int width )
+{
+	const int lo = x - r;
+	const int hi = x + r;
+	int sum = pPrefix[ std::min( hi, width - 1 ) + 1 ] - pPrefix[ std::max( lo, 0 ) ];
+	if ( lo < 0 )
+		sum -= lo * pColSums[ 0 ];
+	if ( hi > width - 1 )
+		sum += ( hi - width + 1 ) * pColSums[ width - 1 ];
+	return sum;
+}
+
+
+/** thresholds a range of tiles */
+class QuadrangleExtractor::TileBinarizer
+	: public cv::ParallelLoopBody
+{
+public:
+	TileBinarizer( QuadrangleExtractor& extractor, const cv::Mat& grey, int blockSize, int iDelta )
+		: m_extractor( extractor )
+		, m_grey( grey )
+		, m_blockSize( blockSize )
+		, m_iDelta( iDelta )
+	{}
+
+	virtual void operator()( const cv::Range& range ) const
+	{
+		for ( int i = range.start; i < range.end; i++ )
+			m_extractor.binarizeTile( m_grey, i, m_blockSize, m_iDelta );
+	}
+
+protected:
+	QuadrangleExtractor& m_extractor;
+	const cv::Mat& m_grey;
+	int m_blockSize;
+	int m_iDelta;
+};
+
+
+QuadrangleExtractor::QuadrangleExtractor()
+	: m_bAdaptive( true )
+	, m_threshold( 120 )
+	, m_blockSize( 0 )
+	, m_delta( 4.0 )
+	, m_width( 0 )
+	, m_height( 0 )
+	, m_fDiagonal( 0 )
+	, m_step( 0 )
+	, m_tileHeight( 1 )
+	, m_fBinarizationTime( 0.0 )
+	, m_fContourTime( 0.0 )
+	, m_nContours( 0 )
+{
+	for ( int i = 0; i < 8; i++ )
+		m_deltas[ i ] = 0;
+}
+
+
+void QuadrangleExtractor::setBinaryThreshold( int threshold )
+{
+	m_bAdaptive = false;
+	m_threshold = threshold;
+}
+
+
+void QuadrangleExtractor::setAdaptiveThreshold( int blockSize, double delta )
+{
+	m_bAdaptive = true;
+	m_blockSize = blockSize;
+	m_delta = delta;
+}
+
+
+void QuadrangleExtractor::setRegionsOfInterest( const std::vector< cv::Rect >& rois )
+{
+	m_rois = rois;
+}
+
+
+void QuadrangleExtractor::clearRegionsOfInterest()
+{
+	m_rois.clear();
+}
+
+
+void QuadrangleExtractor::extract( Image& img, MarkerList& quadrangles, Image* pDbgImg, cv::Point offset )
+{
+	const cv::Mat& grey( img.Mat() );
+	const int64 t0 = cv::getTickCount();
+	binarize( grey );
+	const int64 t1 = cv::getTickCount();
+	m_nContours = 0;
+
+	// raster scan for starting points of outer and hole borders
+	for ( std::vector< Tile >::const_iterator itTile = m_tiles.begin(); itTile != m_tiles.end(); itTile++ )
+	for ( int y = itTile->y0; y < itTile->y1; y++ )
+	{
+		signed char* pRow = &m_labels[ ( y + 1 ) * m_step + 1 ];
+		for ( int x = itTile->x0; x < itTile->x1; x++ )
+		{
+			const signed char label = pRow[ x ];
+			if ( label == 0 )
+				continue;
+
+			const int pos = static_cast< int >( &pRow[ x ] - &m_labels[ 0 ] );
+			if ( label == g_labelForeground && pRow[ x - 1 ] == 0 )
+				followBorder( pos, 4 ); // outer border
+			else if ( label >= g_labelForeground && pRow[ x + 1 ] == 0 )
+				followBorder( pos, 0 ); // hole border
+			else
+				continue;
+
+			m_nContours++;
+			approximate( quadrangles, pDbgImg, offset );
+		}
+	}
+
+	const double fTickMs = 1000.0 / cv::getTickFrequency();
+	m_fBinarizationTime = ( t1 - t0 ) * fTickMs;
+	m_fContourTime = ( cv::getTickCount() - t1 ) * fTickMs;
+}
+
+
+void QuadrangleExtractor::binarize( const cv::Mat& grey )
+{
+	assert( grey.type() == CV_8UC1 );
+
+	if ( grey.cols != m_width || grey.rows != m_height )
+	{
+		m_width = grey.cols;
+		m_height = grey.rows;
+		m_fDiagonal = sqrtf( static_cast< float >( m_width ) * m_width + static_cast< float >( m_height ) * m_height );
+		m_step = m_width + 2;
+
+		// top and bottom frame rows are never written by the thresholding below
+		m_labels.assign( m_step * ( m_height + 2 ), 0 );
+
+		const int deltas[ 8 ] = { 1, 1 - m_step, -m_step, -1 - m_step, -1, m_step - 1, m_step, m_step + 1 };
+		std::copy( deltas, deltas + 8, m_deltas );
+	}
+
+	int blockSize = 0;
+	int iDelta = 0;
+	if ( m_bAdaptive )
+	{
+		blockSize = m_blockSize ? m_blockSize : ( ( m_height / 48 ) | 1 );
+		iDelta = cvCeil( m_delta );
+	}
+
+	// split the image into tiles, the box sums need to be initialized once per tile
+	m_tileHeight = std::max( 4 * blockSize, g_nMinTileHeight );
+	const int nTiles = ( m_height + m_tileHeight - 1 ) / m_tileHeight;
+	m_tiles.resize( nTiles );
+	for ( int i = 0; i < nTiles; i++ )
+	{
+		Tile& tile( m_tiles[ i ] );
+		tile.y0 = i * m_tileHeight;
+		tile.y1 = std::min( tile.y0 + m_tileHeight, m_height );
+		if ( m_rois.empty() )
+		{
+			tile.x0 = 0;
+			tile.x1 = m_width;
+			continue;
+		}
+
+		// horizontal extent of all regions that overlap the tile
+		tile.x0 = m_width;
+		tile.x1 = 0;
+		for ( std::vector< cv::Rect >::const_iterator itRoi = m_rois.begin(); itRoi != m_rois.end(); itRoi++ )
+			if ( itRoi->y < tile.y1 && itRoi->y + itRoi->height > tile.y0 )
+			{
+				tile.x0 = std::min( tile.x0, std::max( itRoi->x, 0 ) );
+				tile.x1 = std::max( tile.x1, std::min( itRoi->x + itRoi->width, m_width ) );
+			}
+		if ( tile.x0 >= tile.x1 )
+			tile.x0 = tile.x1 = 0;
+	}
+
+	if ( m_bAdaptive )
+		m_boxSums.resize( nTiles * ( 2 * m_width + 1 ) );
+
+	cv::parallel_for_( cv::Range( 0, nTiles ), TileBinarizer( *this, grey, blockSize, iDelta ) );
+}
+
+
+void QuadrangleExtractor::binarizeTile( const cv::Mat& grey, int iTile, int blockSize, int iDelta )
+{
+	const Tile& tile( m_tiles[ iTile ] );
+
+	// everything outside the analysed columns is background
+	for ( int y = tile.y0; y < tile.y1; y++ )
+	{
+		signed char* pDst = &m_labels[ ( y + 1 ) * m_step ];
+		memset( pDst, 0, tile.x0 + 1 );
+		memset( pDst + tile.x1 + 1, 0, m_width - tile.x1 + 1 );
+	}
+
+	if ( tile.x0 >= tile.x1 )
+		return;
+
+	if ( !m_bAdaptive )
+	{
+		// fixed threshold
+		for ( int y = tile.y0; y < tile.y1; y++ )
+		{
+			const unsigned char* pSrc = grey.ptr< unsigned char >( y );
+			signed char* pDst = &m_labels[ ( y + 1 ) * m_step + 1 ];
+			int x = tile.x0;
+			#ifdef UTVISION_QUADRANGLE_SSE2
+			if ( m_threshold >= 0 )
+			{
+				// unsigned comparison via signed comparison of the values shifted by 128
+				const __m128i vSign = _mm_set1_epi8( -128 );
+				const __m128i vThreshold = _mm_set1_epi8( static_cast< char >( std::min( m_threshold, 255 ) - 128 ) );
+				const __m128i vOne = _mm_set1_epi8( g_labelForeground );
+				for ( ; x + 16 <= tile.x1; x += 16 )
+				{
+					__m128i v = _mm_xor_si128( _mm_loadu_si128( reinterpret_cast< const __m128i* >( pSrc + x ) ), vSign );
+					_mm_storeu_si128( reinterpret_cast< __m128i* >( pDst + x ), _mm_and_si128( _mm_cmpgt_epi8( v, vThreshold ), vOne ) );
+				}
+			}
+			#endif
+			for ( ; x < tile.x1; x++ )
+				pDst[ x ] = ( pSrc[ x ] > m_threshold ) ? g_labelForeground : 0;
+		}
+		return;
+	}
+
+	// adaptive threshold: pixel is foreground if pixel + delta > mean of box, i.e. ( pixel + delta ) * area > box sum
+	const int r = blockSize / 2;
+	const int area = blockSize * blockSize;
+	const int bias = iDelta * area;
+
+	// columns whose vertical sums are needed, border pixels are replicated
+	const int xs = std::max( tile.x0 - r, 0 );
+	const int xe = std::min( tile.x1 + r, m_width );
+
+	// vertical sums of blockSize rows per column and their prefix sums along the row
+	int* pColSums = &m_boxSums[ iTile * ( 2 * m_width + 1 ) ];
+	int* pPrefix = pColSums + m_width;
+
+	for ( int x = xs; x < xe; x++ )
+		pColSums[ x ] = 0;
+	for ( int dy = -r; dy <= r; dy++ )
+	{
+		const unsigned char* pSrc = grey.ptr< unsigned char >( std::min( std::max( tile.y0 + dy, 0 ), m_height - 1 ) );
+		for ( int x = xs; x < xe; x++ )
+			pColSums[ x ] += pSrc[ x ];
+	}
+
+	for ( int y = tile.y0; y < tile.y1; y++ )
+	{
+		if ( y > tile.y0 )
+		{
+			// move the box one row down
+			const unsigned char* pAdd = grey.ptr< unsigned char >( std::min( y + r, m_height - 1 ) );
+			const unsigned char* pSub = grey.ptr< unsigned char >( std::max( y - r - 1, 0 ) );
+			for ( int x = xs; x < xe; x++ )
+				pColSums[ x ] += pAdd[ x ] - pSub[ x ];
+		}
+
+		pPrefix[ xs ] = 0;
+		for ( int x = xs; x < xe; x++ )
+			pPrefix[ x + 1 ] = pPrefix[ x ] + pColSums[ x ];
+
+		const unsigned char* pSrc = grey.ptr< unsigned char >( y );
+		signed char* pDst = &m_labels[ ( y + 1 ) * m_step + 1 ];
+
+		// columns whose box is completely inside the image
+		const int xInnerBegin = std::min( std::max( tile.x0, r ), tile.x1 );
+		const int xInnerEnd = std::max( std::min( tile.x1, m_width - r ), xInnerBegin );
+
+		int x = tile.x0;
+		for ( ; x < xInnerBegin; x++ )
+			pDst[ x ] = ( pSrc[ x ] * area + bias > borderBoxSum( pColSums, pPrefix, x, r, m_width ) ) ? g_labelForeground : 0;
+
+		#ifdef UTVISION_QUADRANGLE_SSE2
+		if ( area < 32768 )
+		{
+			// pixel * area is computed with _mm_madd_epi16 on (pixel, 0) pairs, which needs area to fit into 16 bits
+			const __m128i vZero = _mm_setzero_si128();
+			const __m128i vArea = _mm_set1_epi32( area );
+			const __m128i vBias = _mm_set1_epi32( bias );
+			const __m128i vOne = _mm_set1_epi8( g_labelForeground );
+			for ( ; x + 16 <= xInnerEnd; x += 16 )
+			{
+				const __m128i v8 = _mm_loadu_si128( reinterpret_cast< const __m128i* >( pSrc + x ) );
+				const __m128i v16lo = _mm_unpacklo_epi8( v8, vZero );
+				const __m128i v16hi = _mm_unpackhi_epi8( v8, vZero );
+				const __m128i v32[ 4 ] = { _mm_unpacklo_epi16( v16lo, vZero ), _mm_unpackhi_epi16( v16lo, vZero ),
+					_mm_unpacklo_epi16( v16hi, vZero ), _mm_unpackhi_epi16( v16hi, vZero ) };
+
+				__m128i cmp[ 4 ];
+				for ( int k = 0; k < 4; k++ )
+				{
+					const __m128i sum = _mm_sub_epi32(
+						_mm_loadu_si128( reinterpret_cast< const __m128i* >( pPrefix + x + 4 * k + r + 1 ) ),
+						_mm_loadu_si128( reinterpret_cast< const __m128i* >( pPrefix + x + 4 * k - r ) ) );
+					cmp[ k ] = _mm_cmpgt_epi32( _mm_add_epi32( _mm_madd_epi16( v32[ k ], vArea ), vBias ), sum );
+				}
+
+				const __m128i mask = _mm_packs_epi16( _mm_packs_epi32( cmp[ 0 ], cmp[ 1 ] ), _mm_packs_epi32( cmp[ 2 ], cmp[ 3 ] ) );
+				_mm_storeu_si128( reinterpret_cast< __m128i* >( pDst + x ), _mm_and_si128( mask, vOne ) );
+			}
+		}
+		#endif
+
+		for ( ; x < xInnerEnd; x++ )
+		{
+			const int sum = pPrefix[ x + r + 1 ] - pPrefix[ x - r ];
+			pDst[ x ] = ( pSrc[ x ] * area + bias > sum ) ? g_labelForeground : 0;
+		}
+
+		for ( ; x < tile.x1; x++ )
+			pDst[ x ] = ( pSrc[ x ] * area + bias > borderBoxSum( pColSums, pPrefix, x, r, m_width ) ) ? g_labelForeground : 0;
+	}
+}
+
+
+void QuadrangleExtractor::followBorder( int start, int startDir )
+{
+	signed char* pLabels = &m_labels[ 0 ];
+
+	const cv::Point startPoint( start % m_step - 1, start / m_step - 1 );
+	m_contour.clear();
+	m_contour.push_back( startPoint );
+	m_contourMin = m_contourMax = startPoint;
+
+	// search clockwise for the first non-zero neighbour
+	int dir = startDir;
+	int first = 0;
+	do
+	{
+		dir = ( dir - 1 ) & 7;
+		first = start + m_deltas[ dir ];
+	}
+	while ( pLabels[ first ] == 0 && dir != startDir );
+
+	if ( pLabels[ first ] == 0 )
+	{
+		// isolated pixel
+		pLabels[ start ] = g_labelRightBorder;
+		return;
+	}
+
+	int current = start;
+	for ( ;; )
+	{
+		// search counter-clockwise for the next non-zero neighbour, starting after the previous one
+		int prevDir = dir;
+		int next = 0;
+		bool bRightIsZero = false;
+		for ( int i = 1; i <= 8; i++ )
+		{
+			dir = ( prevDir + i ) & 7;
+			next = current + m_deltas[ dir ];
+			if ( pLabels[ next ] != 0 )
+				break;
+			if ( dir == 0 )
+				bRightIsZero = true;
+		}
+
+		if ( bRightIsZero )
+			pLabels[ current ] = g_labelRightBorder;
+		else if ( pLabels[ current ] == g_labelForeground )
+			pLabels[ current ] = g_labelBorder;
+
+		if ( next == start && current == first )
+			break;
+
+		current = next;
+		dir = ( dir + 4 ) & 7;
+
+		const cv::Point p( current % m_step - 1, current / m_step - 1 );
+		m_contour.push_back( p );
+		m_contourMin.x = std::min( m_contourMin.x, p.x );
+		m_contourMin.y = std::min( m_contourMin.y, p.y );
+		m_contourMax.x = std::max( m_contourMax.x, p.x );
+		m_contourMax.y = std::max( m_contourMax.y, p.y );
+	}
+}
+
+
+bool QuadrangleExtractor::isRegionBorder( const cv::Point& p ) const
+{
+	// left or right end of the analysed columns, which is not the image border
+	const Tile& tile( m_tiles[ p.y / m_tileHeight ] );
+	if ( ( p.x == tile.x0 && tile.x0 > 0 ) || ( p.x == tile.x1 - 1 && tile.x1 < m_width ) )
+		return true;
+
+	// the pixels above and below must have been analysed, too
+	if ( p.y > 0 )
+	{
+		const Tile& above( m_tiles[ ( p.y - 1 ) / m_tileHeight ] );
+		if ( p.x < above.x0 || p.x >= above.x1 )
+			return true;
+	}
+	if ( p.y + 1 < m_height )
+	{
+		const Tile& below( m_tiles[ ( p.y + 1 ) / m_tileHeight ] );
+		if ( p.x < below.x0 || p.x >= below.x1 )
+			return true;
+	}
+	return false;
+}
+
+
+void QuadrangleExtractor::approximate( MarkerList& quadrangles, Image* pDbgImg, const cv::Point& offset )
+{
+	const int width = m_contourMax.x - m_contourMin.x + 1;
+	const int height = m_contourMax.y - m_contourMin.y + 1;
+	const float fDiameter = sqrtf( static_cast< float >( width * width + height * height ) );
+	const float ratio = fDiameter / m_fDiagonal;
+
+	// discard too small and too large contours
+	if ( ratio < g_fQuadMinRatio || ratio > g_fQuadMaxRatio )
+		return;
+
+	// approximate contour by few corners
+	cv::approxPolyDP( m_contour, m_polygon, fDiameter * 0.03f + 2.0f, true );
+
+	// discard non-quadrangles
+	if ( m_polygon.size() != 4 )
+		return;
+
+	// discard contours that are cut off by the regions of interest, e.g. the background around a marker
+	if ( !m_rois.empty() )
+		for ( std::vector< cv::Point >::const_iterator it = m_contour.begin(); it != m_contour.end(); it++ )
+			if ( isRegionBorder( *it ) )
+				return;
+
+	CornerList rect( 4 );
+	for ( int i = 0; i < 4; i++ )
+	{
+		m_polygon[ i ] += offset;
+		rect[ i ][ 0 ] = static_cast< float >( m_polygon[ i ].x );
+		rect[ i ][ 1 ] = static_cast< float >( m_polygon[ i ].y );
+	}
+
+	if ( pDbgImg )
+		cv::polylines( pDbgImg->Mat(), m_polygon, true, CV_RGB( 255, 0, 255 ) );
+
+	LOG4CPP_TRACE( logger, "quadrangle: (" << m_polygon[ 0 ].x << ", " << m_polygon[ 0 ].y << ") (" << m_polygon[ 1 ].x << ", " << m_polygon[ 1 ].y
+		<< ") (" << m_polygon[ 2 ].x << ", " << m_polygon[ 2 ].y << ") (" << m_polygon[ 3 ].x << ", " << m_polygon[ 3 ].y << ")" );
+
+	quadrangles.push_back( rect );
+}
+
+} } } // namespace Ubitrack::Vision::Markers
@@ -0,0 +1,209 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @ingroup vision
+ * @file
+ * Extraction of quadrangle candidates from grey-scale images for marker detection.
+ */
+
+#ifndef __UBITRACK_VISION_QUADRANGLEEXTRACTOR_H_INCLUDED__
+#define __UBITRACK_VISION_QUADRANGLEEXTRACTOR_H_INCLUDED__
+
+#include <vector>
+#include <boost/utility.hpp>
+#include <opencv2/core/core.hpp>
+#include <utVision.h>
+#include "Image.h"
+#include "MarkerDetection.h"
+
+namespace Ubitrack { namespace Vision { namespace Markers {
+
+/**
+ * @ingroup vision
+ * Finds quadrangles in grey-scale images.
+ *
+ * Binarization and contour extraction are done in one step: the image is thresholded directly into a
+ * padded label buffer, on which the borders of all connected components are followed (Suzuki and Abe,
+ * "Topological Structural Analysis of Digitized Binary Images by Border Following", 1985) and
+ * approximated by polygons. All buffers are kept between calls, so an extractor that is reused for
+ * frames of the same size does not allocate memory.
+ *
+ * The image is thresholded in horizontal tiles using the OpenCV parallel framework. The local means of
+ * the adaptive thresholding are computed from running box sums, which are updated incrementally per
+ * row and column instead of filtering the whole image.
+ *
+ * An extractor must not be used by several threads at the same time.
+ */
+class UTVISION_EXPORT QuadrangleExtractor
+	: private boost::noncopyable
+{
+public:
+	/** constructor, defaults to the adaptive thresholding used by detectMarkers */
+	QuadrangleExtractor();
+
+	/**
+	 * Binarizes with a fixed threshold, pixels brighter than \c threshold are foreground.
+	 */
+	void setBinaryThreshold( int threshold );
+
+	/**
+	 * Binarizes with a local mean threshold, pixels brighter than the mean of the surrounding
+	 * \c blockSize x \c blockSize box minus \c delta are foreground (same as cv::ADAPTIVE_THRESH_MEAN_C).
+	 *
+	 * @param blockSize side length of the box, must be odd. If 0, (image height / 48) | 1 is used.
+	 * @param delta constant subtracted from the mean
+	 */
+	void setAdaptiveThreshold( int blockSize = 0, double delta = 4.0 );
+
+	/**
+	 * Restricts the analysis to regions of the image, e.g. around markers that are tracked.
+	 * Only the parts of the horizontal image tiles that overlap a region are thresholded and searched,
+	 * everything else is treated as background. Quadrangles must therefore lie completely inside a region.
+	 * Contours that touch the border of the analysed area inside the image are dropped, as they are cut
+	 * off by it. Contours at the image border are kept, as without regions. The regions stay active until 
+	 * they are cleared or replaced.
+	 *
+	 * @param rois regions in image coordinates, an empty list disables the restriction
+	 */
+	void setRegionsOfInterest( const std::vector< cv::Rect >& rois );
+
+	/** analyse the whole image again */
+	void clearRegionsOfInterest();
+
+	/**
+	 * Finds all quadrangles in a grey-scale image.
+	 *
+	 * This function does not respect the origin flag and assumes a y-coordinate of 0 is top.
+	 *
+	 * @param img grey-scale input image, not modified
+	 * @param quadrangles found quadrangles are appended to this list
+	 * @param pDbgImg optional debug image which shows found quadrangles
+	 * @param offset additional offset that is added to the corner coordinates
+	 */
+	void extract( Image& img, MarkerList& quadrangles, Image* pDbgImg = 0, cv::Point offset = cv::Point( 0, 0 ) );
+
+	/** time in milliseconds the last call to extract spent for binarization */
+	double binarizationTime() const
+	{ return m_fBinarizationTime; }
+
+	/** time in milliseconds the last call to extract spent for contour following and polygon approximation */
+	double contourTime() const
+	{ return m_fContourTime; }
+
+	/** number of contours the last call to extract has followed */
+	unsigned contourCount() const
+	{ return m_nContours; }
+
+protected:
+	/** parallel loop body that thresholds a range of tiles */
+	class TileBinarizer;
+
+	/** a horizontal band of the image that is processed as one unit */
+	struct Tile
+	{
+		/** first and last+1 row */
+		int y0, y1;
+
+		/** first and last+1 column that need to be analysed */
+		int x0, x1;
+	};
+
+	/** thresholds the image into the label buffer */
+	void binarize( const cv::Mat& grey );
+
+	/** thresholds one tile into the label buffer, may be called concurrently for different tiles */
+	void binarizeTile( const cv::Mat& grey, int iTile, int blockSize, int iDelta );
+
+	/**
+	 * follows a border in the label buffer and stores it in m_contour
+	 * @param start index of the border starting point in the label buffer
+	 * @param startDir direction of the 0-pixel next to \c start
+	 */
+	void followBorder( int start, int startDir );
+
+	/** checks if a pixel lies on the border of the area analysed within the regions of interest */
+	bool isRegionBorder( const cv::Point& p ) const;
+
+	/** approximates m_contour by a polygon and appends it to the result, if it is a suitable quadrangle */
+	void approximate( MarkerList& quadrangles, Image* pDbgImg, const cv::Point& offset );
+
+	/** use adaptive thresholding? */
+	bool m_bAdaptive;
+
+	/** fixed threshold */
+	int m_threshold;
+
+	/** box size for adaptive thresholding */
+	int m_blockSize;
+
+	/** constant for adaptive thresholding */
+	double m_delta;
+
+	/** width and height of the current image */
+	int m_width;
+	int m_height;
+
+	/** diagonal of the current image, reference for the contour size checks */
+	float m_fDiagonal;
+
+	/** binary image with a one pixel frame of zeros, later also holds the border labels */
+	std::vector< signed char > m_labels;
+
+	/** row step of the label buffer */
+	int m_step;
+
+	/** buffer offsets of the 8 neighbours in counter-clockwise order, starting with the right one */
+	int m_deltas[ 8 ];
+
+	/** regions of interest, empty for the whole image */
+	std::vector< cv::Rect > m_rois;
+
+	/** tiles of the current image */
+	std::vector< Tile > m_tiles;
+
+	/** height of the tiles, except for the last one */
+	int m_tileHeight;
+
+	/** per tile buffers for the running box sums of the adaptive thresholding */
+	std::vector< int > m_boxSums;
+
+	/** points of the current border */
+	std::vector< cv::Point > m_contour;
+
+	/** bounding box of the current border */
+	cv::Point m_contourMin;
+	cv::Point m_contourMax;
+
+	/** polygon approximation of the current border */
+	std::vector< cv::Point > m_polygon;
+
+	/** statistics of the last call to extract */
+	double m_fBinarizationTime;
+	double m_fContourTime;
+	unsigned m_nContours;
+};
+
+} } } // namespace Ubitrack::Vision::Markers
+
+#endif
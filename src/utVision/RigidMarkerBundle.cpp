@@ -0,0 +1,251 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @ingroup vision
+ * @file
+ * Implementation of the joint pose refinement for rigid marker bundles.
+ */
+
+#include <math.h>
+#include <utMath/Quaternion.h>
+#include <utUtil/Exception.h>
+#include <utAlgorithm/Projection.h>
+#include "RigidMarkerBundle.h"
+#include "MarkerInfoTable.h"
+
+// get a logger
+#include <log4cpp/Category.hh>
+static log4cpp::Category& logger( log4cpp::Category::getInstance( "Ubitrack.Vision.RigidMarkerBundle" ) );
+
+#ifdef HAVE_LAPACK
+#include <utMath/Optimization/LevenbergMarquardt.h>
+#include <utVision/EdgeMeasurement.h>
+#include <utAlgorithm/Function/ProjectivePoseNormalize.h>
+#endif
+
+namespace ublas = boost::numeric::ublas;
+
+
+namespace Ubitrack { namespace Vision { namespace Markers {
+
+static Math::Vector< double, 3 > crossProduct( const Math::Vector< double, 3 >& a, const Math::Vector< double, 3 >& b )
+{
+	return Math::Vector< double, 3 >( a( 1 ) * b( 2 ) - a( 2 ) * b( 1 ), a( 2 ) * b( 0 ) - a( 0 ) * b( 2 ), a( 0 ) * b( 1 ) - a( 1 ) * b( 0 ) );
+}
+
+
+RigidMarkerBundle::RigidMarkerBundle( unsigned int uiCodeSize, unsigned int uiMarkerSize, unsigned long long int uiMask, bool useInnerEdgels )
+	: m_uiCodeSize( uiCodeSize )
+	, m_uiMarkerSize( uiMarkerSize )
+	, m_uiMask( uiMask )
+	, m_useInnerEdgels( useInnerEdgels )
+{
+}
+
+
+void RigidMarkerBundle::addMarker( unsigned long long int nCode, const Math::Pose& pose, float fSize )
+{
+	Marker marker;
+	marker.nCode = nCode;
+	marker.pose = pose;
+
+	// transform the edgels of the marker into the bundle frame
+	computeMarkerEdgels( nCode, fSize, marker.edgels1, marker.edgels2, m_uiCodeSize, m_uiMarkerSize, m_uiMask, m_useInnerEdgels );
+	for ( std::size_t i = 0; i < marker.edgels1.size(); i++ )
+	{
+		const Math::Vector< double, 3 > p1( pose * Math::Vector< double, 3 >( marker.edgels1[ i ]( 0 ), marker.edgels1[ i ]( 1 ), marker.edgels1[ i ]( 2 ) ) );
+		const Math::Vector< double, 3 > p2( pose * Math::Vector< double, 3 >( marker.edgels2[ i ]( 0 ), marker.edgels2[ i ]( 1 ), marker.edgels2[ i ]( 2 ) ) );
+		marker.edgels1[ i ] = Math::Vector< float, 3 >( float( p1( 0 ) ), float( p1( 1 ) ), float( p1( 2 ) ) );
+		marker.edgels2[ i ] = Math::Vector< float, 3 >( float( p2( 0 ) ), float( p2( 1 ) ), float( p2( 2 ) ) );
+	}
+
+	m_markers.push_back( marker );
+}
+
+
+void RigidMarkerBundle::addMarker( unsigned long long int nCode, const std::vector< Math::Vector< double, 3 > >& corners )
+{
+	if ( corners.size() != 4 )
+		UBITRACK_THROW( "A marker needs four corners" );
+
+	// the corners are (-1, 1), (-1, -1), (1, -1), (1, 1) times half the marker size in the marker frame
+	const Math::Vector< double, 3 > center( 0.25 * ( corners[ 0 ] + corners[ 1 ] + corners[ 2 ] + corners[ 3 ] ) );
+	Math::Vector< double, 3 > xAxis( 0.5 * ( corners[ 2 ] + corners[ 3 ] - corners[ 0 ] - corners[ 1 ] ) );
+	Math::Vector< double, 3 > yAxis( 0.5 * ( corners[ 0 ] + corners[ 3 ] - corners[ 1 ] - corners[ 2 ] ) );
+	const double fSize = 0.5 * ( ublas::norm_2( xAxis ) + ublas::norm_2( yAxis ) );
+
+	// orthonormalize, keeping the direction of the x axis
+	xAxis /= ublas::norm_2( xAxis );
+	Math::Vector< double, 3 > zAxis( crossProduct( xAxis, yAxis ) );
+	zAxis /= ublas::norm_2( zAxis );
+	yAxis = crossProduct( zAxis, xAxis );
+
+	Math::Matrix< double, 3, 3 > rot;
+	for ( unsigned i = 0; i < 3; i++ )
+	{
+		rot( i, 0 ) = xAxis( i );
+		rot( i, 1 ) = yAxis( i );
+		rot( i, 2 ) = zAxis( i );
+	}
+
+	addMarker( nCode, Math::Pose( Math::Quaternion( rot ), center ), float( fSize ) );
+}
+
+
+#ifdef HAVE_LAPACK
+
+/** area of the quadrangle spanned by the corners of a marker in the image */
+static float projectedArea( const CornerList& corners )
+{
+	float fArea = 0.0f;
+	for ( std::size_t i = 0; i < corners.size(); i++ )
+	{
+		const Math::Vector< float, 2 >& a( corners[ i ] );
+		const Math::Vector< float, 2 >& b( corners[ ( i + 1 ) % corners.size() ] );
+		fArea += a( 0 ) * b( 1 ) - a( 1 ) * b( 0 );
+	}
+	return 0.5f * fabsf( fArea );
+}
+
+
+template< class InfoMap >
+unsigned RigidMarkerBundle::refinePoseImpl( Image& img, const InfoMap& markerInfos, const Math::Matrix< float, 3, 3 >& K, 
+	Math::Pose& pose, float* pResidual, DetectionStatistics* pStats ) const
+{
+	// the edge measurement works on the origin-corrected intrinsics, as in detectMarkers
+	Math::Matrix< float, 3, 3 > correctedK( K );
+	Algorithm::correctOrigin( correctedK, img.origin(), img.height() );
+
+	std::vector< Math::Vector< float, 3 > > edgels1;
+	std::vector< Math::Vector< float, 3 > > edgels2;
+	Math::Matrix< float, 2, 2 > searchScale( Math::Matrix< float, 2, 2 >::zeros() );
+	const Marker* pBest = 0;
+	const MarkerInfo* pBestInfo = 0;
+	float fBestArea = 0.0f;
+	unsigned nMarkers = 0;
+
+	for ( typename std::vector< Marker >::const_iterator it = m_markers.begin(); it != m_markers.end(); it++ )
+	{
+		typename InfoMap::const_iterator itInfo = markerInfos.find( it->nCode );
+		if ( itInfo == markerInfos.end() )
+			continue;
+
+		const MarkerInfo& info( itInfo->second );
+		if ( info.found < MarkerInfo::ERefinementFound || info.refinement < MarkerInfo::EInitialPose )
+			continue;
+
+		nMarkers++;
+		edgels1.insert( edgels1.end(), it->edgels1.begin(), it->edgels1.end() );
+		edgels2.insert( edgels2.end(), it->edgels2.begin(), it->edgels2.end() );
+
+		// covariance of the marker corners, as in the refinement of single markers
+		Math::Matrix< float, 2, 2 > cornerCov( Math::Matrix< float, 2, 2 >::zeros() );
+		Math::Vector< float, 2 > cornerAvg( Math::Vector< float, 2 >::zeros() );
+		for ( unsigned int i = 0; i < 4; i++ )
+		{
+			cornerCov += ublas::outer_prod( info.corners[ i ], info.corners[ i ] );
+			cornerAvg += info.corners[ i ];
+		}
+		cornerCov /= 4;
+		cornerAvg /= 4;
+		cornerCov -= ublas::outer_prod( cornerAvg, cornerAvg );
+		searchScale += cornerCov;
+
+		// the largest marker in the image has the most accurate initial pose
+		const float fArea = projectedArea( info.corners );
+		if ( !pBestInfo || fArea > fBestArea )
+		{
+			pBest = &*it;
+			pBestInfo = &info;
+			fBestArea = fArea;
+		}
+	}
+
+	if ( !nMarkers )
+		return 0;
+
+	// use the average marker for the search range
+	searchScale /= float( nMarkers * m_uiMarkerSize * m_uiMarkerSize );
+	searchScale *= ( 2.0f * 2.0f );
+
+	// initialize with the largest marker
+	Math::Vector< float, 7 > poseVector;
+	( pBestInfo->pose * ~pBest->pose ).toVector( poseVector );
+
+	EdgeListMeasurementFunction< float, FindEdgePositiveMaximum > edgeMF( 
+		edgels1, edgels2, correctedK, searchScale, img );
+
+	try
+	{
+		Math::Optimization::weightedLevenbergMarquardt( 
+			edgeMF,
+			poseVector,
+			Math::Vector< float >::zeros( edgels1.size() ),
+			// Max. 6 iterations, precision 1e-4
+			Math::Optimization::OptTerminate( 6, 1e-4 ),
+			Algorithm::Function::ProjectivePoseNormalize(),
+			edgeMF
+		);
+	}
+	catch ( Ubitrack::Util::Exception& e )
+	{
+		LOG4CPP_DEBUG( logger, "Bundle refinement failed: " << e.what() );
+		return 0;
+	}
+	
+	if ( pStats )
+	{
+		pStats->nEdgeRefinements++;
+		pStats->nLMIterations += edgeMF.getJacobianEvaluations();
+	}
+
+	const int nVisibility = int( edgeMF.getGoodEdgelsPercentage() * 100 );
+	LOG4CPP_TRACE( logger, "Bundle refined with " << nMarkers << " markers, visibility " << nVisibility << "%" );
+	if ( nVisibility < 40 )
+		return 0;
+
+	pose = Math::Pose::fromVector( poseVector );
+	if ( pResidual )
+		*pResidual = edgeMF.getBoundedResidual();
+
+	return nMarkers;
+}
+
+
+unsigned RigidMarkerBundle::refinePose( Image& img, const MarkerInfoMap& markerInfos, const Math::Matrix< float, 3, 3 >& K, 
+	Math::Pose& pose, float* pResidual, DetectionStatistics* pStats ) const
+{
+	return refinePoseImpl( img, markerInfos, K, pose, pResidual, pStats );
+}
+
+
+unsigned RigidMarkerBundle::refinePose( Image& img, const MarkerInfoTable& markerInfos, const Math::Matrix< float, 3, 3 >& K, 
+	Math::Pose& pose, float* pResidual, DetectionStatistics* pStats ) const
+{
+	return refinePoseImpl( img, markerInfos, K, pose, pResidual, pStats );
+}
+
+#endif
+
+} } } // namespace Ubitrack::Vision::Markers
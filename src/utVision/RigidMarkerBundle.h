@@ -0,0 +1,134 @@
+/*
+ * Ubitrack - Library for Ubiquitous Tracking
+ * Copyright 2006, Technische Universitaet Muenchen, and individual
+ * contributors as indicated by the @authors tag. See the 
+ * copyright.txt in the distribution for a full listing of individual
+ * contributors.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this software; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA, or see the FSF site: http://www.fsf.org.
+ */
+
+/**
+ * @ingroup vision
+ * @file
+ * Joint pose refinement for rigidly attached sets of markers.
+ */
+
+#ifndef __UBITRACK_VISION_RIGIDMARKERBUNDLE_H_INCLUDED__
+#define __UBITRACK_VISION_RIGIDMARKERBUNDLE_H_INCLUDED__
+
+#include <vector>
+#include <utVision.h>
+#include <utMath/Vector.h>
+#include <utMath/Matrix.h>
+#include <utMath/Pose.h>
+#include "Image.h"
+#include "MarkerDetection.h"
+
+namespace Ubitrack { namespace Vision { namespace Markers {
+
+/**
+ * @ingroup vision
+ * A set of markers with known poses relative to each other, e.g. computed by the marker bundle tool.
+ *
+ * Instead of refining every marker on its own, the edgels of all markers of the bundle that were found
+ * in a frame are used in a single Levenberg-Marquardt optimization with the bundle pose as the only
+ * unknown. For this, the markers only need to be detected with \c MarkerInfo::EInitialPose or
+ * \c MarkerInfo::ERefinedPose, which saves the edge-based refinement of every single marker.
+ */
+class UTVISION_EXPORT RigidMarkerBundle
+{
+public:
+	/**
+	 * constructs an empty bundle
+	 * @param uiCodeSize size of the markers' bit pattern
+	 * @param uiMarkerSize overall size of the markers, counted in bits
+	 * @param uiMask regions of the bit pattern that belong to the ID (1) or not (0)
+	 * @param useInnerEdgels also use the edges inside the markers
+	 */
+	RigidMarkerBundle( unsigned int uiCodeSize = 4, unsigned int uiMarkerSize = 6, unsigned long long int uiMask = 0xFFFF,
+		bool useInnerEdgels = true );
+
+	/**
+	 * adds a marker
+	 * @param nCode normalized marker code
+	 * @param pose pose of the marker in the bundle coordinate frame
+	 * @param fSize side length of the marker
+	 */
+	void addMarker( unsigned long long int nCode, const Math::Pose& pose, float fSize );
+
+	/**
+	 * adds a marker given by its corners in the bundle coordinate frame, in the order written by
+	 * BAInfo::writeUTQL to the marker calibration files: top left, bottom left, bottom right, top right.
+	 */
+	void addMarker( unsigned long long int nCode, const std::vector< Math::Vector< double, 3 > >& corners );
+
+	/** number of markers */
+	std::size_t size() const
+	{ return m_markers.size(); }
+
+#ifdef HAVE_LAPACK
+	/**
+	 * Refines the pose of the bundle in a frame in which detectMarkers has found some of its markers.
+	 *
+	 * The optimization is initialized with the pose of the found marker that covers the largest area 
+	 * in the image.
+	 *
+	 * @param img the grey-scale image passed to detectMarkers
+	 * @param markerInfos the marker infos updated by detectMarkers
+	 * @param K camera intrinsics matrix, as passed to detectMarkers
+	 * @param pose returns the pose of the bundle in camera coordinates
+	 * @param pResidual optionally returns the residual of the optimization
+	 * @param pStats optionally counts the refinement and its LM iterations, without resetting the statistics
+	 * @return number of markers that were used, 0 if the bundle was not found and \c pose was not changed
+	 */
+	unsigned refinePose( Image& img, const MarkerInfoMap& markerInfos, const Math::Matrix< float, 3, 3 >& K, 
+		Math::Pose& pose, float* pResidual = 0, DetectionStatistics* pStats = 0 ) const;
+
+	/** refines the pose of the bundle, see above */
+	unsigned refinePose( Image& img, const MarkerInfoTable& markerInfos, const Math::Matrix< float, 3, 3 >& K, 
+		Math::Pose& pose, float* pResidual = 0, DetectionStatistics* pStats = 0 ) const;
+#endif
+
+protected:
+	/** a marker of the bundle */
+	struct Marker
+	{
+		unsigned long long int nCode;
+
+		/** pose in the bundle frame */
+		Math::Pose pose;
+
+		/** edgels in the bundle frame, see computeMarkerEdgels */
+		std::vector< Math::Vector< float, 3 > > edgels1;
+		std::vector< Math::Vector< float, 3 > > edgels2;
+	};
+
+	template< class InfoMap >
+	unsigned refinePoseImpl( Image& img, const InfoMap& markerInfos, const Math::Matrix< float, 3, 3 >& K, 
+		Math::Pose& pose, float* pResidual, DetectionStatistics* pStats ) const;
+
+	unsigned int m_uiCodeSize;
+	unsigned int m_uiMarkerSize;
+	unsigned long long int m_uiMask;
+	bool m_useInnerEdgels;
+
+	std::vector< Marker > m_markers;
+};
+
+} } } // namespace Ubitrack::Vision::Markers
+
+#endif
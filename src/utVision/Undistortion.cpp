@@ -32,9 +32,21 @@
 
 #include "Undistortion.h"
 
+// std
+#include <algorithm>
+
+// Boost
+#include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+
 // OpenCV
 #include <opencv/cv.h>
 
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define UTVISION_UNDISTORTION_SSE2
+#endif
+
 // Ubitrack
 #include "Image.h"
 #include <utUtil/CalibFile.h>
@@ -47,17 +59,30 @@ static log4cpp::Category& logger( log4cpp::Category::getInstance( "Ubitrack.Visi
 
 namespace { 
 	
+	/// number of image formats for which the undistortion maps are kept
+	const std::size_t g_nMaxMapSets = 4;
+	
+	/// distance in pixels between the nodes of the inverse distortion grid of undistortPoints
+	const int g_nPointGridStep = 8;
+	
+	/// fixed-point iterations to invert the distortion at the grid nodes and for the individual points
+	const int g_nPointGridIterations = 20;
+	const int g_nPointIterations = 2;
+	
+	/// number of points converted at a time by the vector overloads of undistortPoints and distortPoints
+	const std::size_t g_nPointChunk = 64;
+	
 	/// scales the intrinsic camera matrix parameters to used image resolution
 	template< typename PrecisionType >	
-	void inline correctForScale( const Ubitrack::Vision::Image& image, Ubitrack::Math::CameraIntrinsics< PrecisionType >& intrinsics )
+	void inline correctForScale( const int width, const int height, Ubitrack::Math::CameraIntrinsics< PrecisionType >& intrinsics )
 	{
 		// scale the intrinsic matrix up or down if image size is different ( does not work if image is cropped instead of scaled)
-		const PrecisionType scaleX = image.width() / static_cast< PrecisionType > ( intrinsics.dimension( 0 ) );
+		const PrecisionType scaleX = width / static_cast< PrecisionType > ( intrinsics.dimension( 0 ) );
 		intrinsics.matrix ( 0, 0 ) *= scaleX;
 		intrinsics.matrix ( 0, 2 ) *= scaleX;
 		intrinsics.dimension ( 0 ) *= scaleX;
 		
-		const PrecisionType scaleY = image.height() / static_cast< PrecisionType > ( intrinsics.dimension( 1 ) );
+		const PrecisionType scaleY = height / static_cast< PrecisionType > ( intrinsics.dimension( 1 ) );
 		intrinsics.matrix ( 1, 1 ) *= scaleY;
 		intrinsics.matrix ( 1, 2 ) *= scaleY;
 		intrinsics.dimension ( 1 ) *= scaleY;
@@ -79,41 +104,348 @@ namespace {
 	
 	/// corrects the Ubitrack intrinsics parameters if the image is flipped upside-down
 	template< typename PrecisionType >	
-	void inline correctForOrigin( const Ubitrack::Vision::Image& image, Ubitrack::Math::CameraIntrinsics< PrecisionType >& intrinsics )
+	void inline correctForOrigin( const int height, const int origin, Ubitrack::Math::CameraIntrinsics< PrecisionType >& intrinsics )
 	{
-		if ( image.origin() )
+		if ( origin )
 			return;
 		
 		{	// compensate if origin==0
-			intrinsics.matrix( 1, 2 ) = image.height() - 1 - intrinsics.matrix( 1, 2 );
+			intrinsics.matrix( 1, 2 ) = height - 1 - intrinsics.matrix( 1, 2 );
 			intrinsics.tangential_params( 1 ) *= -1.0;
 			
 			intrinsics.reset(); // recalculate the inverse
 		}
 	}
 	
+	/// hashes the parameters that determine the undistortion maps
+	template< typename PrecisionType >	
+	std::size_t hashIntrinsics( const Ubitrack::Math::CameraIntrinsics< PrecisionType >& intrinsics )
+	{
+		std::size_t seed = 0;
+		for ( std::size_t i = 0; i < 3; i++ )
+			for ( std::size_t j = 0; j < 3; j++ )
+				boost::hash_combine( seed, intrinsics.matrix( i, j ) );
+		for ( std::size_t i = 0; i < intrinsics.radial_size; i++ )
+			boost::hash_combine( seed, intrinsics.radial_params( i ) );
+		boost::hash_combine( seed, intrinsics.tangential_params( 0 ) );
+		boost::hash_combine( seed, intrinsics.tangential_params( 1 ) );
+		boost::hash_combine( seed, intrinsics.dimension( 0 ) );
+		boost::hash_combine( seed, intrinsics.dimension( 1 ) );
+		return seed;
+	}
+	
+	/// derives the OpenCV intrinsics for images of the given format
+	template< typename PrecisionType >
+	Ubitrack::Math::CameraIntrinsics< PrecisionType > correctForImage( const Ubitrack::Math::CameraIntrinsics< PrecisionType >& intrinsics,
+		const int width, const int height, const int origin )
+	{
+		Ubitrack::Math::CameraIntrinsics< PrecisionType > result( intrinsics );
+		
+		// image size different than intrinsics? -> scale
+		if ( result.dimension( 0 ) > 0 && result.dimension( 1 ) > 0
+			&& ( static_cast< int >( result.dimension( 0 ) ) != width || static_cast< int >( result.dimension( 1 ) ) != height ) )
+			correctForScale( width, height, result );
+		// always right-hand -> left-hand
+		correctForOpenCV( result );
+		// upside down? -> flip intrinsics and tangential param
+		correctForOrigin( height, origin, result );
+		
+		return result;
+	}
+	
+	/// OpenCV camera parameters and distortion coefficients in single precision, as used by cvInitUndistortMap
+	struct DistortionModel
+	{
+		float fx, fy, cx, cy;
+		float k1, k2, p1, p2, k3, k4, k5, k6;
+	};
+	
+	/// extracts the distortion model from OpenCV intrinsics
+	template< typename PrecisionType >
+	DistortionModel distortionModel( const Ubitrack::Math::CameraIntrinsics< PrecisionType >& intrinsics )
+	{
+		PrecisionType radial[ 6 ] = { 0, 0, 0, 0, 0, 0 };
+		for ( std::size_t i = 0; i < std::min< std::size_t >( intrinsics.radial_size, 6 ); i++ )
+			radial[ i ] = intrinsics.radial_params( i );
+		
+		DistortionModel m;
+		m.fx = static_cast< float >( intrinsics.matrix( 0, 0 ) );
+		m.fy = static_cast< float >( intrinsics.matrix( 1, 1 ) );
+		m.cx = static_cast< float >( intrinsics.matrix( 0, 2 ) );
+		m.cy = static_cast< float >( intrinsics.matrix( 1, 2 ) );
+		m.k1 = static_cast< float >( radial[ 0 ] );
+		m.k2 = static_cast< float >( radial[ 1 ] );
+		m.p1 = static_cast< float >( intrinsics.tangential_params( 0 ) );
+		m.p2 = static_cast< float >( intrinsics.tangential_params( 1 ) );
+		m.k3 = static_cast< float >( radial[ 2 ] );
+		m.k4 = static_cast< float >( radial[ 3 ] );
+		m.k5 = static_cast< float >( radial[ 4 ] );
+		m.k6 = static_cast< float >( radial[ 5 ] );
+		return m;
+	}
+	
+	/** 
+	 * computes the radial factor and tangential offset of normalized undistorted coordinates, 
+	 * the distorted coordinates being ( x * kr + dx, y * kr + dy )
+	 */
+	inline void distortionTerms( const DistortionModel& m, float x, float y, float& kr, float& dx, float& dy )
+	{
+		const float x2 = x * x;
+		const float y2 = y * y;
+		const float xy2 = 2 * x * y;
+		const float r2 = x2 + y2;
+		kr = ( 1 + ( ( m.k3 * r2 + m.k2 ) * r2 + m.k1 ) * r2 ) / ( 1 + ( ( m.k6 * r2 + m.k5 ) * r2 + m.k4 ) * r2 );
+		dx = m.p1 * xy2 + m.p2 * ( r2 + 2 * x2 );
+		dy = m.p1 * ( r2 + 2 * y2 ) + m.p2 * xy2;
+	}
+	
+#ifdef UTVISION_UNDISTORTION_SSE2
+	/// distortionTerms for four points
+	inline void distortionTerms( const DistortionModel& m, __m128 x, __m128 y, __m128& kr, __m128& dx, __m128& dy )
+	{
+		const __m128 one = _mm_set1_ps( 1.0f );
+		const __m128 two = _mm_set1_ps( 2.0f );
+		const __m128 x2 = _mm_mul_ps( x, x );
+		const __m128 y2 = _mm_mul_ps( y, y );
+		const __m128 xy2 = _mm_mul_ps( two, _mm_mul_ps( x, y ) );
+		const __m128 r2 = _mm_add_ps( x2, y2 );
+		
+		__m128 num = _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m.k3 ), r2 ), _mm_set1_ps( m.k2 ) );
+		num = _mm_add_ps( _mm_mul_ps( num, r2 ), _mm_set1_ps( m.k1 ) );
+		num = _mm_add_ps( one, _mm_mul_ps( num, r2 ) );
+		__m128 den = _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m.k6 ), r2 ), _mm_set1_ps( m.k5 ) );
+		den = _mm_add_ps( _mm_mul_ps( den, r2 ), _mm_set1_ps( m.k4 ) );
+		den = _mm_add_ps( one, _mm_mul_ps( den, r2 ) );
+		kr = _mm_div_ps( num, den );
+		
+		const __m128 p1 = _mm_set1_ps( m.p1 );
+		const __m128 p2 = _mm_set1_ps( m.p2 );
+		dx = _mm_add_ps( _mm_mul_ps( p1, xy2 ), _mm_mul_ps( p2, _mm_add_ps( r2, _mm_mul_ps( two, x2 ) ) ) );
+		dy = _mm_add_ps( _mm_mul_ps( p1, _mm_add_ps( r2, _mm_mul_ps( two, y2 ) ) ), _mm_mul_ps( p2, xy2 ) );
+	}
+#endif
+	
+	/// luminance of an 8 bit pixel in fixed point, with the weights of cv::cvtColor
+	template< int nChannels >
+	inline int greyValue( const unsigned char* p, int iR, int iB )
+	{
+		if ( nChannels == 1 )
+			return p[ 0 ];
+		return ( p[ iB ] * 1868 + p[ 1 ] * 9617 + p[ iR ] * 4899 + ( 1 << 13 ) ) >> 14;
+	}
+	
+	/**
+	 * bilinear interpolation of the luminance at ( x + ax / 32, y + ay / 32 ) with the 5 bit weights of
+	 * cv::remap, neighbours outside the image being black
+	 */
+	template< int nChannels >
+	inline unsigned char sampleGrey( const cv::Mat& src, int x, int y, int ax, int ay, int iR, int iB )
+	{
+		int v00, v01, v10, v11;
+		if ( x >= 0 && y >= 0 && x < src.cols - 1 && y < src.rows - 1 )
+		{
+			const unsigned char* p = src.ptr( y ) + x * nChannels;
+			v00 = greyValue< nChannels >( p, iR, iB );
+			v01 = greyValue< nChannels >( p + nChannels, iR, iB );
+			p += src.step;
+			v10 = greyValue< nChannels >( p, iR, iB );
+			v11 = greyValue< nChannels >( p + nChannels, iR, iB );
+		}
+		else
+		{
+			int v[ 4 ];
+			for ( int k = 0; k < 4; k++ )
+			{
+				const int xk = x + ( k & 1 );
+				const int yk = y + ( k >> 1 );
+				v[ k ] = ( xk >= 0 && yk >= 0 && xk < src.cols && yk < src.rows ) ? greyValue< nChannels >( src.ptr( yk ) + xk * nChannels, iR, iB ) : 0;
+			}
+			v00 = v[ 0 ];
+			v01 = v[ 1 ];
+			v10 = v[ 2 ];
+			v11 = v[ 3 ];
+		}
+		
+		const int a = v00 * ( 32 - ax ) + v01 * ax;
+		const int b = v10 * ( 32 - ax ) + v11 * ax;
+		return static_cast< unsigned char >( ( a * ( 32 - ay ) + b * ay + 512 ) >> 10 );
+	}
+	
+	/**
+	 * remaps and converts an 8 bit image to grey row by row. If pHalf is given, each pair of rows is 
+	 * averaged into it as soon as it is complete, while the rows are still in the cache.
+	 */
+	template< int nChannels >
+	void remapGrey( const cv::Mat& src, const cv::Mat& mapX, const cv::Mat& mapY, bool bFixedPoint, 
+		cv::Mat& dst, cv::Mat* pHalf, int iR, int iB )
+	{
+		for ( int y = 0; y < dst.rows; y++ )
+		{
+			unsigned char* pDst = dst.ptr( y );
+			if ( bFixedPoint )
+			{
+				// integer positions and indices into the 32x32 table of interpolation weights
+				const short* pPos = mapX.ptr< short >( y );
+				const unsigned short* pIndex = mapY.ptr< unsigned short >( y );
+				for ( int x = 0; x < dst.cols; x++ )
+					pDst[ x ] = sampleGrey< nChannels >( src, pPos[ 2 * x ], pPos[ 2 * x + 1 ], pIndex[ x ] & 31, ( pIndex[ x ] >> 5 ) & 31, iR, iB );
+			}
+			else
+			{
+				const float* pX = mapX.ptr< float >( y );
+				const float* pY = mapY.ptr< float >( y );
+				for ( int x = 0; x < dst.cols; x++ )
+				{
+					const int ix = cv::saturate_cast< int >( pX[ x ] * 32 );
+					const int iy = cv::saturate_cast< int >( pY[ x ] * 32 );
+					pDst[ x ] = sampleGrey< nChannels >( src, ix >> 5, iy >> 5, ix & 31, iy & 31, iR, iB );
+				}
+			}
+			
+			if ( pHalf && ( y & 1 ) && ( y >> 1 ) < pHalf->rows )
+			{
+				const unsigned char* pUpper = dst.ptr( y - 1 );
+				unsigned char* pHalfRow = pHalf->ptr( y >> 1 );
+				for ( int x = 0; x < pHalf->cols; x++ )
+					pHalfRow[ x ] = static_cast< unsigned char >( ( pUpper[ 2 * x ] + pUpper[ 2 * x + 1 ] + pDst[ 2 * x ] + pDst[ 2 * x + 1 ] + 2 ) >> 2 );
+			}
+		}
+	}
 	
 }	// anonymous namespace
 
 namespace Ubitrack { namespace Vision {
+
+/// undistortion maps for one image size and origin, built from the intrinsics with the given hash
+struct Undistortion::MapSet
+{
+	int width;
+	int height;
+	int origin;
+	std::size_t intrinsicsHash;
+	MapFormat format;
+	
+	/// intrinsics scaled and corrected for OpenCV and the image origin
+	intrinsics_type intrinsics;
 	
-Undistortion::Undistortion(){};
+	/// true once the maps have been built, protected by Undistortion::m_mapMutex
+	bool bReady;
+	
+	/// x and y coordinates or positions and interpolation table indices, see MapFormat. Empty if building the maps failed.
+	boost::scoped_ptr< Image > pMapX;
+	boost::scoped_ptr< Image > pMapY;
+};
+
+/// distortion model and inverse distortion grid for the points of one image size and origin
+struct Undistortion::PointModel
+{
+	int width;
+	int height;
+	int origin;
+	std::size_t intrinsicsHash;
+	
+	DistortionModel model;
+	
+	/// normalized undistorted coordinates of the raw pixels ( i * g_nPointGridStep, j * g_nPointGridStep ), row by row
+	int gridWidth;
+	int gridHeight;
+	std::vector< float > gridX;
+	std::vector< float > gridY;
+};
+	
+Undistortion::Undistortion()
+	: m_bStopMapThread( false )
+	, m_intrinsicsHash( 0 )
+	, m_mapFormat( EMapFloat )
+	, m_bBackgroundMapping( false )
+	, m_nextOutputBuffer( 0 )
+{};
 
 Undistortion::Undistortion( const std::string& intrinsicMatrixFile, const std::string& distortionFile )
+	: m_bStopMapThread( false )
+	, m_intrinsicsHash( 0 )
+	, m_mapFormat( EMapFloat )
+	, m_bBackgroundMapping( false )
+	, m_nextOutputBuffer( 0 )
 {
 	reset( intrinsicMatrixFile, distortionFile );
 }
 
 Undistortion::Undistortion( const std::string& cameraIntrinsicsFile )
+	: m_bStopMapThread( false )
+	, m_intrinsicsHash( 0 )
+	, m_mapFormat( EMapFloat )
+	, m_bBackgroundMapping( false )
+	, m_nextOutputBuffer( 0 )
 {
 	reset( cameraIntrinsicsFile );
 }
 
 Undistortion::Undistortion( const intrinsics_type& intrinsics )
+	: m_bStopMapThread( false )
+	, m_intrinsicsHash( 0 )
+	, m_mapFormat( EMapFloat )
+	, m_bBackgroundMapping( false )
+	, m_nextOutputBuffer( 0 )
 {
 	reset( intrinsics );
 }
 
+Undistortion::~Undistortion()
+{
+	// the background thread accesses the mutex and condition variables, queued maps are dropped
+	if ( !m_pMapThread )
+		return;
+	
+	{
+		boost::mutex::scoped_lock lock( m_mapMutex );
+		m_bStopMapThread = true;
+	}
+	m_mapQueued.notify_all();
+	m_pMapThread->join();
+}
+
+void Undistortion::setMapFormat( MapFormat format )
+{
+	if ( format == m_mapFormat )
+		return;
+	
+	m_mapFormat = format;
+	
+	// rebuild the maps on the next image
+	clearMappings();
+}
+
+void Undistortion::clearMappings()
+{
+	// maps that are still being built are released by the background thread
+	boost::mutex::scoped_lock lock( m_mapMutex );
+	m_mapSets.clear();
+	m_pointModels.clear();
+}
+
+void Undistortion::setIntrinsics( const intrinsics_type& intrinsics )
+{
+	// mapping and pointModel read the intrinsics from other threads
+	boost::mutex::scoped_lock lock( m_mapMutex );
+	m_intrinsics = intrinsics;
+	m_intrinsicsHash = hashIntrinsics( m_intrinsics );
+	m_mapSets.clear();
+	m_pointModels.clear();
+}
+
+void Undistortion::prepare( int width, int height, int origin )
+{
+	mapping( width, height, origin, false );
+}
+
+void Undistortion::setOutputBuffers( std::size_t nBuffers )
+{
+	m_outputBuffers.clear();
+	m_outputBuffers.resize( nBuffers );
+	m_nextOutputBuffer = 0;
+}
+
 void Undistortion::reset( const std::string& CameraIntrinsicsFile )
 {
 	Measurement::CameraIntrinsics measMat;
@@ -124,18 +456,17 @@ void Undistortion::reset( const std::string& CameraIntrinsicsFile )
 
 void Undistortion::reset( const intrinsics_type& camIntrinsics )
 {
-	m_intrinsics = camIntrinsics;
-	m_intrinsicMatrix = m_intrinsics.matrix;
-	
-	m_coeffs( 0 ) = m_intrinsics.radial_params ( 0 );
-	m_coeffs( 1 ) = m_intrinsics.radial_params ( 1 );
-	m_coeffs( 2 ) = m_intrinsics.tangential_params ( 0 );
-	m_coeffs( 3 ) = m_intrinsics.tangential_params ( 1 );
+	m_intrinsicMatrix = camIntrinsics.matrix;
 	
-	for( std::size_t i = 4; i < (m_intrinsics.radial_size+2); ++i )
-		m_coeffs( i ) = m_intrinsics.radial_params( i-2 );
+	m_coeffs( 0 ) = camIntrinsics.radial_params ( 0 );
+	m_coeffs( 1 ) = camIntrinsics.radial_params ( 1 );
+	m_coeffs( 2 ) = camIntrinsics.tangential_params ( 0 );
+	m_coeffs( 3 ) = camIntrinsics.tangential_params ( 1 );
 	
+	for( std::size_t i = 4; i < (camIntrinsics.radial_size+2); ++i )
+		m_coeffs( i ) = camIntrinsics.radial_params( i-2 );
 	
+	setIntrinsics( camIntrinsics );
 }
 
 void Undistortion::reset( const std::string& intrinsicMatrixFile, const std::string& distortionFile )
@@ -200,18 +531,21 @@ void Undistortion::reset( const std::string& intrinsicMatrixFile, const std::str
 		radVec( 5 ) = m_coeffs( 7 );
 		intrinsics_type::tangential_type tanVec = intrinsics_type::tangential_type( m_coeffs( 2 ), m_coeffs( 3 ) );
 		
-		m_intrinsics = intrinsics_type( m_intrinsicMatrix, radVec, tanVec );
+		setIntrinsics( intrinsics_type( m_intrinsicMatrix, radVec, tanVec ) );
 	}
 }
 
-/// resets the mapping to the provided image parameters
-bool Undistortion::resetMapping( const int width, const int height, const intrinsics_type& intrinsics )
+/// computes the maps of a map set for the given OpenCV intrinsics
+bool Undistortion::resetMapping( MapSet& maps, const intrinsics_type& intrinsics )
 {
-	LOG4CPP_INFO( logger, "initialize undistortion mapping with intrinsics:\n" << intrinsics );
+	LOG4CPP_INFO( logger, "initialize undistortion mapping for " << maps.width << "x" << maps.height << " with intrinsics:\n" << intrinsics );
+	
+	const int width = maps.width;
+	const int height = maps.height;
 	
 	// reset the map images
-	m_pMapX.reset( new Image( width, height, 1, CV_32F ) );
-	m_pMapY.reset( new Image( width, height, 1, CV_32F ) );
+	maps.pMapX.reset( new Image( width, height, 1, CV_32F ) );
+	maps.pMapY.reset( new Image( width, height, 1, CV_32F ) );
 	
 	// copy the values to the corresponding opencv data-structures
 	// CvMat cvIntrinsics;
@@ -223,8 +557,8 @@ bool Undistortion::resetMapping( const int width, const int height, const intrin
 	
 	// set values to the mapping
 	// @todo should be upgraded to modern opencv
-	CvMat pX = m_pMapX->Mat();
-	CvMat pY = m_pMapY->Mat();
+	CvMat pX = maps.pMapX->Mat();
+	CvMat pY = maps.pMapY->Mat();
 	cvInitUndistortMap( cvIntrinsics, cvCoeffs, &pX, &pY );
 	
 	// explicitly release the allocated memory
@@ -232,72 +566,511 @@ bool Undistortion::resetMapping( const int width, const int height, const intrin
 	cvReleaseMat( &cvIntrinsics );
 	
 	// alternative undistortion using special fisheye calibration 8 camera should be really fishy, seems buggy in 2.4.11 (CW@2015-03-24)
-	//cv::fisheye::initUndistortRectifyMap( cv::Mat( pCvIntrinsics ), cv::Mat( pCvCoeffs ), cv::Mat::eye( 3, 3, CV_32F ), cv::Mat::eye( 3, 3, CV_32F ), cv::Size( width, height ), CV_32FC1, cv::Mat( *m_pMapX ), cv::Mat( *m_pMapY ) );
+	//cv::fisheye::initUndistortRectifyMap( cv::Mat( pCvIntrinsics ), cv::Mat( pCvCoeffs ), cv::Mat::eye( 3, 3, CV_32F ), cv::Mat::eye( 3, 3, CV_32F ), cv::Size( width, height ), CV_32FC1, cv::Mat( *maps.pMapX ), cv::Mat( *maps.pMapY ) );
+	
+	if ( maps.format == EMapFixedPoint )
+	{
+		// replace the float maps by integer positions and interpolation table indices
+		boost::scoped_ptr< Image > pPositions( new Image( width, height, 2, CV_16S ) );
+		boost::scoped_ptr< Image > pTableIndices( new Image( width, height, 1, CV_16U ) );
+		cv::convertMaps( maps.pMapX->Mat(), maps.pMapY->Mat(), pPositions->Mat(), pTableIndices->Mat(), CV_16SC2 );
+		maps.pMapX.swap( pPositions );
+		maps.pMapY.swap( pTableIndices );
+	}
 	LOG4CPP_INFO( logger, "Initialization of distortion maps finished." );
 	
 	return true;
 }
 
-bool Undistortion::resetMapping( const Vision::Image& image )
+void Undistortion::buildMapping( boost::shared_ptr< MapSet > pMaps )
 {
-	// generate a local copy first
-	intrinsics_type camIntrinsics = m_intrinsics;
+	// the maps are not accessed by other threads before they are ready
+	bool bSuccess = false;
+	try
+	{
+		bSuccess = resetMapping( *pMaps, pMaps->intrinsics );
+	}
+	catch ( const std::exception& e )
+	{
+		LOG4CPP_ERROR( logger, "Could not initialize the undistortion maps: " << e.what() );
+	}
 	
-	// TODO: image size different than intrinsics ? -> scale
-	//correctForScale( image, camIntrinsics );
-	// always right-hand -> left-hand
-	correctForOpenCV( camIntrinsics );
-	// upside down? -> flip intrinsics and tangential param
-	correctForOrigin( image, camIntrinsics );
-	// set new lookup maps
-	if( !resetMapping( image.width(), image.height(), camIntrinsics ) )
-		return false;
+	if ( !bSuccess )
+	{
+		pMaps->pMapX.reset();
+		pMaps->pMapY.reset();
+	}
+	
+	{
+		boost::mutex::scoped_lock lock( m_mapMutex );
+		pMaps->bReady = true;
+	}
+	m_mapReady.notify_all();
+}
+
+void Undistortion::mapThread()
+{
+	while ( true )
+	{
+		boost::shared_ptr< MapSet > pMaps;
+		{
+			boost::mutex::scoped_lock lock( m_mapMutex );
+			while ( m_mapQueue.empty() && !m_bStopMapThread )
+				m_mapQueued.wait( lock );
+			if ( m_bStopMapThread )
+				return;
+			
+			pMaps = m_mapQueue.front();
+			m_mapQueue.pop_front();
+		}
+		
+		buildMapping( pMaps );
+	}
+}
+
+boost::shared_ptr< Undistortion::MapSet > Undistortion::mapping( int width, int height, int origin, bool bWait )
+{
+	boost::mutex::scoped_lock lock( m_mapMutex );
+	
+	// look for maps of this format, keeping the most recently used first
+	for ( std::size_t i = 0; i < m_mapSets.size(); i++ )
+	{
+		boost::shared_ptr< MapSet > pMaps( m_mapSets[ i ] );
+		if ( pMaps->width != width || pMaps->height != height || pMaps->origin != origin 
+			|| pMaps->intrinsicsHash != m_intrinsicsHash || pMaps->format != m_mapFormat )
+			continue;
+		
+		m_mapSets.erase( m_mapSets.begin() + i );
+		m_mapSets.insert( m_mapSets.begin(), pMaps );
+		
+		if ( !pMaps->bReady && !bWait )
+			return boost::shared_ptr< MapSet >();
+		
+		while ( !pMaps->bReady )
+			m_mapReady.wait( lock );
+		return pMaps;
+	}
+	
+	// new image format: derive the intrinsics for it
+	boost::shared_ptr< MapSet > pMaps( new MapSet );
+	pMaps->width = width;
+	pMaps->height = height;
+	pMaps->origin = origin;
+	pMaps->intrinsicsHash = m_intrinsicsHash;
+	pMaps->format = m_mapFormat;
+	pMaps->bReady = false;
+	pMaps->intrinsics = correctForImage( m_intrinsics, width, height, origin );
+	
+	m_mapSets.insert( m_mapSets.begin(), pMaps );
+	if ( m_mapSets.size() > g_nMaxMapSets )
+		m_mapSets.pop_back();
+	
+	if ( !bWait )
+	{
+		// a single thread builds the maps one after the other
+		m_mapQueue.push_back( pMaps );
+		if ( !m_pMapThread )
+			m_pMapThread.reset( new boost::thread( boost::bind( &Undistortion::mapThread, this ) ) );
+		lock.unlock();
+		m_mapQueued.notify_one();
+		return boost::shared_ptr< MapSet >();
+	}
+	
+	// build the maps without blocking the threads that use other maps
+	lock.unlock();
+	buildMapping( pMaps );
+	return pMaps;
+}
+
+boost::shared_ptr< Undistortion::PointModel > Undistortion::pointModel( int width, int height, int origin )
+{
+	std::size_t intrinsicsHash;
+	intrinsics_type intrinsics;
+	{
+		boost::mutex::scoped_lock lock( m_mapMutex );
+		for ( std::size_t i = 0; i < m_pointModels.size(); i++ )
+		{
+			boost::shared_ptr< PointModel > pModel( m_pointModels[ i ] );
+			if ( pModel->width != width || pModel->height != height || pModel->origin != origin 
+				|| pModel->intrinsicsHash != m_intrinsicsHash )
+				continue;
+			
+			m_pointModels.erase( m_pointModels.begin() + i );
+			m_pointModels.insert( m_pointModels.begin(), pModel );
+			return pModel;
+		}
+		intrinsicsHash = m_intrinsicsHash;
+		intrinsics = correctForImage( m_intrinsics, width, height, origin );
+	}
+	
+	LOG4CPP_DEBUG( logger, "initialize point undistortion for " << width << "x" << height );
+	
+	boost::shared_ptr< PointModel > pModel( new PointModel );
+	pModel->width = width;
+	pModel->height = height;
+	pModel->origin = origin;
+	pModel->intrinsicsHash = intrinsicsHash;
+	pModel->model = distortionModel( intrinsics );
+	const DistortionModel& m( pModel->model );
+	
+	// invert the distortion at the grid nodes, which cover the image, starting from the neighbouring node
+	pModel->gridWidth = std::max( 2, ( width - 1 ) / g_nPointGridStep + 2 );
+	pModel->gridHeight = std::max( 2, ( height - 1 ) / g_nPointGridStep + 2 );
+	pModel->gridX.resize( pModel->gridWidth * pModel->gridHeight );
+	pModel->gridY.resize( pModel->gridWidth * pModel->gridHeight );
+	
+	float x0 = -m.cx / m.fx;
+	float y0 = -m.cy / m.fy;
+	for ( int j = 0; j < pModel->gridHeight; j++ )
+	{
+		const float yd = ( j * g_nPointGridStep - m.cy ) / m.fy;
+		float x = x0;
+		float y = y0;
+		for ( int i = 0; i < pModel->gridWidth; i++ )
+		{
+			const float xd = ( i * g_nPointGridStep - m.cx ) / m.fx;
+			for ( int k = 0; k < g_nPointGridIterations; k++ )
+			{
+				float kr, dx, dy;
+				distortionTerms( m, x, y, kr, dx, dy );
+				x = ( xd - dx ) / kr;
+				y = ( yd - dy ) / kr;
+			}
+			
+			pModel->gridX[ j * pModel->gridWidth + i ] = x;
+			pModel->gridY[ j * pModel->gridWidth + i ] = y;
+			if ( i == 0 )
+			{
+				x0 = x;
+				y0 = y;
+			}
+		}
+	}
+	
+	boost::mutex::scoped_lock lock( m_mapMutex );
+	m_pointModels.insert( m_pointModels.begin(), pModel );
+	if ( m_pointModels.size() > g_nMaxMapSets )
+		m_pointModels.pop_back();
+	return pModel;
+}
+
+void Undistortion::undistortPoints( const float* pX, const float* pY, float* pDstX, float* pDstY, std::size_t nPoints, 
+	int width, int height, int origin )
+{
+	boost::shared_ptr< PointModel > pModel( pointModel( width, height, origin ) );
+	const DistortionModel& m( pModel->model );
+	const float fInvStep = 1.0f / g_nPointGridStep;
+	
+	std::size_t i = 0;
+#ifdef UTVISION_UNDISTORTION_SSE2
+	const int nBatch = 4;
+#else
+	const int nBatch = 1;
+#endif
+	for ( ; i < nPoints; i += nBatch )
+	{
+		const int n = static_cast< int >( std::min< std::size_t >( nBatch, nPoints - i ) );
+		
+		// initial estimate interpolated from the grid, linearly extrapolated outside the image
+		float x[ nBatch ], y[ nBatch ], xd[ nBatch ], yd[ nBatch ];
+		for ( int k = 0; k < nBatch; k++ )
+		{
+			const float u = pX[ i + std::min( k, n - 1 ) ];
+			const float v = pY[ i + std::min( k, n - 1 ) ];
+			xd[ k ] = ( u - m.cx ) / m.fx;
+			yd[ k ] = ( v - m.cy ) / m.fy;
+			
+			const float gx = u * fInvStep;
+			const float gy = v * fInvStep;
+			const int ix = std::max( 0, std::min( pModel->gridWidth - 2, static_cast< int >( floorf( gx ) ) ) );
+			const int iy = std::max( 0, std::min( pModel->gridHeight - 2, static_cast< int >( floorf( gy ) ) ) );
+			const float fx = gx - ix;
+			const float fy = gy - iy;
+			const std::size_t i00 = iy * pModel->gridWidth + ix;
+			const std::size_t i10 = i00 + pModel->gridWidth;
+			
+			const float* pGrid = &pModel->gridX[ 0 ];
+			float a = pGrid[ i00 ] + fx * ( pGrid[ i00 + 1 ] - pGrid[ i00 ] );
+			float b = pGrid[ i10 ] + fx * ( pGrid[ i10 + 1 ] - pGrid[ i10 ] );
+			x[ k ] = a + fy * ( b - a );
+			
+			pGrid = &pModel->gridY[ 0 ];
+			a = pGrid[ i00 ] + fx * ( pGrid[ i00 + 1 ] - pGrid[ i00 ] );
+			b = pGrid[ i10 ] + fx * ( pGrid[ i10 + 1 ] - pGrid[ i10 ] );
+			y[ k ] = a + fy * ( b - a );
+		}
+		
+		// refine with fixed-point iterations
+#ifdef UTVISION_UNDISTORTION_SSE2
+		__m128 vX = _mm_loadu_ps( x );
+		__m128 vY = _mm_loadu_ps( y );
+		const __m128 vXd = _mm_loadu_ps( xd );
+		const __m128 vYd = _mm_loadu_ps( yd );
+		for ( int k = 0; k < g_nPointIterations; k++ )
+		{
+			__m128 kr, dx, dy;
+			distortionTerms( m, vX, vY, kr, dx, dy );
+			vX = _mm_div_ps( _mm_sub_ps( vXd, dx ), kr );
+			vY = _mm_div_ps( _mm_sub_ps( vYd, dy ), kr );
+		}
+		_mm_storeu_ps( x, _mm_add_ps( _mm_mul_ps( vX, _mm_set1_ps( m.fx ) ), _mm_set1_ps( m.cx ) ) );
+		_mm_storeu_ps( y, _mm_add_ps( _mm_mul_ps( vY, _mm_set1_ps( m.fy ) ), _mm_set1_ps( m.cy ) ) );
+#else
+		for ( int k = 0; k < g_nPointIterations; k++ )
+		{
+			float kr, dx, dy;
+			distortionTerms( m, x[ 0 ], y[ 0 ], kr, dx, dy );
+			x[ 0 ] = ( xd[ 0 ] - dx ) / kr;
+			y[ 0 ] = ( yd[ 0 ] - dy ) / kr;
+		}
+		x[ 0 ] = x[ 0 ] * m.fx + m.cx;
+		y[ 0 ] = y[ 0 ] * m.fy + m.cy;
+#endif
+		
+		for ( int k = 0; k < n; k++ )
+		{
+			pDstX[ i + k ] = x[ k ];
+			pDstY[ i + k ] = y[ k ];
+		}
+	}
+}
+
+void Undistortion::distortPoints( const float* pX, const float* pY, float* pDstX, float* pDstY, std::size_t nPoints, 
+	int width, int height, int origin )
+{
+	boost::shared_ptr< PointModel > pModel( pointModel( width, height, origin ) );
+	const DistortionModel& m( pModel->model );
+	
+	std::size_t i = 0;
+#ifdef UTVISION_UNDISTORTION_SSE2
+	const __m128 fx = _mm_set1_ps( m.fx );
+	const __m128 fy = _mm_set1_ps( m.fy );
+	const __m128 cx = _mm_set1_ps( m.cx );
+	const __m128 cy = _mm_set1_ps( m.cy );
+	for ( ; i + 4 <= nPoints; i += 4 )
+	{
+		const __m128 x = _mm_div_ps( _mm_sub_ps( _mm_loadu_ps( pX + i ), cx ), fx );
+		const __m128 y = _mm_div_ps( _mm_sub_ps( _mm_loadu_ps( pY + i ), cy ), fy );
+		__m128 kr, dx, dy;
+		distortionTerms( m, x, y, kr, dx, dy );
+		_mm_storeu_ps( pDstX + i, _mm_add_ps( _mm_mul_ps( _mm_add_ps( _mm_mul_ps( x, kr ), dx ), fx ), cx ) );
+		_mm_storeu_ps( pDstY + i, _mm_add_ps( _mm_mul_ps( _mm_add_ps( _mm_mul_ps( y, kr ), dy ), fy ), cy ) );
+	}
+#endif
+
+	for ( ; i < nPoints; i++ )
+	{
+		const float x = ( pX[ i ] - m.cx ) / m.fx;
+		const float y = ( pY[ i ] - m.cy ) / m.fy;
+		float kr, dx, dy;
+		distortionTerms( m, x, y, kr, dx, dy );
+		pDstX[ i ] = ( x * kr + dx ) * m.fx + m.cx;
+		pDstY[ i ] = ( y * kr + dy ) * m.fy + m.cy;
+	}
+}
+
+void Undistortion::undistortPoints( const std::vector< Math::Vector< float, 2 > >& points, std::vector< Math::Vector< float, 2 > >& result, 
+	int width, int height, int origin )
+{
+	convertPoints( points, result, width, height, origin, false );
+}
+
+void Undistortion::distortPoints( const std::vector< Math::Vector< float, 2 > >& points, std::vector< Math::Vector< float, 2 > >& result, 
+	int width, int height, int origin )
+{
+	convertPoints( points, result, width, height, origin, true );
+}
+
+void Undistortion::convertPoints( const std::vector< Math::Vector< float, 2 > >& points, std::vector< Math::Vector< float, 2 > >& result, 
+	int width, int height, int origin, bool bDistort )
+{
+	result.resize( points.size() );
 	
-	return isValid( image );
+	// convert to coordinate arrays in chunks, without heap allocations
+	float x[ g_nPointChunk ];
+	float y[ g_nPointChunk ];
+	for ( std::size_t i = 0; i < points.size(); i += g_nPointChunk )
+	{
+		const std::size_t n = std::min( g_nPointChunk, points.size() - i );
+		for ( std::size_t k = 0; k < n; k++ )
+		{
+			x[ k ] = points[ i + k ]( 0 );
+			y[ k ] = points[ i + k ]( 1 );
+		}
+		
+		if ( bDistort )
+			distortPoints( x, y, x, y, n, width, height, origin );
+		else
+			undistortPoints( x, y, x, y, n, width, height, origin );
+			
+		for ( std::size_t k = 0; k < n; k++ )
+			result[ i + k ] = Math::Vector< float, 2 >( x[ k ], y[ k ] );
+	}
 }
 
 Vision::Image::Ptr Undistortion::undistort( Vision::Image::Ptr pImage )
 {
-	return undistort( *pImage );
+	boost::shared_ptr< MapSet > pMaps( mapping( pImage->width(), pImage->height(), pImage->origin(), !m_bBackgroundMapping ) );
+	
+	// maps are still being built -> pass the image through
+	if ( !pMaps )
+		return pImage;
+	if ( !pMaps->pMapX )
+		return pImage->Clone();
+	
+	// undistort
+	Vision::Image::Ptr pImgUndistorted( outputImage( *pImage ) );
+	remap( *pImage, *pImgUndistorted, *pMaps );
+
+	return pImgUndistorted;
 }
 
 Vision::Image::Ptr Undistortion::undistort( Image& image )
 {
-	// check if old values are still valid for the image size, only reset mapping if not
-	if( !isValid( image ) )
-		if( !resetMapping( image ) )
-			return image.Clone();
+	boost::shared_ptr< MapSet > pMaps( mapping( image.width(), image.height(), image.origin(), !m_bBackgroundMapping ) );
+	if ( !pMaps || !pMaps->pMapX )
+		return image.Clone();
 
 	// undistort
+	Vision::Image::Ptr pImgUndistorted( outputImage( image ) );
+	remap( image, *pImgUndistorted, *pMaps );
+
+	return pImgUndistorted;
+}
+
+bool Undistortion::undistort( Image& image, Image& result )
+{
+	if ( result.width() != image.width() || result.height() != image.height() || result.channels() != image.channels() 
+		|| result.depth() != image.depth() || result.origin() != image.origin() )
+		UBITRACK_THROW( "Undistortion: output image does not match the format of the input image" );
+	
+	boost::shared_ptr< MapSet > pMaps( mapping( image.width(), image.height(), image.origin(), !m_bBackgroundMapping ) );
+	if ( !pMaps || !pMaps->pMapX )
+	{
+		if ( image.isOnGPU() )
+			image.uMat().copyTo( result.uMat() );
+		else
+			image.Mat().copyTo( result.Mat() );
+		return false;
+	}
+
+	remap( image, result, *pMaps );
+	return true;
+}
+
+Vision::Image::Ptr Undistortion::undistortGrey( Image& image )
+{
+	return undistortGrey( image, 0 );
+}
+
+Vision::Image::Ptr Undistortion::undistortGrey( Image& image, Vision::Image::Ptr& pHalfResult )
+{
+	return undistortGrey( image, &pHalfResult );
+}
+
+Vision::Image::Ptr Undistortion::undistortGrey( Image& image, Vision::Image::Ptr* pHalfResult )
+{
+	const int nChannels = image.channels();
+	boost::shared_ptr< MapSet > pMaps;
+	if ( !image.isOnGPU() && image.depth() == CV_8U && ( nChannels == 1 || nChannels == 3 || nChannels == 4 ) )
+		pMaps = mapping( image.width(), image.height(), image.origin(), !m_bBackgroundMapping );
+	
+	if ( !pMaps || !pMaps->pMapX )
+	{
+		// separate steps for images the fused pass does not handle, and while the maps are not ready
+		Vision::Image::Ptr pGrey( nChannels == 1 ? image.Clone() : image.CvtColor( 
+			image.pixelFormat() == Image::RGB || image.pixelFormat() == Image::RGBA ? CV_RGB2GRAY : CV_BGR2GRAY, 1, image.depth() ) );
+		pGrey = undistort( pGrey );
+		if ( pHalfResult )
+			*pHalfResult = pGrey->Scale( image.width() / 2, image.height() / 2 );
+		return pGrey;
+	}
+	
+	Vision::Image::ImageFormatProperties fmt;
+	image.getFormatProperties( fmt );
+	fmt.imageFormat = Image::LUMINANCE;
+	fmt.depth = CV_8U;
+	fmt.channels = 1;
+	fmt.matType = CV_8UC1;
+	fmt.bitsPerPixel = 8;
+	
+	Vision::Image::Ptr pGrey( new Image( image.width(), image.height(), fmt ) );
+	cv::Mat* pHalf = 0;
+	if ( pHalfResult )
+	{
+		pHalfResult->reset( new Image( image.width() / 2, image.height() / 2, fmt ) );
+		pHalf = &( *pHalfResult )->Mat();
+	}
+	
+	// OpenCV's default channel order is BGR
+	const bool bRgb = image.pixelFormat() == Image::RGB || image.pixelFormat() == Image::RGBA;
+	const int iR = bRgb ? 0 : 2;
+	const int iB = bRgb ? 2 : 0;
+	const bool bFixedPoint = pMaps->format == EMapFixedPoint;
+	const cv::Mat& src( image.Mat() );
+	if ( nChannels == 1 )
+		remapGrey< 1 >( src, pMaps->pMapX->Mat(), pMaps->pMapY->Mat(), bFixedPoint, pGrey->Mat(), pHalf, iR, iB );
+	else if ( nChannels == 3 )
+		remapGrey< 3 >( src, pMaps->pMapX->Mat(), pMaps->pMapY->Mat(), bFixedPoint, pGrey->Mat(), pHalf, iR, iB );
+	else
+		remapGrey< 4 >( src, pMaps->pMapX->Mat(), pMaps->pMapY->Mat(), bFixedPoint, pGrey->Mat(), pHalf, iR, iB );
+	
+	return pGrey;
+}
+
+Vision::Image::Ptr Undistortion::outputImage( Image& image )
+{
 	Vision::Image::ImageFormatProperties fmt;
 	image.getFormatProperties(fmt);
-	Vision::Image::Ptr pImgUndistorted( new Image( image.width(), image.height(), fmt, image.getImageState() ) );
+	
+	if ( m_outputBuffers.empty() )
+		return Vision::Image::Ptr( new Image( image.width(), image.height(), fmt, image.getImageState() ) );
+	
+	// reuse the next image of the ring if nobody else holds it and the format still matches
+	Vision::Image::Ptr& pBuffer( m_outputBuffers[ m_nextOutputBuffer ] );
+	m_nextOutputBuffer = ( m_nextOutputBuffer + 1 ) % m_outputBuffers.size();
+	
+	if ( !pBuffer || !pBuffer.unique() || pBuffer->width() != image.width() || pBuffer->height() != image.height() 
+		|| pBuffer->channels() != image.channels() || pBuffer->depth() != image.depth() || pBuffer->origin() != image.origin()
+		|| pBuffer->isOnGPU() != image.isOnGPU() )
+	{
+		LOG4CPP_DEBUG( logger, "allocating new output image for the undistortion ring" );
+		pBuffer.reset( new Image( image.width(), image.height(), fmt, image.getImageState() ) );
+	}
+	else if ( pBuffer->pixelFormat() != image.pixelFormat() )
+	{
+		// the same memory layout with another channel order, e.g. RGB instead of BGR
+		pBuffer->setFormatProperties( fmt );
+	}
+	
+	return pBuffer;
+}
 
+void Undistortion::remap( Image& image, Image& result, MapSet& maps )
+{
 	if (image.isOnGPU())	{
 		cv::UMat& distortedUMat = image.uMat();
-		cv::UMat& undistortedUMat = pImgUndistorted->uMat();
-		cv::remap( distortedUMat, undistortedUMat, m_pMapX->uMat(), m_pMapY->uMat(), cv::INTER_LINEAR );
+		cv::UMat& undistortedUMat = result.uMat();
+		cv::remap( distortedUMat, undistortedUMat, maps.pMapX->uMat(), maps.pMapY->uMat(), cv::INTER_LINEAR );
 	} else {
 		cv::Mat& distortedMat = image.Mat();
-		cv::Mat& undistortedMat = pImgUndistorted->Mat();
-		cv::remap( distortedMat, undistortedMat, m_pMapX->Mat(), m_pMapY->Mat(), cv::INTER_LINEAR );
+		cv::Mat& undistortedMat = result.Mat();
+		cv::remap( distortedMat, undistortedMat, maps.pMapX->Mat(), maps.pMapY->Mat(), cv::INTER_LINEAR );
 	}
-
-	return pImgUndistorted;
 }
 
 bool Undistortion::isValid( const Vision::Image& image ) const
 {
-	if ( !m_pMapX || !m_pMapY )
-		return false;
-	
-	if( m_pMapX->width() != image.width() || m_pMapX->height() != image.height() )
-		return false;
-	
-	if( m_pMapY->width() != image.width() || m_pMapY->height() != image.height() )
-		return false;
+	boost::mutex::scoped_lock lock( m_mapMutex );
+	for ( std::size_t i = 0; i < m_mapSets.size(); i++ )
+	{
+		const MapSet& maps( *m_mapSets[ i ] );
+		if ( maps.width == image.width() && maps.height == image.height() && maps.origin == image.origin()
+			&& maps.intrinsicsHash == m_intrinsicsHash && maps.format == m_mapFormat )
+			return maps.bReady && maps.pMapX;
+	}
 	
-	return true;
+	return false;
 }
 
 } } // namespace Ubitrack::Vision
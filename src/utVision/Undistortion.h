@@ -35,10 +35,15 @@
 
 // std
 #include <string>
+#include <vector>
+#include <deque>
 
 // Boost
 #include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
 
 // Ubitrack
 #include "../utVision.h"	// UTVISION_EXPORT
@@ -55,6 +60,26 @@ namespace Ubitrack { namespace Vision {
 
 class UTVISION_EXPORT Undistortion
 {
+public:
+	/**
+	 * Storage formats of the undistortion maps.
+	 *
+	 * \c EMapFloat stores the source position of every pixel in two \c CV_32F maps, i.e. 8 bytes per pixel.
+	 *
+	 * \c EMapFixedPoint stores the integer source position in a \c CV_16SC2 map and the index of the
+	 * sub-pixel offset in a \c CV_16UC1 map, as created by \c cv::convertMaps, i.e. 6 bytes per pixel.
+	 * \c cv::remap then interpolates with precomputed fixed-point weights. The sub-pixel offsets are 
+	 * quantized to 1/32 pixel (\c cv::INTER_TAB_SIZE), so source positions deviate by at most 1/64 pixel
+	 * per axis from the float maps, and the interpolated values of 8 bit images differ by at most one grey
+	 * level, mostly only on strong edges. Positions must lie within -32768..32767 pixels.
+	 */
+	enum MapFormat
+	{
+		EMapFloat,
+		EMapFixedPoint
+	};
+
+private:
 	/// type used throughout the class used for representing distortion lens distortion parameters
 	typedef Math::CameraIntrinsics< double > intrinsics_type;
 	
@@ -67,14 +92,58 @@ class UTVISION_EXPORT Undistortion
 	/// intrinsic camera matrix
 	Math::Matrix< double, 3, 3 > m_intrinsicMatrix;
 	
-	// undistortion maps
-	boost::scoped_ptr< Image > m_pMapX;
-	boost::scoped_ptr< Image > m_pMapY;
+	/// undistortion maps for one image size and origin
+	struct MapSet;
+	
+	/// cached undistortion maps, the most recently used first
+	std::vector< boost::shared_ptr< MapSet > > m_mapSets;
+	
+	/// protects m_mapSets and the state of the map sets, which may be built in the background
+	mutable boost::mutex m_mapMutex;
+	
+	/// signalled when a map set is ready
+	boost::condition_variable m_mapReady;
+	
+	/// thread building the queued maps in the background, started on demand
+	boost::scoped_ptr< boost::thread > m_pMapThread;
+	
+	/// map sets waiting for the background thread, protected by m_mapMutex
+	std::deque< boost::shared_ptr< MapSet > > m_mapQueue;
+	
+	/// signalled when a map set is queued or the background thread has to stop
+	boost::condition_variable m_mapQueued;
+	
+	/// tells the background thread to stop, protected by m_mapMutex
+	bool m_bStopMapThread;
+	
+	/// distortion model and inverse distortion grid for the points of one image size and origin
+	struct PointModel;
+	
+	/// cached point models, the most recently used first, protected by m_mapMutex
+	std::vector< boost::shared_ptr< PointModel > > m_pointModels;
+	
+	/// hash of the intrinsics, part of the key of the map sets
+	std::size_t m_intrinsicsHash;
+
+	/// storage format of the maps
+	MapFormat m_mapFormat;
+	
+	/// build maps in the background?
+	bool m_bBackgroundMapping;
+	
+	/// recycled output images, see setOutputBuffers
+	std::vector< boost::shared_ptr< Image > > m_outputBuffers;
+	
+	/// next output image to recycle
+	std::size_t m_nextOutputBuffer;
 	
 public:
 	/** standard constructor */
 	Undistortion();
 	
+	/** destructor, waits for the map that is being built in the background */
+	~Undistortion();
+	
 	/**
 	 * Initialize from new camera intrinsics 
 	 */
@@ -104,6 +173,61 @@ public:
 
 	/** initialize from matrix+vector */
 	void reset( const Math::Matrix< double, 3, 3 >& intrinsicMatrix, const Math::Vector< double, 8 >& distortion );
+
+	/** sets the storage format of the undistortion maps, which are rebuilt for the next image */
+	void setMapFormat( MapFormat format );
+
+	/** returns the storage format of the undistortion maps */
+	MapFormat getMapFormat() const
+	{
+		return m_mapFormat;
+	}
+	
+	/**
+	 * Enables building the maps for new image sizes in a background thread. Until the maps are 
+	 * ready, images of that size are returned without undistortion, so switching between streams 
+	 * never stalls on the map generation. Use prepare() to build the maps before the first image.
+	 */
+	void setBackgroundMapping( bool bEnable )
+	{
+		m_bBackgroundMapping = bEnable;
+	}
+	
+	/**
+	 * Starts building the maps for images of the given size and origin in the background, if they
+	 * do not exist yet. Maps for up to four image formats are kept at a time. If the size differs
+	 * from the calibrated one, the intrinsics are scaled accordingly.
+	 */
+	void prepare( int width, int height, int origin );
+	
+	/**
+	 * Undistorts points of an image with the given size and origin, i.e. maps their positions in the raw
+	 * image to the positions that undistort() moves them to. Thus, features can be detected in the raw 
+	 * image and only their coordinates corrected, instead of remapping the whole image.
+	 *
+	 * The inverse of the distortion is interpolated from a grid computed once per image format and refined
+	 * by fixed-point iterations of the distortion model, four points at a time where SSE2 is available. 
+	 * Within the image, the results deviate by less than 1/100 pixel from the exact inverse, also for strong
+	 * barrel distortion.
+	 * The input and output arrays may be the same.
+	 */
+	void undistortPoints( const float* pX, const float* pY, float* pDstX, float* pDstY, std::size_t nPoints, 
+		int width, int height, int origin );
+	
+	/** 
+	 * Distorts points of an image with the given size and origin, i.e. maps positions in the undistorted 
+	 * image to the raw image, like the undistortion maps. The input and output arrays may be the same.
+	 */
+	void distortPoints( const float* pX, const float* pY, float* pDstX, float* pDstY, std::size_t nPoints, 
+		int width, int height, int origin );
+	
+	/** undistortPoints for a vector of points */
+	void undistortPoints( const std::vector< Math::Vector< float, 2 > >& points, std::vector< Math::Vector< float, 2 > >& result, 
+		int width, int height, int origin );
+	
+	/** distortPoints for a vector of points */
+	void distortPoints( const std::vector< Math::Vector< float, 2 > >& points, std::vector< Math::Vector< float, 2 > >& result, 
+		int width, int height, int origin );
 	
 	/** 
 	 * Undistorts an image.
@@ -116,6 +240,40 @@ public:
 	 */
 	boost::shared_ptr< Image > undistort( boost::shared_ptr< Image > pImage );
 	
+	/**
+	 * Undistorts an image into an image provided by the caller, which must have the same size, 
+	 * channels, depth and origin as the source image. No memory is allocated once the maps exist.
+	 * @return false if the mapping could not be initialized and the image was copied unchanged
+	 */
+	bool undistort( Image& image, Image& result );
+	
+	/**
+	 * Undistorts an 8 bit colour or grey image and converts it to grey in a single pass, instead of
+	 * \c Image::CvtColor followed by undistort(). Each output pixel interpolates the luminance of its 
+	 * four source pixels, computed with the weights of \c cv::cvtColor, so the result differs from the
+	 * separate steps by at most one grey level. The channel order is RGB for \c Image::RGB and 
+	 * \c Image::RGBA images, BGR otherwise. Images with other depths or channel counts, images on the GPU
+	 * and images whose maps are not ready in background mode are processed in separate steps.
+	 */
+	boost::shared_ptr< Image > undistortGrey( Image& image );
+	
+	/**
+	 * undistortGrey, additionally computing an image of half the size from the rows of the result
+	 * while they are in the cache. Each of its pixels is the mean of 2x2 pixels, as computed by 
+	 * \c Image::Scale for half the size.
+	 */
+	boost::shared_ptr< Image > undistortGrey( Image& image, boost::shared_ptr< Image >& pHalfResult );
+	
+	/**
+	 * Enables recycling of the images returned by undistort for streams of images with equal formats.
+	 * The returned images are taken from a ring of \c nBuffers images. An image is only reused when
+	 * the caller has released all references to it, otherwise a new one is allocated in its place.
+	 * Thus, the ring should be larger than the number of images the consumers keep at a time. Matrix
+	 * headers that share the pixel data of a returned image must not be kept after releasing it.
+	 * @param nBuffers size of the ring, 0 to allocate a new image for every call
+	 */
+	void setOutputBuffers( std::size_t nBuffers );
+	
 	/** returns the intrinsic matrix */
 	const Math::Matrix< double, 3, 3 >& getMatrix() const
 	{
@@ -136,11 +294,42 @@ public:
 
 protected:
 
-	/// resets the mapping to the provided image parameters
-	bool resetMapping( const int width, const int height, const intrinsics_type& intrinsics );
+	/// computes the maps of a map set for the given OpenCV intrinsics
+	static bool resetMapping( MapSet& maps, const intrinsics_type& intrinsics );
 
-	/// overloaded function to reset undistortion maps using data from connected components
-	bool resetMapping( const Vision::Image& image );	
+	/// builds the maps of a map set and marks it as ready
+	void buildMapping( boost::shared_ptr< MapSet > pMaps );
+	
+	/// main loop of the background thread, builds the queued map sets
+	void mapThread();
+	
+	/// sets the intrinsics used for new maps and forgets the existing ones
+	void setIntrinsics( const intrinsics_type& intrinsics );
+	
+	/**
+	 * returns the maps for the given image format, creating them if necessary
+	 * @param bWait if false, returns 0 if the maps are not ready yet and builds them in the background
+	 */
+	boost::shared_ptr< MapSet > mapping( int width, int height, int origin, bool bWait );
+	
+	/// returns the point model for the given image format, creating it if necessary
+	boost::shared_ptr< PointModel > pointModel( int width, int height, int origin );
+	
+	/// converts points in chunks with undistortPoints or distortPoints
+	void convertPoints( const std::vector< Math::Vector< float, 2 > >& points, std::vector< Math::Vector< float, 2 > >& result, 
+		int width, int height, int origin, bool bDistort );
+	
+	/// forgets all maps, e.g. after the intrinsics changed
+	void clearMappings();
+	
+	/// implementation of undistortGrey
+	boost::shared_ptr< Image > undistortGrey( Image& image, boost::shared_ptr< Image >* pHalfResult );
+	
+	/// returns an image to undistort the given one into, recycled if possible
+	boost::shared_ptr< Image > outputImage( Image& image );
+	
+	/// applies the maps
+	static void remap( Image& image, Image& result, MapSet& maps );
 };
 
 } } // namespace Ubitrack::Vision
@@ -0,0 +1,73 @@
+// Boost
+#include <boost/test/unit_test.hpp>
+
+// std
+#include <vector>
+
+// Ubitrack
+#include <utMath/Vector.h>
+#include <utMath/Matrix.h>
+#include <utMath/Random/Scalar.h>
+#include <utMath/CameraIntrinsics.h>
+#include <utVision/Undistortion.h>
+
+namespace {
+
+using namespace Ubitrack;
+
+	/// random intrinsics with the principal point near the image center
+	Math::CameraIntrinsics< double > randomIntrinsics( int width, int height )
+	{
+		Math::Matrix< double, 3, 3 > K( Math::Matrix< double, 3, 3 >::identity() );
+		K( 0, 0 ) = Random::distribute_uniform< double >( 500, 1000 );
+		K( 1, 1 ) = K( 0, 0 ) * Random::distribute_uniform< double >( 0.98, 1.02 );
+		K( 0, 2 ) = -( width - 1 ) * 0.5 + Random::distribute_uniform< double >( -10, 10 );
+		K( 1, 2 ) = -( height - 1 ) * 0.5 + Random::distribute_uniform< double >( -10, 10 );
+		K( 2, 2 ) = -1;
+		
+		Math::Vector< double, 6 > radVec;
+		radVec( 0 ) = Random::distribute_uniform< double >( -0.3, 0.2 );
+		radVec( 1 ) = Random::distribute_uniform< double >( -0.1, 0.1 );
+		for ( std::size_t i = 2; i != 6; ++i )
+			radVec( i ) = Random::distribute_uniform< double >( -0.01, 0.01 );
+		
+		Math::Vector< double, 2 > tanVec;
+		tanVec( 0 ) = Random::distribute_uniform< double >( -0.002, 0.002 );
+		tanVec( 1 ) = Random::distribute_uniform< double >( -0.002, 0.002 );
+		
+		return Math::CameraIntrinsics< double >( K, radVec, tanVec );
+	}
+
+}	// anonymous namespace
+
+void TestUndistortionPoints()
+{
+	const int width = 640;
+	const int height = 480;
+	
+	for ( int iRun = 0; iRun < 20; iRun++ )
+	{
+		Vision::Undistortion undistorter( randomIntrinsics( width, height ) );
+		
+		std::vector< Math::Vector< float, 2 > > points;
+		for ( int i = 0; i < 101; i++ )
+			points.push_back( Math::Vector< float, 2 >( 
+				Random::distribute_uniform< float >( 0, width - 1 ), Random::distribute_uniform< float >( 0, height - 1 ) ) );
+		
+		for ( int origin = 0; origin < 2; origin++ )
+		{
+			// distorting the undistorted points must lead back to the raw positions
+			std::vector< Math::Vector< float, 2 > > undistorted;
+			std::vector< Math::Vector< float, 2 > > distorted;
+			undistorter.undistortPoints( points, undistorted, width, height, origin );
+			undistorter.distortPoints( undistorted, distorted, width, height, origin );
+			
+			BOOST_REQUIRE( distorted.size() == points.size() );
+			for ( std::size_t i = 0; i < points.size(); i++ )
+			{
+				BOOST_CHECK_SMALL( distorted[ i ]( 0 ) - points[ i ]( 0 ), 0.01f );
+				BOOST_CHECK_SMALL( distorted[ i ]( 1 ) - points[ i ]( 1 ), 0.01f );
+			}
+		}
+	}
+}
@@ -0,0 +1,78 @@
+// std
+#include <math.h>
+#include <vector>
+
+// Boost
+#include <boost/test/unit_test.hpp>
+
+// Ubitrack
+#include <utMath/Vector.h>
+#include <utMath/Matrix.h>
+#include <utMath/Pose.h>
+#include <utAlgorithm/PoseEstimation2D3D/PlanarPoseEstimation.h>
+#include <utVision/MarkerDetection.h>
+
+#ifdef HAVE_LAPACK
+
+namespace {
+
+using namespace Ubitrack;
+using namespace Ubitrack::Vision::Markers;
+
+	/// checks that the deferred covariance of a pose equals the eagerly computed one
+	void checkDeferredCovariance( const Math::Pose& pose, float fSize )
+	{
+		Math::Matrix< float, 3, 3 > K( Math::Matrix< float, 3, 3 >::zeros() );
+		K( 0, 0 ) = K( 1, 1 ) = 500.0f;
+		K( 0, 2 ) = -319.5f;
+		K( 1, 2 ) = -239.5f;
+		K( 2, 2 ) = -1.0f;
+
+		// as detectMarkers computes it
+		const float fF = 0.5f * fSize;
+		std::vector< Math::Vector< float, 3 > > p3D;
+		p3D.push_back( Math::Vector< float, 3 >( -fF, fF, 0.0f ) );
+		p3D.push_back( Math::Vector< float, 3 >( -fF, -fF, 0.0f ) );
+		p3D.push_back( Math::Vector< float, 3 >( fF, -fF, 0.0f ) );
+		p3D.push_back( Math::Vector< float, 3 >( fF, fF, 0.0f ) );
+		const Math::Matrix< double, 6, 6 > eager( Algorithm::PoseEstimation2D3D::singleCameraPoseError( pose, p3D, K, 0.04f * 0.04f ) );
+
+		MarkerInfo info( fSize );
+		info.covariance = Math::Matrix< double, 6, 6 >::zeros();
+		info.deferCovariance( pose, K );
+
+		// copies share the computation
+		const MarkerInfo copy( info );
+		const Math::Matrix< double, 6, 6 >& deferred( copy.getCovariance() );
+		BOOST_CHECK_EQUAL( &deferred, &info.getCovariance() );
+
+		for ( std::size_t i = 0; i < 6; i++ )
+			for ( std::size_t j = 0; j < 6; j++ )
+				BOOST_CHECK_CLOSE_FRACTION( deferred( i, j ) + 1e-12, eager( i, j ) + 1e-12, 1e-9 );
+
+		// the field is not touched by the deferred computation
+		BOOST_CHECK_EQUAL( info.covariance( 0, 0 ), 0.0 );
+	}
+
+}	// anonymous namespace
+
+void TestMarkerCovariance()
+{
+	checkDeferredCovariance( Math::Pose( Math::Quaternion(), Math::Vector< double, 3 >( 0.0, 0.0, -0.5 ) ), 0.06f );
+	const double w = sqrt( 1.0 - 0.2 * 0.2 - 0.1 * 0.1 - 0.05 * 0.05 );
+	checkDeferredCovariance( Math::Pose( Math::Quaternion( 0.2, -0.1, 0.05, w ), Math::Vector< double, 3 >( 0.05, -0.03, -0.8 ) ), 0.1f );
+
+	// without deferral, the field is returned
+	MarkerInfo info( 0.06f );
+	info.covariance = Math::Matrix< double, 6, 6 >::identity();
+	BOOST_CHECK_EQUAL( &info.getCovariance(), &info.covariance );
+}
+
+#else
+
+void TestMarkerCovariance()
+{
+	BOOST_CHECK( true );
+}
+
+#endif
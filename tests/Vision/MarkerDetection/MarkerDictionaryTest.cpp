@@ -0,0 +1,104 @@
+// Boost
+#include <boost/test/unit_test.hpp>
+
+// Ubitrack
+#include <utVision/MarkerDetection.h>
+#include <utVision/MarkerDictionary.h>
+
+namespace {
+
+using namespace Ubitrack::Vision::Markers;
+
+	/// flips some pseudo-random bits of a code within the mask
+	unsigned long long int flipBits( unsigned long long int nCode, unsigned long long int nMask, unsigned int nBits, unsigned int nSeed )
+	{
+		std::vector< int > bits;
+		for ( int i = 0; i < 64; i++ )
+			if ( nMask & ( 1ULL << i ) )
+				bits.push_back( i );
+
+		for ( unsigned int i = 0; i < nBits; i++ )
+		{
+			nSeed = nSeed * 1103515245 + 12345;
+			std::size_t j = i + ( nSeed >> 8 ) % ( bits.size() - i );
+			std::swap( bits[ i ], bits[ j ] );
+			nCode ^= 1ULL << bits[ i ];
+		}
+		return nCode;
+	}
+
+	/// rotates a code 90 degrees counter-clockwise
+	unsigned long long int rotate( unsigned long long int nCode, int codeLen )
+	{
+		unsigned long long int nRotCode = 0;
+		for ( int j = 0; j < codeLen * codeLen; j++ )
+			if ( nCode & ( 1ULL << j ) )
+				nRotCode |= 1ULL << ( codeLen * ( j % codeLen ) + codeLen - 1 - ( j / codeLen ) );
+		return nRotCode;
+	}
+
+	/// checks that all rotations of all codes are recovered with up to nBits wrong bits
+	void checkCorrection( const MarkerDictionary& dict, unsigned long long int nMask, unsigned int nBits )
+	{
+		for ( std::size_t i = 0; i < dict.size(); i++ )
+		{
+			const unsigned long long int nCode = dict.codes()[ i ];
+			unsigned long long int nRotCode = nCode;
+			for ( int j = 0; j < 4; j++, nRotCode = rotate( nRotCode, dict.codeSize() ) )
+			{
+				int nExpectedRotations;
+				normalizeCode( nRotCode, dict.codeSize(), nExpectedRotations );
+
+				const unsigned long long int nRaw = flipBits( nRotCode, nMask, nBits, static_cast< unsigned int >( i * 4 + j ) );
+				int nRotations;
+				unsigned int nCorrected;
+				BOOST_CHECK_EQUAL( dict.lookup( nRaw, nRotations, nCorrected ), nCode );
+				BOOST_CHECK_EQUAL( nRotations, nExpectedRotations );
+				BOOST_CHECK_EQUAL( nCorrected, nBits );
+			}
+		}
+	}
+
+}	// anonymous namespace
+
+void TestMarkerDictionary()
+{
+	// small dictionary, searched linearly
+	MarkerDictionary small( 4, 0xFFFF );
+	BOOST_CHECK( small.generate( 8, 3 ) > 1 );
+	BOOST_CHECK( small.minimalDistance() >= 3 );
+	BOOST_CHECK_EQUAL( small.correctableBits(), ( small.minimalDistance() - 1 ) / 2 );
+	checkCorrection( small, 0xFFFF, 0 );
+	checkCorrection( small, 0xFFFF, 1 );
+
+	// codes that are symmetric under rotations by 180 or 90 degrees are rejected and keep the correction
+	const std::size_t nSmallCodes = small.size();
+	const unsigned int nSmallCorrectable = small.correctableBits();
+	BOOST_CHECK( !small.add( 0x8001 ) );
+	BOOST_CHECK( !small.add( 0x9009 ) );
+	BOOST_CHECK( !small.add( 0 ) );
+	BOOST_CHECK_EQUAL( small.size(), nSmallCodes );
+	BOOST_CHECK_EQUAL( small.correctableBits(), nSmallCorrectable );
+	BOOST_CHECK( small.add( small.codes()[ 0 ] ) );
+	BOOST_CHECK_EQUAL( small.size(), nSmallCodes );
+
+	// large dictionary, searched with multi-index hashing
+	MarkerDictionary large( 8, 0 );
+	BOOST_CHECK_EQUAL( large.generate( 300, 9 ), 300u );
+	BOOST_CHECK( large.correctableBits() >= 4 );
+	checkCorrection( large, ~0ULL, 4 );
+
+	// codes far from all markers are rejected
+	int nRotations;
+	unsigned int nCorrected;
+	unsigned int nRejected = 0;
+	for ( unsigned int i = 0; i < 100; i++ )
+		if ( !large.lookup( flipBits( large.codes()[ i ], ~0ULL, 20, i ), nRotations, nCorrected ) )
+			nRejected++;
+	BOOST_CHECK( nRejected > 90 );
+
+	// limiting the correction
+	large.setMaxCorrection( 1 );
+	BOOST_CHECK_EQUAL( large.correctableBits(), 1u );
+	BOOST_CHECK_EQUAL( large.lookup( flipBits( large.codes()[ 0 ], ~0ULL, 2, 0 ), nRotations, nCorrected ), 0u );
+}
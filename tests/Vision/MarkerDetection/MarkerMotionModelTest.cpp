@@ -0,0 +1,106 @@
+// std
+#include <math.h>
+#include <algorithm>
+
+// Boost
+#include <boost/test/unit_test.hpp>
+
+// Ubitrack
+#include <utMath/Vector.h>
+#include <utMath/Pose.h>
+#include <utMath/Quaternion.h>
+#include <utVision/MarkerMotionModel.h>
+
+namespace ublas = boost::numeric::ublas;
+
+namespace {
+
+using namespace Ubitrack;
+using namespace Ubitrack::Vision::Markers;
+
+	/// unit quaternion of a rotation vector
+	Math::Quaternion fromRotationVector( const Math::Vector< double, 3 >& v )
+	{
+		const double fAngle = ublas::norm_2( v );
+		const double fScale = fAngle < 1e-12 ? 0.5 : sin( 0.5 * fAngle ) / fAngle;
+		return Math::Quaternion( fScale * v( 0 ), fScale * v( 1 ), fScale * v( 2 ), cos( 0.5 * fAngle ) );
+	}
+
+	/// angle in radians between two rotations
+	double rotationAngle( const Math::Quaternion& a, const Math::Quaternion& b )
+	{
+		const Math::Quaternion d( a * ~b );
+		return 2.0 * acos( std::min( 1.0, fabs( d.R_component_1() ) ) );
+	}
+
+	/// pose of a marker moving with constant linear and angular velocity in frame k
+	Math::Pose constantVelocityPose( int k )
+	{
+		const Math::Vector< double, 3 > t0( 0.1, 0.05, -0.6 );
+		const Math::Vector< double, 3 > velocity( 0.002, -0.001, 0.003 );
+		const Math::Vector< double, 3 > angularVelocity( 0.01, 0.02, -0.015 );
+		const Math::Quaternion q0( fromRotationVector( Math::Vector< double, 3 >( 0.3, -0.2, 0.1 ) ) );
+		return Math::Pose( fromRotationVector( double( k ) * angularVelocity ) * q0, t0 + double( k ) * velocity );
+	}
+
+}	// anonymous namespace
+
+void TestMarkerMotionModel()
+{
+	MarkerMotionModel model;
+	BOOST_CHECK( !model.isInitialized() );
+
+	double fPrevTranslation = 0.0;
+	double fPrevRotation = 0.0;
+	const int nFrames = 30;
+	for ( int k = 0; k < nFrames; k++ )
+	{
+		model.update( constantVelocityPose( k ) );
+		BOOST_CHECK( model.isInitialized() );
+		BOOST_CHECK_EQUAL( model.hasVelocity(), k > 0 );
+
+		// the uncertainty of the prediction does not grow with more measurements
+		double fTranslation, fRotation;
+		model.predictedDeviation( fTranslation, fRotation );
+		BOOST_CHECK( fTranslation > 0.0 && fRotation > 0.0 );
+		if ( k > 0 )
+		{
+			BOOST_CHECK( fTranslation <= fPrevTranslation * ( 1.0 + 1e-9 ) );
+			BOOST_CHECK( fRotation <= fPrevRotation * ( 1.0 + 1e-9 ) );
+		}
+
+		// the first velocity measurement already reduces it considerably
+		if ( k == 1 )
+		{
+			BOOST_CHECK( fTranslation < 0.5 * fPrevTranslation );
+			BOOST_CHECK( fRotation < 0.5 * fPrevRotation );
+		}
+		fPrevTranslation = fTranslation;
+		fPrevRotation = fRotation;
+
+		// once the velocity is known, the prediction converges to the next pose
+		if ( k >= 5 )
+		{
+			const Math::Pose predicted( model.predict() );
+			const Math::Pose next( constantVelocityPose( k + 1 ) );
+			BOOST_CHECK_SMALL( ublas::norm_2( predicted.translation() - next.translation() ), 1e-5 );
+			BOOST_CHECK_SMALL( rotationAngle( predicted.rotation(), next.rotation() ), 1e-4 );
+		}
+	}
+
+	const Math::Pose predicted( model.predict() );
+	const Math::Pose next( constantVelocityPose( nFrames ) );
+	BOOST_CHECK_SMALL( ublas::norm_2( predicted.translation() - next.translation() ), 1e-8 );
+	BOOST_CHECK_SMALL( rotationAngle( predicted.rotation(), next.rotation() ), 1e-6 );
+
+	// the covariance matches the deviations
+	double fTranslation, fRotation;
+	model.predictedDeviation( fTranslation, fRotation );
+	const Math::Matrix< double, 6, 6 > cov( model.predictedCovariance() );
+	BOOST_CHECK_CLOSE( cov( 0, 0 ), fTranslation * fTranslation, 1e-9 );
+	BOOST_CHECK_CLOSE( cov( 5, 5 ), fRotation * fRotation, 1e-9 );
+
+	// reset forgets the state
+	model.reset();
+	BOOST_CHECK( !model.isInitialized() );
+}
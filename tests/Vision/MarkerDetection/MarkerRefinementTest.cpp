@@ -0,0 +1,96 @@
+// Boost
+#include <boost/test/unit_test.hpp>
+
+// Ubitrack
+#include <utMath/Vector.h>
+#include <utMath/Matrix.h>
+#include <utMath/Pose.h>
+#include <utVision/Image.h>
+#include <utVision/MarkerDetection.h>
+
+#ifdef HAVE_LAPACK
+
+namespace ublas = boost::numeric::ublas;
+
+namespace {
+
+using namespace Ubitrack;
+using namespace Ubitrack::Vision;
+using namespace Ubitrack::Vision::Markers;
+
+	/// refines a map with the catch-all entry, a detected and an undetected marker on an empty image
+	void checkRefineOnly( bool bParallel )
+	{
+		const int width = 640;
+		const int height = 480;
+		Image img( width, height, 1, CV_8U );
+		img.Mat().setTo( 128 );
+
+		Math::Matrix< float, 3, 3 > K( Math::Matrix< float, 3, 3 >::zeros() );
+		K( 0, 0 ) = K( 1, 1 ) = 500.0f;
+		K( 0, 2 ) = -0.5f * ( width - 1 );
+		K( 1, 2 ) = -0.5f * ( height - 1 );
+		K( 2, 2 ) = -1.0f;
+
+		const Math::Pose pose( Math::Quaternion(), Math::Vector< double, 3 >( 0.0, 0.0, -0.5 ) );
+		CornerList corners;
+		corners.push_back( Math::Vector< float, 2 >( 300.0f, 220.0f ) );
+		corners.push_back( Math::Vector< float, 2 >( 340.0f, 220.0f ) );
+		corners.push_back( Math::Vector< float, 2 >( 340.0f, 260.0f ) );
+		corners.push_back( Math::Vector< float, 2 >( 300.0f, 260.0f ) );
+
+		MarkerInfoMap infos;
+		MarkerInfo catchAll( 0.06f );
+		catchAll.pose = pose;
+		catchAll.prevPose = pose;
+		catchAll.corners = corners;
+		catchAll.fResidual = 1.5f;
+		infos[ 0 ] = catchAll;
+
+		MarkerInfo detected( 0.06f );
+		detected.pose = pose;
+		detected.prevPose = pose;
+		detected.corners = corners;
+		infos[ 0x272 ] = detected;
+
+		infos[ 0x123 ] = MarkerInfo( 0.06f );
+
+		DetectionOptions options;
+		options.bParallelRefinement = bParallel;
+		detectMarkers( img, infos, K, 0, true, 4, 6, 0xFFFF, true, true, 120, options );
+
+		// the template of new markers keeps its state
+		const MarkerInfo& info0( infos[ 0 ] );
+		BOOST_CHECK_EQUAL( info0.fResidual, 1.5f );
+		BOOST_CHECK_EQUAL( info0.found, MarkerInfo::ENotFound );
+		BOOST_CHECK_SMALL( ublas::norm_2( info0.pose.translation() - pose.translation() ), 1e-12 );
+		BOOST_CHECK_SMALL( ublas::norm_2( info0.prevPose.translation() - pose.translation() ), 1e-12 );
+		BOOST_REQUIRE_EQUAL( info0.corners.size(), 4u );
+		for ( std::size_t i = 0; i < 4; i++ )
+			BOOST_CHECK_SMALL( ublas::norm_2( info0.corners[ i ] - corners[ i ] ), 1e-6f );
+
+		// markers that were never detected are not refined
+		BOOST_CHECK( infos[ 0x123 ].corners.empty() );
+		BOOST_CHECK_EQUAL( infos[ 0x123 ].found, MarkerInfo::ENotFound );
+
+		// the detected marker is refined, but there is nothing to find
+		BOOST_CHECK_EQUAL( infos[ 0x272 ].corners.size(), 4u );
+		BOOST_CHECK( infos[ 0x272 ].found != MarkerInfo::ERefinementFound );
+	}
+
+}	// anonymous namespace
+
+void TestMarkerRefinement()
+{
+	checkRefineOnly( false );
+	checkRefineOnly( true );
+}
+
+#else
+
+void TestMarkerRefinement()
+{
+	BOOST_CHECK( true );
+}
+
+#endif
@@ -0,0 +1,66 @@
+// std
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+// Boost
+#include <boost/test/unit_test.hpp>
+
+// Ubitrack
+#include <utVision/Image.h>
+#include <utVision/QuadrangleExtractor.h>
+
+namespace {
+
+using namespace Ubitrack::Vision;
+using namespace Ubitrack::Vision::Markers;
+
+	/// checks if all corners of a quadrangle lie within a distance of a rectangle's border
+	bool isNear( const CornerList& quad, const cv::Rect& rect, float fMaxDistance )
+	{
+		for ( CornerList::const_iterator it = quad.begin(); it != quad.end(); it++ )
+		{
+			const float dx = std::min( fabsf( ( *it )( 0 ) - rect.x ), fabsf( ( *it )( 0 ) - ( rect.x + rect.width ) ) );
+			const float dy = std::min( fabsf( ( *it )( 1 ) - rect.y ), fabsf( ( *it )( 1 ) - ( rect.y + rect.height ) ) );
+			if ( dx > fMaxDistance || dy > fMaxDistance )
+				return false;
+		}
+		return true;
+	}
+
+	/// extracts the quadrangles of an image within the regions of interest
+	MarkerList extract( Image& img, const std::vector< cv::Rect >& rois )
+	{
+		QuadrangleExtractor extractor;
+		extractor.setBinaryThreshold( 120 );
+		extractor.setRegionsOfInterest( rois );
+
+		MarkerList quadrangles;
+		extractor.extract( img, quadrangles );
+		return quadrangles;
+	}
+
+}	// anonymous namespace
+
+void TestQuadrangleExtractor()
+{
+	// a dark square on a bright background
+	Image img( 320, 240, 1, CV_8U );
+	img.Mat().setTo( 200 );
+	const cv::Rect square( 130, 90, 60, 60 );
+	img.Mat()( square ).setTo( 0 );
+
+	// whole image
+	MarkerList quadrangles( extract( img, std::vector< cv::Rect >() ) );
+	BOOST_REQUIRE_EQUAL( quadrangles.size(), 1u );
+	BOOST_CHECK( isNear( quadrangles[ 0 ], square, 2.0f ) );
+
+	// region around the square, the background cut off by the region is no quadrangle
+	quadrangles = extract( img, std::vector< cv::Rect >( 1, cv::Rect( 100, 60, 120, 120 ) ) );
+	BOOST_REQUIRE_EQUAL( quadrangles.size(), 1u );
+	BOOST_CHECK( isNear( quadrangles[ 0 ], square, 2.0f ) );
+
+	// region that cuts off the square
+	quadrangles = extract( img, std::vector< cv::Rect >( 1, cv::Rect( 160, 60, 100, 120 ) ) );
+	BOOST_CHECK( quadrangles.empty() );
+}
@@ -2,11 +2,23 @@
 
 // declare external tests here, to save us some trivial header files
 void TestPointUndistorion();
+void TestUndistortionPoints();
+void TestMarkerDictionary();
+void TestMarkerRefinement();
+void TestMarkerMotionModel();
+void TestMarkerCovariance();
+void TestQuadrangleExtractor();
 
 
 VisionTest::VisionTest()
 	: boost::unit_test::test_suite( "VisionTests" )
 {
 	add( BOOST_TEST_CASE( &TestPointUndistorion ) );	
+	add( BOOST_TEST_CASE( &TestUndistortionPoints ) );
+	add( BOOST_TEST_CASE( &TestMarkerDictionary ) );
+	add( BOOST_TEST_CASE( &TestMarkerRefinement ) );
+	add( BOOST_TEST_CASE( &TestMarkerMotionModel ) );
+	add( BOOST_TEST_CASE( &TestMarkerCovariance ) );
+	add( BOOST_TEST_CASE( &TestQuadrangleExtractor ) );
 }
 